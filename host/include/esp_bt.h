@@ -0,0 +1,34 @@
+/*
+ * Host build: the controller of ESP-IDF 4.4, only its state is kept, see
+ * mock/bt.c.
+ */
+#pragma once
+
+#include "esp_bt_defs.h"
+
+typedef enum {
+    ESP_BT_MODE_IDLE = 0,
+    ESP_BT_MODE_BLE,
+    ESP_BT_MODE_CLASSIC_BT,
+    ESP_BT_MODE_BTDM,
+} esp_bt_mode_t;
+
+typedef enum {
+    ESP_BT_CONTROLLER_STATUS_IDLE = 0,
+    ESP_BT_CONTROLLER_STATUS_INITED,
+    ESP_BT_CONTROLLER_STATUS_ENABLED,
+    ESP_BT_CONTROLLER_STATUS_NUM,
+} esp_bt_controller_status_t;
+
+typedef struct {
+    uint8_t mode;
+} esp_bt_controller_config_t;
+
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() { .mode = ESP_BT_MODE_BTDM }
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode);
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg);
+esp_err_t esp_bt_controller_deinit(void);
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode);
+esp_err_t esp_bt_controller_disable(void);
+esp_bt_controller_status_t esp_bt_controller_get_status(void);
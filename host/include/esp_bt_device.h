@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_bt_defs.h"
+
+const uint8_t *esp_bt_dev_get_address(void);
+esp_err_t esp_bt_dev_set_device_name(const char *name);
@@ -0,0 +1,127 @@
+/*
+ * Host build: the Classic Bluetooth GAP API of ESP-IDF 4.4, with the
+ * events and parameters the modules use. Values as in ESP-IDF.
+ */
+#pragma once
+
+#include "esp_bt_defs.h"
+
+#define ESP_BT_GAP_MAX_BDNAME_LEN 248
+#define ESP_BT_GAP_EIR_DATA_LEN   240
+
+typedef enum {
+    ESP_BT_NON_CONNECTABLE,
+    ESP_BT_CONNECTABLE,
+} esp_bt_connection_mode_t;
+
+typedef enum {
+    ESP_BT_NON_DISCOVERABLE,
+    ESP_BT_LIMITED_DISCOVERABLE,
+    ESP_BT_GENERAL_DISCOVERABLE,
+} esp_bt_discovery_mode_t;
+
+typedef enum {
+    ESP_BT_INQ_MODE_GENERAL_INQUIRY,
+    ESP_BT_INQ_MODE_LIMITED_INQUIRY,
+} esp_bt_inq_mode_t;
+
+typedef enum {
+    ESP_BT_PIN_TYPE_VARIABLE = 0,
+    ESP_BT_PIN_TYPE_FIXED = 1,
+} esp_bt_pin_type_t;
+
+#define ESP_BT_PIN_CODE_LEN 16
+typedef uint8_t esp_bt_pin_code_t[ESP_BT_PIN_CODE_LEN];
+
+typedef enum {
+    ESP_BT_EIR_TYPE_FLAGS = 0x01,
+    ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME = 0x08,
+    ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME = 0x09,
+} esp_bt_eir_type_t;
+
+typedef enum {
+    ESP_BT_GAP_DEV_PROP_BDNAME = 1,
+    ESP_BT_GAP_DEV_PROP_COD,
+    ESP_BT_GAP_DEV_PROP_RSSI,
+    ESP_BT_GAP_DEV_PROP_EIR,
+} esp_bt_gap_dev_prop_type_t;
+
+typedef struct {
+    esp_bt_gap_dev_prop_type_t type;
+    int len;
+    void *val;
+} esp_bt_gap_dev_prop_t;
+
+typedef enum {
+    ESP_BT_GAP_DISCOVERY_STOPPED,
+    ESP_BT_GAP_DISCOVERY_STARTED,
+} esp_bt_gap_discovery_state_t;
+
+typedef enum {
+    ESP_BT_GAP_DISC_RES_EVT = 0,
+    ESP_BT_GAP_DISC_STATE_CHANGED_EVT,
+    ESP_BT_GAP_RMT_SRVCS_EVT,
+    ESP_BT_GAP_RMT_SRVC_REC_EVT,
+    ESP_BT_GAP_AUTH_CMPL_EVT,
+    ESP_BT_GAP_PIN_REQ_EVT,
+    ESP_BT_GAP_CFM_REQ_EVT,
+    ESP_BT_GAP_KEY_NOTIF_EVT,
+    ESP_BT_GAP_KEY_REQ_EVT,
+    ESP_BT_GAP_READ_RSSI_DELTA_EVT,
+    ESP_BT_GAP_CONFIG_EIR_DATA_EVT,
+    ESP_BT_GAP_SET_AFH_CHANNELS_EVT,
+    ESP_BT_GAP_READ_REMOTE_NAME_EVT,
+    ESP_BT_GAP_MODE_CHG_EVT,
+    ESP_BT_GAP_REMOVE_BOND_DEV_COMPLETE_EVT,
+    ESP_BT_GAP_QOS_CMPL_EVT,
+    ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT,
+    ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT,
+    ESP_BT_GAP_EVT_MAX,
+} esp_bt_gap_cb_event_t;
+
+typedef union {
+    struct disc_res_param {
+        esp_bd_addr_t bda;
+        int num_prop;
+        esp_bt_gap_dev_prop_t *prop;
+    } disc_res;
+    struct disc_state_changed_param {
+        esp_bt_gap_discovery_state_t state;
+    } disc_st_chg;
+    struct auth_cmpl_param {
+        esp_bd_addr_t bda;
+        esp_bt_status_t stat;
+        uint8_t device_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+    } auth_cmpl;
+    struct pin_req_param {
+        esp_bd_addr_t bda;
+        bool min_16_digit;
+    } pin_req;
+    struct bt_remove_bond_dev_cmpl_evt_param {
+        esp_bd_addr_t bda;
+        esp_bt_status_t status;
+    } remove_bond_dev_cmpl;
+    struct acl_conn_cmpl_stat_param {
+        esp_bt_status_t stat;
+        uint16_t handle;
+        esp_bd_addr_t bda;
+    } acl_conn_cmpl_stat;
+    struct acl_disconn_cmpl_stat_param {
+        esp_bt_status_t reason;
+        uint16_t handle;
+        esp_bd_addr_t bda;
+    } acl_disconn_cmpl_stat;
+} esp_bt_gap_cb_param_t;
+
+typedef void (*esp_bt_gap_cb_t)(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param);
+
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback);
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t c_mode, esp_bt_discovery_mode_t d_mode);
+esp_err_t esp_bt_gap_start_discovery(esp_bt_inq_mode_t mode, uint8_t inq_len, uint8_t num_rsps);
+esp_err_t esp_bt_gap_cancel_discovery(void);
+uint8_t *esp_bt_gap_resolve_eir_data(uint8_t *eir, esp_bt_eir_type_t type, uint8_t *length);
+esp_err_t esp_bt_gap_set_pin(esp_bt_pin_type_t pin_type, uint8_t pin_code_len, esp_bt_pin_code_t pin_code);
+esp_err_t esp_bt_gap_pin_reply(esp_bd_addr_t bd_addr, bool accept, uint8_t pin_code_len, esp_bt_pin_code_t pin_code);
+int esp_bt_gap_get_bond_device_num(void);
+esp_err_t esp_bt_gap_get_bond_device_list(int *dev_num, esp_bd_addr_t *dev_list);
+esp_err_t esp_bt_gap_remove_bond_device(esp_bd_addr_t bd_addr);
@@ -0,0 +1,17 @@
+/*
+ * Host build: log lines go to stderr when BT_SPP_MOCK_LOG is set in the
+ * environment, see mock_log_on().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+int mock_log_on(void);
+
+#define ESP_LOGE(tag, fmt, ...) do { if (mock_log_on()) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGW(tag, fmt, ...) do { if (mock_log_on()) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { if (mock_log_on()) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+
+void esp_log_buffer_hex(const char *tag, const void *buffer, uint16_t buff_len);
+void esp_log_buffer_char(const char *tag, const void *buffer, uint16_t buff_len);
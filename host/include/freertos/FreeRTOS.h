@@ -0,0 +1,41 @@
+/*
+ * Host build: FreeRTOS on pthreads, see mock/rtos.c. A tick is a
+ * millisecond. portMUX_TYPE is a recursive mutex, like the ESP-IDF
+ * spinlock it nests on the same task.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  0
+#define pdPASS  1
+
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY      ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms)  ((TickType_t) (ms))
+
+typedef struct {
+    pthread_mutex_t m;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux)      vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)       vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux)  vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux)   vPortExitCritical(mux)
+#define portENTER_CRITICAL_SAFE(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_SAFE(mux)  vPortExitCritical(mux)
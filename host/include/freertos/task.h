@@ -0,0 +1,6 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(const TickType_t xTicksToDelay);
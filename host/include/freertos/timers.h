@@ -0,0 +1,19 @@
+/*
+ * Host build: software timers, the callbacks run on one timer thread as
+ * they do on the FreeRTOS timer task.
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tmr_def *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t xTimer);
+
+TimerHandle_t xTimerCreate(const char *pcTimerName, const TickType_t xTimerPeriodInTicks,
+    const UBaseType_t uxAutoReload, void *pvTimerID, TimerCallbackFunction_t pxCallbackFunction);
+BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait);
+BaseType_t xTimerReset(TimerHandle_t xTimer, TickType_t xTicksToWait);
+BaseType_t xTimerStop(TimerHandle_t xTimer, TickType_t xTicksToWait);
+BaseType_t xTimerChangePeriod(TimerHandle_t xTimer, TickType_t xNewPeriod, TickType_t xTicksToWait);
+BaseType_t xTimerIsTimerActive(TimerHandle_t xTimer);
+void *pvTimerGetTimerID(TimerHandle_t xTimer);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef unsigned char byte;
+
+#define MP_ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* no GC on the host, objects come from malloc and are never freed */
+#define m_new(type, num) ((type *) m_malloc(sizeof(type) * (num)))
+#define m_new_obj(type) (m_new(type, 1))
+#define m_del(type, ptr, num) free(ptr)
+
+void *m_malloc(size_t num_bytes);
+
+typedef struct _vstr_t {
+    size_t alloc;
+    size_t len;
+    char *buf;
+    bool fixed_buf;
+} vstr_t;
+
+void vstr_init(vstr_t *vstr, size_t alloc);
+void vstr_init_len(vstr_t *vstr, size_t len);
+void vstr_clear(vstr_t *vstr);
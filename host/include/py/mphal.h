@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+#include "py/obj.h"
+
+mp_uint_t mp_hal_ticks_ms(void);
+mp_uint_t mp_hal_ticks_us(void);
+mp_uint_t mp_hal_ticks_cpu(void);
+void mp_hal_delay_ms(mp_uint_t ms);
@@ -0,0 +1,13 @@
+/* Host build: the root pointers the modules register */
+#pragma once
+
+#include "py/obj.h"
+
+typedef struct _mp_state_port_t {
+    mp_obj_t bts_irq_handler;
+    mp_obj_t btm_irq_handler;
+} mp_state_port_t;
+
+extern mp_state_port_t mp_state_port;
+
+#define MP_STATE_PORT(x) (mp_state_port.x)
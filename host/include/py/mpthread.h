@@ -0,0 +1,8 @@
+/*
+ * Host build: one thread runs MicroPython, so there is no GIL to give up.
+ * The Bluetooth and timer threads never touch Python objects.
+ */
+#pragma once
+
+#define MP_THREAD_GIL_ENTER()
+#define MP_THREAD_GIL_EXIT()
@@ -0,0 +1,27 @@
+/*
+ * Host build: non-local return on setjmp, as the setjmp variant of
+ * MicroPython's nlr does it.
+ *
+ *     nlr_buf_t nlr;
+ *     if (nlr_push(&nlr) == 0) {
+ *         ... may raise ...
+ *         nlr_pop();
+ *     } else {
+ *         ... nlr.ret_val is the exception ...
+ *     }
+ */
+#pragma once
+
+#include <setjmp.h>
+
+typedef struct _nlr_buf_t {
+    struct _nlr_buf_t *prev;
+    void *ret_val;
+    jmp_buf jmpbuf;
+} nlr_buf_t;
+
+void nlr_push_tail(nlr_buf_t *top);
+void nlr_pop(void);
+__attribute__((noreturn)) void nlr_jump(void *val);
+
+#define nlr_push(buf) (nlr_push_tail(buf), setjmp((buf)->jmpbuf))
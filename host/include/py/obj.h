@@ -0,0 +1,272 @@
+/*
+ * Host build: the object model of MicroPython 1.20, cut down to what the
+ * modules and the tests use. Small ints and qstrs are tagged in the
+ * pointer as in representation A, everything else is a struct that
+ * starts with its type.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "py/misc.h"
+#include "py/qstr.h"
+
+#define STATIC static
+#define NORETURN __attribute__((noreturn))
+
+typedef void *mp_obj_t;
+typedef const void *mp_const_obj_t;
+typedef const void *mp_rom_obj_t;
+typedef intptr_t mp_int_t;
+typedef uintptr_t mp_uint_t;
+
+typedef struct _mp_obj_type_t mp_obj_type_t;
+
+typedef struct _mp_obj_base_t {
+    const mp_obj_type_t *type;
+} mp_obj_base_t;
+
+#define MP_OBJ_NULL (MP_OBJ_FROM_PTR(NULL))
+
+#define MP_OBJ_FROM_PTR(p) ((mp_obj_t) (p))
+#define MP_OBJ_TO_PTR(o) ((void *) (o))
+
+#define MP_OBJ_IS_SMALL_INT(o) ((((mp_int_t) (o)) & 1) != 0)
+#define MP_OBJ_SMALL_INT_VALUE(o) (((mp_int_t) (o)) >> 1)
+#define MP_OBJ_NEW_SMALL_INT(small_int) ((mp_obj_t) ((((mp_uint_t) (small_int)) << 1) | 1))
+
+#define MP_OBJ_IS_QSTR(o) ((((mp_int_t) (o)) & 7) == 2)
+#define MP_OBJ_QSTR_VALUE(o) (((mp_uint_t) (o)) >> 3)
+#define MP_OBJ_NEW_QSTR(qst) ((mp_obj_t) ((((mp_uint_t) (qst)) << 3) | 2))
+
+#define MP_ROM_INT(i) MP_OBJ_NEW_SMALL_INT(i)
+#define MP_ROM_QSTR(q) MP_OBJ_NEW_QSTR(q)
+#define MP_ROM_PTR(p) (p)
+#define MP_ROM_NONE mp_const_none
+
+extern const mp_obj_base_t mp_const_none_obj;
+extern const mp_obj_base_t mp_const_false_obj;
+extern const mp_obj_base_t mp_const_true_obj;
+
+#define mp_const_none (MP_OBJ_FROM_PTR((void *) &mp_const_none_obj))
+#define mp_const_false (MP_OBJ_FROM_PTR((void *) &mp_const_false_obj))
+#define mp_const_true (MP_OBJ_FROM_PTR((void *) &mp_const_true_obj))
+
+/* maps and dicts */
+
+typedef struct _mp_map_elem_t {
+    mp_obj_t key;
+    mp_obj_t value;
+} mp_map_elem_t;
+
+typedef struct _mp_rom_map_elem_t {
+    mp_rom_obj_t key;
+    mp_rom_obj_t value;
+} mp_rom_map_elem_t;
+
+typedef struct _mp_map_t {
+    size_t used;
+    size_t alloc;
+    mp_map_elem_t *table;
+} mp_map_t;
+
+typedef struct _mp_obj_dict_t {
+    mp_obj_base_t base;
+    mp_map_t map;
+} mp_obj_dict_t;
+
+#define MP_DEFINE_CONST_DICT(dict_name, table_name) \
+    const mp_obj_dict_t dict_name = { \
+        .base = { &mp_type_dict }, \
+        .map = { \
+            .used = MP_ARRAY_SIZE(table_name), \
+            .alloc = MP_ARRAY_SIZE(table_name), \
+            .table = (mp_map_elem_t *) (mp_rom_map_elem_t *) table_name, \
+        }, \
+    }
+
+typedef struct _mp_obj_module_t {
+    mp_obj_base_t base;
+    mp_obj_dict_t *globals;
+} mp_obj_module_t;
+
+/* the port registers modules and root pointers by scanning for these */
+#define MP_REGISTER_MODULE(module_name, obj_module) extern const mp_obj_module_t obj_module
+#define MP_REGISTER_ROOT_POINTER(entry) extern mp_state_port_t mp_state_port
+
+/* builtin functions, the type tells how many arguments they take */
+
+typedef struct _mp_obj_fun_builtin_t {
+    mp_obj_base_t base;
+    uint16_t n_args_min;
+    uint16_t n_args_max;
+    union {
+        mp_obj_t (*_0)(void);
+        mp_obj_t (*_1)(mp_obj_t);
+        mp_obj_t (*_2)(mp_obj_t, mp_obj_t);
+        mp_obj_t (*_3)(mp_obj_t, mp_obj_t, mp_obj_t);
+        mp_obj_t (*var)(size_t, const mp_obj_t *);
+        mp_obj_t (*kw)(size_t, const mp_obj_t *, mp_map_t *);
+    } fun;
+} mp_obj_fun_builtin_t;
+
+#define MP_OBJ_FUN_ARGS_MAX 0xffff
+
+#define MP_DEFINE_CONST_FUN_OBJ_0(obj_name, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_0 }, 0, 0, { ._0 = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_1(obj_name, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_1 }, 1, 1, { ._1 = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_2(obj_name, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_2 }, 2, 2, { ._2 = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_3(obj_name, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_3 }, 3, 3, { ._3 = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_VAR(obj_name, n_args_min, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_var }, n_args_min, MP_OBJ_FUN_ARGS_MAX, { .var = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(obj_name, n_args_min, n_args_max, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_var }, n_args_min, n_args_max, { .var = fun_name } }
+#define MP_DEFINE_CONST_FUN_OBJ_KW(obj_name, n_args_min, fun_name) \
+    const mp_obj_fun_builtin_t obj_name = { { &mp_type_fun_builtin_kw }, n_args_min, MP_OBJ_FUN_ARGS_MAX, { .kw = fun_name } }
+
+/* types, MP_DEFINE_CONST_OBJ_TYPE takes slot, value pairs as in 1.20 */
+
+#define MP_TYPE_FLAG_NONE           0x0000
+#define MP_TYPE_FLAG_ITER_IS_STREAM 0x0100
+
+struct _mp_obj_type_t {
+    mp_obj_base_t base;
+    uint16_t flags;
+    uint16_t name;
+    const void *make_new;
+    const void *print;
+    const void *call;
+    const void *unary_op;
+    const void *binary_op;
+    const void *attr;
+    const void *subscr;
+    const void *iter;
+    const void *buffer;
+    const void *protocol;
+    const void *parent;
+    const mp_obj_dict_t *locals_dict;
+};
+
+#define MP_TYPE_SLOTS_2(s1, v1) .s1 = v1,
+#define MP_TYPE_SLOTS_4(s1, v1, ...) .s1 = v1, MP_TYPE_SLOTS_2(__VA_ARGS__)
+#define MP_TYPE_SLOTS_6(s1, v1, ...) .s1 = v1, MP_TYPE_SLOTS_4(__VA_ARGS__)
+#define MP_TYPE_SLOTS_8(s1, v1, ...) .s1 = v1, MP_TYPE_SLOTS_6(__VA_ARGS__)
+#define MP_TYPE_SLOTS_10(s1, v1, ...) .s1 = v1, MP_TYPE_SLOTS_8(__VA_ARGS__)
+#define MP_TYPE_SLOTS_12(s1, v1, ...) .s1 = v1, MP_TYPE_SLOTS_10(__VA_ARGS__)
+#define MP_TYPE_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, n, ...) n
+#define MP_TYPE_NARGS(...) MP_TYPE_NARGS_(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define MP_TYPE_CAT_(a, b) a##b
+#define MP_TYPE_CAT(a, b) MP_TYPE_CAT_(a, b)
+
+#define MP_DEFINE_CONST_OBJ_TYPE(_typename, _name, _flags, ...) \
+    const mp_obj_type_t _typename = { \
+        .base = { &mp_type_type }, \
+        .flags = _flags, \
+        .name = _name, \
+        MP_TYPE_CAT(MP_TYPE_SLOTS_, MP_TYPE_NARGS(__VA_ARGS__))(__VA_ARGS__) \
+    }
+
+extern const mp_obj_type_t mp_type_type;
+extern const mp_obj_type_t mp_type_NoneType;
+extern const mp_obj_type_t mp_type_bool;
+extern const mp_obj_type_t mp_type_int;
+extern const mp_obj_type_t mp_type_str;
+extern const mp_obj_type_t mp_type_bytes;
+extern const mp_obj_type_t mp_type_bytearray;
+extern const mp_obj_type_t mp_type_tuple;
+extern const mp_obj_type_t mp_type_list;
+extern const mp_obj_type_t mp_type_dict;
+extern const mp_obj_type_t mp_type_module;
+extern const mp_obj_type_t mp_type_fun_builtin_0;
+extern const mp_obj_type_t mp_type_fun_builtin_1;
+extern const mp_obj_type_t mp_type_fun_builtin_2;
+extern const mp_obj_type_t mp_type_fun_builtin_3;
+extern const mp_obj_type_t mp_type_fun_builtin_var;
+extern const mp_obj_type_t mp_type_fun_builtin_kw;
+extern const mp_obj_type_t mp_type_BaseException;
+extern const mp_obj_type_t mp_type_MemoryError;
+extern const mp_obj_type_t mp_type_OSError;
+extern const mp_obj_type_t mp_type_RuntimeError;
+extern const mp_obj_type_t mp_type_TypeError;
+extern const mp_obj_type_t mp_type_ValueError;
+
+/* the concrete objects, the tests look inside them */
+
+typedef struct _mp_obj_str_t {
+    mp_obj_base_t base;
+    size_t len;
+    const byte *data;
+} mp_obj_str_t;
+
+typedef struct _mp_obj_array_t {
+    mp_obj_base_t base;
+    size_t len;
+    byte *items;
+} mp_obj_array_t;
+
+typedef struct _mp_obj_tuple_t {
+    mp_obj_base_t base;
+    size_t len;
+    mp_obj_t items[];
+} mp_obj_tuple_t;
+
+typedef struct _mp_obj_list_t {
+    mp_obj_base_t base;
+    size_t alloc;
+    size_t len;
+    mp_obj_t *items;
+} mp_obj_list_t;
+
+typedef struct _mp_obj_exception_t {
+    mp_obj_base_t base;
+    int errno_;    /* OSError only, 0 otherwise */
+    char msg[160];
+} mp_obj_exception_t;
+
+typedef struct _mp_buffer_info_t {
+    void *buf;
+    size_t len;
+    int typecode;
+} mp_buffer_info_t;
+
+#define MP_BUFFER_READ  (1)
+#define MP_BUFFER_WRITE (2)
+#define MP_BUFFER_RW (MP_BUFFER_READ | MP_BUFFER_WRITE)
+
+const mp_obj_type_t *mp_obj_get_type(mp_const_obj_t o_in);
+#define mp_obj_is_type(o, t) (mp_obj_get_type(o) == (t))
+bool mp_obj_is_str(mp_const_obj_t o);
+bool mp_obj_is_true(mp_obj_t arg);
+bool mp_obj_is_callable(mp_obj_t o_in);
+bool mp_obj_equal(mp_obj_t o1, mp_obj_t o2);
+
+mp_int_t mp_obj_get_int(mp_const_obj_t arg);
+mp_obj_t mp_obj_new_int(mp_int_t value);
+mp_obj_t mp_obj_new_int_from_uint(mp_uint_t value);
+mp_obj_t mp_obj_new_int_from_ll(long long val);
+mp_obj_t mp_obj_new_int_from_ull(unsigned long long val);
+static inline mp_obj_t mp_obj_new_bool(mp_int_t x) {
+    return x ? mp_const_true : mp_const_false;
+}
+
+mp_obj_t mp_obj_new_str(const char *data, size_t len);
+mp_obj_t mp_obj_new_bytes(const byte *data, size_t len);
+mp_obj_t mp_obj_new_bytearray(size_t n, const void *items);
+mp_obj_t mp_obj_new_str_from_vstr(const mp_obj_type_t *type, vstr_t *vstr);
+const char *mp_obj_str_get_str(mp_obj_t self_in);
+const char *mp_obj_str_get_data(mp_obj_t self_in, size_t *len);
+
+mp_obj_t mp_obj_new_tuple(size_t n, const mp_obj_t *items);
+mp_obj_t mp_obj_new_list(size_t n, mp_obj_t *items);
+mp_obj_t mp_obj_list_append(mp_obj_t self_in, mp_obj_t arg);
+void mp_obj_get_array(mp_obj_t o, size_t *len, mp_obj_t **items);
+mp_obj_t mp_obj_new_dict(size_t n_args);
+mp_obj_t mp_obj_dict_store(mp_obj_t self_in, mp_obj_t key, mp_obj_t value);
+mp_obj_t mp_obj_dict_get(mp_obj_t self_in, mp_obj_t index);
+
+bool mp_get_buffer(mp_obj_t obj, mp_buffer_info_t *bufinfo, mp_uint_t flags);
+void mp_get_buffer_raise(mp_obj_t obj, mp_buffer_info_t *bufinfo, mp_uint_t flags);
@@ -0,0 +1,20 @@
+/*
+ * Host build: qstrs are an enum over the MP_QSTR_ names found in the
+ * sources, genhdr/qstrdefs.generated.h is made by the Makefile.
+ */
+#pragma once
+
+#include <stddef.h>
+
+enum {
+    MP_QSTRnull,
+#define QDEF(id, str) id,
+#include "genhdr/qstrdefs.generated.h"
+#undef QDEF
+    MP_QSTRnumber_of,
+};
+
+typedef size_t qstr;
+
+const char *qstr_str(qstr q);
+qstr qstr_find_strn(const char *str, size_t str_len); /* MP_QSTRnull if it is not one */
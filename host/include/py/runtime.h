@@ -0,0 +1,47 @@
+#pragma once
+
+#include "py/obj.h"
+#include "py/mpstate.h"
+#include "py/mpthread.h"
+#include "py/nlr.h"
+
+typedef const char *mp_rom_error_text_t;
+#define MP_ERROR_TEXT(x) (x)
+
+typedef enum {
+    MP_ARG_BOOL      = 0x001,
+    MP_ARG_INT       = 0x002,
+    MP_ARG_OBJ       = 0x003,
+    MP_ARG_KIND_MASK = 0x0ff,
+    MP_ARG_REQUIRED  = 0x100,
+    MP_ARG_KW_ONLY   = 0x200,
+} mp_arg_flag_t;
+
+typedef union _mp_arg_val_t {
+    bool u_bool;
+    mp_int_t u_int;
+    mp_obj_t u_obj;
+    mp_rom_obj_t u_rom_obj;
+} mp_arg_val_t;
+
+typedef struct _mp_arg_t {
+    uint16_t qst;
+    uint16_t flags;
+    mp_arg_val_t defval;
+} mp_arg_t;
+
+void mp_arg_parse_all(size_t n_pos, const mp_obj_t *pos, mp_map_t *kws, size_t n_allowed,
+    const mp_arg_t *allowed, mp_arg_val_t *out_vals);
+
+NORETURN void mp_raise_msg(const mp_obj_type_t *exc_type, mp_rom_error_text_t msg);
+NORETURN void mp_raise_msg_varg(const mp_obj_type_t *exc_type, mp_rom_error_text_t fmt, ...);
+NORETURN void mp_raise_ValueError(mp_rom_error_text_t msg);
+NORETURN void mp_raise_TypeError(mp_rom_error_text_t msg);
+NORETURN void mp_raise_OSError(int errno_);
+
+mp_obj_t mp_call_function_0(mp_obj_t fun);
+mp_obj_t mp_call_function_1(mp_obj_t fun, mp_obj_t arg);
+mp_obj_t mp_call_function_n_kw(mp_obj_t fun, size_t n_args, size_t n_kw, const mp_obj_t *args);
+
+bool mp_sched_schedule(mp_obj_t function, mp_obj_t arg);
+void mp_handle_pending(bool raise_exc);
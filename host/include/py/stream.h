@@ -0,0 +1,32 @@
+#pragma once
+
+#include "py/obj.h"
+
+#define MP_STREAM_ERROR ((mp_uint_t) -1)
+
+#define MP_STREAM_FLUSH 1
+#define MP_STREAM_SEEK  2
+#define MP_STREAM_POLL  3
+#define MP_STREAM_CLOSE 4
+
+#define MP_STREAM_POLL_RD   0x0001
+#define MP_STREAM_POLL_WR   0x0004
+#define MP_STREAM_POLL_ERR  0x0008
+#define MP_STREAM_POLL_HUP  0x0010
+#define MP_STREAM_POLL_NVAL 0x0020
+
+typedef struct _mp_stream_p_t {
+    mp_uint_t (*read)(mp_obj_t obj, void *buf, mp_uint_t size, int *errcode);
+    mp_uint_t (*write)(mp_obj_t obj, const void *buf, mp_uint_t size, int *errcode);
+    mp_uint_t (*ioctl)(mp_obj_t obj, mp_uint_t request, uintptr_t arg, int *errcode);
+    mp_uint_t is_text : 1;
+} mp_stream_p_t;
+
+extern const mp_obj_fun_builtin_t mp_stream_read_obj;
+extern const mp_obj_fun_builtin_t mp_stream_readinto_obj;
+extern const mp_obj_fun_builtin_t mp_stream_unbuffered_readline_obj;
+extern const mp_obj_fun_builtin_t mp_stream_write_obj;
+extern const mp_obj_fun_builtin_t mp_stream_flush_obj;
+extern const mp_obj_fun_builtin_t mp_stream_close_obj;
+extern const mp_obj_fun_builtin_t mp_stream___exit___obj;
+extern const mp_obj_fun_builtin_t mp_identity_obj;
@@ -0,0 +1,413 @@
+/*
+ * Loopback run of bts and btm against the host mocks. Each goes through
+ * the life of a link as the stack reports it on the ESP32: connect, data
+ * both ways, congestion on and off, close and deinit.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "py/mperrno.h"
+#include "mock/mock.h"
+
+#define SLAVE_ADDR  "aa:bb:cc:00:00:01"
+#define MASTER_ADDR "aa:bb:cc:00:00:02"
+#define OTHER_ADDR  "aa:bb:cc:00:00:03"
+#define SLOW_ADDR   "aa:bb:cc:00:00:04"
+#define LATE_ADDR   "aa:bb:cc:00:00:05"
+#define TX_LEN 3000 /* more than one MTU, less than the transmit queue holds */
+
+#define I(n) MP_OBJ_NEW_SMALL_INT(n)
+#define CALL(m, name, ...) ({ \
+        mp_obj_t _a[] = { __VA_ARGS__ }; \
+        mock_call(&m, name, MP_ARRAY_SIZE(_a), 0, _a); \
+    })
+#define CALL0(m, name) mock_call(&m, name, 0, 0, NULL)
+
+static uint8_t tx[TX_LEN];
+static uint8_t rx[2 * TX_LEN];
+
+static mp_int_t stat(const mp_obj_module_t *m, const char *key) {
+    return mock_dict_int(mock_call(m, "stats", 0, 0, NULL), key);
+}
+
+/* send TX_LEN bytes to the remote and check that they come out whole */
+static void check_send(const mp_obj_module_t *m, mock_peer_t *peer) {
+    mp_obj_t a[] = { mock_bytes(tx, TX_LEN) };
+    mp_obj_t ret = mock_call(m, "send_bin", 1, 0, a);
+    CHECK(ret != MP_OBJ_NULL && mp_obj_get_int(ret) == TX_LEN);
+    mock_settle();
+    CHECK(mock_peer_recv(peer, rx, sizeof(rx)) == TX_LEN);
+    CHECK(memcmp(rx, tx, TX_LEN) == 0);
+}
+
+/* a congested link takes nothing until ESP_SPP_CONG_EVT clears it */
+static void check_cong(const mp_obj_module_t *m, mock_peer_t *peer) {
+    mock_peer_cong(peer, true);
+    mock_settle();
+    mp_obj_t a[] = { mock_bytes(tx, TX_LEN) };
+    mp_obj_t ret = mock_call(m, "send_bin", 1, 0, a);
+    CHECK(ret != MP_OBJ_NULL && mp_obj_get_int(ret) == TX_LEN);
+    mock_settle();
+    CHECK(mock_peer_recv(peer, rx, sizeof(rx)) == 0);
+    mock_peer_cong(peer, false);
+    mock_settle();
+    CHECK(mock_peer_recv(peer, rx, sizeof(rx)) == TX_LEN);
+    CHECK(memcmp(rx, tx, TX_LEN) == 0);
+    CHECK(stat(m, "cong_on") == 1);
+    CHECK(stat(m, "cong_off") == 1);
+}
+
+/* a failed write is tried again; a frame that fails TX_TRIES times is given up */
+static void check_fail(const mp_obj_module_t *m, mock_peer_t *peer) {
+    mp_obj_t a[] = { mock_bytes(tx, TX_LEN) };
+    mock_write_fail(2);
+    CHECK(mp_obj_get_int(mock_call(m, "send_bin", 1, 0, a)) == TX_LEN);
+    mock_settle();
+    CHECK(mock_peer_recv(peer, rx, sizeof(rx)) == TX_LEN);
+    CHECK(memcmp(rx, tx, TX_LEN) == 0);
+    CHECK(stat(m, "tx_failed") == 2);
+    mock_write_fail(3);
+    CHECK(mp_obj_get_int(mock_call(m, "send_bin", 1, 0, a)) == TX_LEN);
+    mock_settle();
+    CHECK(mock_peer_recv(peer, rx, sizeof(rx)) == TX_LEN - ESP_SPP_MAX_MTU);
+    CHECK(memcmp(rx, tx + ESP_SPP_MAX_MTU, TX_LEN - ESP_SPP_MAX_MTU) == 0);
+    CHECK(stat(m, "tx_failed") == 5);
+}
+
+static void test_bts(void) {
+    mock_bt_reset();
+    CHECK(CALL(mp_module_bts, "init", mock_str("ESP32_SPP"), mock_str("1234")) == mp_const_true);
+    mock_settle();
+    CHECK(mock_discoverable());
+    CHECK(mock_eq(CALL0(mp_module_bts, "state"), "discoverable", 12));
+
+    // a master with the wrong PIN is turned away
+    mock_peer_t *other = mock_peer_add(OTHER_ADDR, "intruder", 0, "");
+    CHECK(mock_peer_connect(other, "9999") == false);
+    mock_settle();
+    CHECK(CALL0(mp_module_bts, "ready") == mp_const_false);
+    CHECK(mock_eq(CALL0(mp_module_bts, "state"), "discoverable", 12));
+    CHECK(stat(&mp_module_bts, "auth_failed") == 1);
+
+    // a master does not take the slot another one is pairing in
+    esp_bt_gap_cb_param_t g = { 0 };
+    g.acl_conn_cmpl_stat.stat = ESP_BT_STATUS_SUCCESS;
+    mock_addr(OTHER_ADDR, g.acl_conn_cmpl_stat.bda);
+    mock_post_gap(ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT, &g, 0);
+    esp_spp_cb_param_t o = { 0 };
+    o.srv_open.status = ESP_SPP_SUCCESS;
+    o.srv_open.handle = 0x99;
+    mock_addr(MASTER_ADDR, o.srv_open.rem_bda);
+    mock_post_spp(ESP_SPP_SRV_OPEN_EVT, &o, 1);
+    mock_settle();
+    CHECK(CALL0(mp_module_bts, "ready") == mp_const_false);
+    CHECK(stat(&mp_module_bts, "connects") == 0);
+    memset(&g, 0, sizeof(g));
+    mock_addr(OTHER_ADDR, g.acl_disconn_cmpl_stat.bda);
+    mock_post_gap(ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT, &g, 0);
+    mock_settle();
+    CHECK(mock_eq(CALL0(mp_module_bts, "state"), "discoverable", 12));
+
+    // connect
+    mock_peer_t *master = mock_peer_add(MASTER_ADDR, "pc", 0, "");
+    CHECK(mock_peer_connect(master, "1234"));
+    CHECK(MOCK_WAIT_FOR(CALL0(mp_module_bts, "ready") == mp_const_true, 1000));
+    CHECK(mock_eq(CALL0(mp_module_bts, "state"), "connected", 9));
+    CHECK(mock_discoverable() == false); // the one slot is taken
+    CHECK(stat(&mp_module_bts, "connects") == 1);
+
+    // data from the master
+    mock_peer_send(master, "hello\nworld\n", 12);
+    mock_settle();
+    CHECK(mp_obj_get_int(CALL0(mp_module_bts, "data")) == 12);
+    CHECK(mock_eq(CALL0(mp_module_bts, "readline"), "hello\n", 6));
+    CHECK(mock_eq(CALL(mp_module_bts, "get_bin", I(100)), "world\n", 6));
+    CHECK(CALL(mp_module_bts, "get_bin", I(100)) == mp_const_none);
+
+    // data to the master, then with the link congested
+    check_send(&mp_module_bts, master);
+    check_cong(&mp_module_bts, master);
+    check_fail(&mp_module_bts, master);
+
+    // close from this side, the slot is free for the next master
+    CHECK(CALL0(mp_module_bts, "close") == mp_const_true);
+    mock_settle();
+    CHECK(CALL0(mp_module_bts, "ready") == mp_const_false);
+    CHECK(mock_eq(CALL0(mp_module_bts, "state"), "discoverable", 12));
+    CHECK(mock_discoverable());
+    CHECK(stat(&mp_module_bts, "disconnects") == 1);
+
+    // the master is bonded now and comes back without a PIN, then drops
+    CHECK(mock_peer_connect(master, NULL));
+    CHECK(MOCK_WAIT_FOR(CALL0(mp_module_bts, "ready") == mp_const_true, 1000));
+    mock_peer_drop(master);
+    mock_settle();
+    CHECK(CALL0(mp_module_bts, "ready") == mp_const_false);
+    CHECK(stat(&mp_module_bts, "disconnects") == 2);
+
+    // deinit(True) leaves the stack up for btm, which starts warm on it, and
+    // bts gets its callbacks back when it starts warm after btm
+    CHECK(CALL(mp_module_bts, "deinit", mp_const_true) == mp_const_true);
+    mock_settle();
+    CHECK(CALL(mp_module_btm, "init", mock_str("ESP32_MASTER")) == mp_const_true);
+    CHECK(mock_dict_get(CALL0(mp_module_btm, "init_time"), "warm") == mp_const_true);
+    CHECK(CALL(mp_module_btm, "deinit", mp_const_true) == mp_const_true);
+    mock_settle();
+    CHECK(CALL(mp_module_bts, "init", mock_str("ESP32_SPP"), mock_str("1234")) == mp_const_true);
+    CHECK(mock_dict_get(CALL0(mp_module_bts, "init_time"), "warm") == mp_const_true);
+    mock_settle();
+    CHECK(mock_peer_connect(master, NULL));
+    CHECK(MOCK_WAIT_FOR(CALL0(mp_module_bts, "ready") == mp_const_true, 1000));
+
+    CHECK(CALL0(mp_module_bts, "deinit") == mp_const_true);
+    CHECK(CALL0(mp_module_bts, "up") == mp_const_false);
+    CHECK(CALL0(mp_module_btm, "deinit") == mp_const_false); // bts took it all down
+    mock_settle();
+}
+
+/* a FRAME_LEN message: 2 byte length, then len bytes of c */
+static size_t frame(uint8_t *buf, size_t len, uint8_t c) {
+    buf[0] = len >> 8;
+    buf[1] = len & 0xFF;
+    memset(buf + 2, c, len);
+    return len + 2;
+}
+
+/* only whole messages stay in a framed pipe, whatever is dropped */
+static void test_framing(void) {
+    uint8_t buf[256];
+    size_t n;
+    mock_bt_reset();
+    mp_obj_t a[] = { mock_str("ESP32_SPP"), mock_str("1234"),
+                     mock_qstr("rxbuf"), I(64), mock_qstr("framing"), mock_attr(&mp_module_bts, "FRAME_LEN") };
+    CHECK(mock_call(&mp_module_bts, "init", 2, 2, a) == mp_const_true);
+    mock_settle();
+    mock_peer_t *master = mock_peer_add(MASTER_ADDR, "pc", 0, "");
+    CHECK(mock_peer_connect(master, "1234"));
+    CHECK(MOCK_WAIT_FOR(CALL0(mp_module_bts, "ready") == mp_const_true, 1000));
+
+    // one that fits, one too big for rxbuf, one that fits, in one frame
+    n = frame(buf, 10, 'a');
+    n += frame(buf + n, 100, 'b');
+    n += frame(buf + n, 5, 'c');
+    mock_peer_send(master, buf, n);
+    mock_settle();
+    CHECK(mock_eq(CALL0(mp_module_bts, "get_msg"), "aaaaaaaaaa", 10));
+    CHECK(mock_eq(CALL0(mp_module_bts, "get_msg"), "ccccc", 5));
+    CHECK(CALL0(mp_module_bts, "get_msg") == mp_const_none);
+    CHECK(stat(&mp_module_bts, "rx_resync") == 1);
+
+    // a message over two frames
+    n = frame(buf, 20, 'd');
+    mock_peer_send(master, buf, 7);
+    mock_settle();
+    CHECK(CALL0(mp_module_bts, "get_msg") == mp_const_none);
+    mock_peer_send(master, buf + 7, n - 7);
+    mock_settle();
+    CHECK(mock_eq(CALL0(mp_module_bts, "get_msg"), "dddddddddddddddddddd", 20));
+
+    // the start of a message fills the pipe: get_msg() gives up on it, and
+    // the rest of it is skipped when it comes
+    n = frame(buf, 70, 'e');
+    mock_peer_send(master, buf, 64);
+    mock_settle();
+    CHECK(mp_obj_get_int(CALL0(mp_module_bts, "data")) == 64);
+    CHECK(CALL0(mp_module_bts, "get_msg") == mp_const_none);
+    n += frame(buf + n, 3, 'f');
+    mock_peer_send(master, buf + 64, n - 64);
+    mock_settle();
+    CHECK(mock_eq(CALL0(mp_module_bts, "get_msg"), "fff", 3));
+    CHECK(mp_obj_get_int(CALL0(mp_module_bts, "data")) == 0);
+    CHECK(stat(&mp_module_bts, "rx_resync") == 2);
+
+    // the peer could not take a message bigger than rxbuf either
+    memset(buf, 'g', 100);
+    CHECK(CALL(mp_module_bts, "send_msg", mock_bytes(buf, 100)) == MP_OBJ_NULL);
+    CHECK(mock_exc() != NULL && mock_exc()->base.type == &mp_type_ValueError);
+    CHECK(mp_obj_get_int(CALL(mp_module_bts, "send_msg", mock_bytes(buf, 40))) == 40);
+    mock_settle();
+    CHECK(mock_peer_recv(master, rx, sizeof(rx)) == 42);
+
+    CHECK(CALL0(mp_module_bts, "deinit") == mp_const_true);
+    mock_settle();
+}
+
+static mp_int_t conn_stat(const mp_obj_module_t *m, int id, const char *key) {
+    mp_obj_t a[] = { mp_const_false, I(id) };
+    return mock_dict_int(mock_call(m, "stats", 2, 0, a), key);
+}
+
+/* two masters at once, each with its own counters */
+static void test_conns(void) {
+    mock_bt_reset();
+    mp_obj_t a[] = { mock_str("ESP32_SPP"), mock_str("1234"), mock_qstr("conns"), I(2) };
+    CHECK(mock_call(&mp_module_bts, "init", 2, 1, a) == mp_const_true);
+    mock_settle();
+    mock_peer_t *master = mock_peer_add(MASTER_ADDR, "pc", 0, "");
+    mock_peer_t *other = mock_peer_add(OTHER_ADDR, "phone", 0, "");
+    CHECK(mock_peer_connect(master, "1234"));
+    CHECK(MOCK_WAIT_FOR(CALL(mp_module_bts, "ready", I(0)) == mp_const_true, 1000));
+    CHECK(mock_peer_connect(other, "1234"));
+    CHECK(MOCK_WAIT_FOR(CALL(mp_module_bts, "ready", I(1)) == mp_const_true, 1000));
+
+    mock_peer_send(master, tx, 10);
+    mock_peer_send(other, tx, 25);
+    mock_settle();
+    mp_obj_t s[] = { mock_bytes(tx, TX_LEN), I(0), I(1) };
+    CHECK(mp_obj_get_int(mock_call(&mp_module_bts, "send_bin", 3, 0, s)) == TX_LEN);
+    mock_settle();
+    CHECK(mock_peer_recv(other, rx, sizeof(rx)) == TX_LEN);
+    CHECK(conn_stat(&mp_module_bts, 0, "rx_bytes") == 10);
+    CHECK(conn_stat(&mp_module_bts, 1, "rx_bytes") == 25);
+    CHECK(conn_stat(&mp_module_bts, 0, "tx_bytes") == 0);
+    CHECK(conn_stat(&mp_module_bts, 1, "tx_bytes") == TX_LEN);
+    CHECK(conn_stat(&mp_module_bts, 1, "connects") == 1);
+    CHECK(stat(&mp_module_bts, "rx_bytes") == 35);
+    CHECK(stat(&mp_module_bts, "connects") == 2);
+
+    // clearing one leaves the other
+    mp_obj_t r[] = { mp_const_true, I(1) };
+    CHECK(mock_dict_int(mock_call(&mp_module_bts, "stats", 2, 0, r), "rx_bytes") == 25);
+    CHECK(conn_stat(&mp_module_bts, 1, "rx_bytes") == 0);
+    CHECK(conn_stat(&mp_module_bts, 0, "rx_bytes") == 10);
+    CHECK(stat(&mp_module_bts, "rx_bytes") == 10);
+    mp_obj_t bad[] = { mp_const_false, I(2) };
+    CHECK(mock_call(&mp_module_bts, "stats", 2, 0, bad) == MP_OBJ_NULL);
+
+    // each buffer has its own fill histogram
+    mp_obj_t o0[] = { mp_const_false, I(0) };
+    mp_obj_t o1[] = { mp_const_false, I(1) };
+    CHECK(mock_dict_int(mock_call(&mp_module_bts, "occupancy", 2, 0, o0), "peak") == 10);
+    CHECK(mock_dict_int(mock_call(&mp_module_bts, "occupancy", 2, 0, o1), "peak") == 25);
+    CHECK(mock_dict_int(mock_call(&mp_module_bts, "occupancy", 2, 0, o1), "size") == 1024);
+
+    CHECK(CALL0(mp_module_bts, "deinit") == mp_const_true);
+    mock_settle();
+}
+
+static int scan_irqs;
+
+STATIC mp_obj_t on_scan(mp_obj_t events) {
+    scan_irqs++;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(on_scan_obj, on_scan);
+
+static void test_btm(void) {
+    mock_bt_reset();
+    CHECK(CALL(mp_module_btm, "init", mock_str("ESP32_MASTER")) == mp_const_true);
+    mock_settle();
+
+    // open by name: inquiry, SDP, PIN, RFCOMM
+    mock_peer_t *slave = mock_peer_add(SLAVE_ADDR, "ESP32_SLAVE", 1, "1234");
+    mp_obj_t id = CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234"), I(2000));
+    CHECK(id != MP_OBJ_NULL && mp_obj_get_int(id) == 0);
+    CHECK(CALL(mp_module_btm, "ready", I(0)) == mp_const_true);
+    CHECK(stat(&mp_module_btm, "connects") == 1);
+
+    // data from the slave
+    mock_peer_send(slave, "ping\n", 5);
+    mock_settle();
+    CHECK(mock_eq(CALL(mp_module_btm, "get_bin", I(10), I(0)), "ping\n", 5));
+
+    // data to the slave, then with the link congested
+    check_send(&mp_module_btm, slave);
+    check_cong(&mp_module_btm, slave);
+    check_fail(&mp_module_btm, slave);
+
+    // close, then again by name, from the SCN cache this time
+    CHECK(CALL(mp_module_btm, "close", I(0)) != MP_OBJ_NULL);
+    mock_settle();
+    CHECK(CALL(mp_module_btm, "ready", I(0)) == mp_const_false);
+    CHECK(stat(&mp_module_btm, "disconnects") == 1);
+    id = CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234"), I(2000));
+    CHECK(id != MP_OBJ_NULL && mp_obj_get_int(id) == 0);
+    mp_obj_t ct = CALL0(mp_module_btm, "connect_time");
+    CHECK(mock_dict_int(ct, "sdp_us") == 0 && mock_dict_int(ct, "inquiry_us") == 0);
+    CHECK(CALL(mp_module_btm, "close", I(0)) != MP_OBJ_NULL);
+    mock_settle();
+
+    // a slave out of reach keeps its SCN cache entry
+    size_t n;
+    mp_obj_t *items;
+    slave->in_range = false;
+    CHECK(CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234"), I(2000)) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_ECONNABORTED);
+    mock_settle();
+    mp_obj_get_array(CALL0(mp_module_btm, "cache"), &n, &items);
+    CHECK(n == 1);
+    slave->in_range = true;
+
+    // one that moved its service is looked up again with SDP
+    slave->scn = 3;
+    id = CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234"), I(2000));
+    CHECK(id != MP_OBJ_NULL && mp_obj_get_int(id) == 0);
+    ct = CALL0(mp_module_btm, "connect_time");
+    CHECK(mock_dict_int(ct, "sdp_us") > 0);
+    CHECK(CALL(mp_module_btm, "close", I(0)) != MP_OBJ_NULL);
+    mock_settle();
+
+    // the ways an open() fails
+    mock_peer_add(OTHER_ADDR, "ESP32_OTHER", 1, "9999");
+    CHECK(CALL(mp_module_btm, "open", mock_str("ESP32_OTHER"), mock_str("1234"), I(2000)) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_EACCES);
+    mock_settle();
+    CHECK(CALL(mp_module_btm, "open", mock_str("NOBODY"), mock_str("1234"), I(2000)) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_ENOENT);
+    mock_settle();
+
+    // the stack turns the start down: EIO at once, and the next open() may go
+    mock_start_fail(1);
+    CHECK(CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234")) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_EIO);
+    mock_start_fail(1);
+    CHECK(CALL(mp_module_btm, "open", mock_str("NOBODY"), mock_str("1234")) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_EIO);
+    id = CALL(mp_module_btm, "open", mock_str("ESP32_SLAVE"), mock_str("1234"), I(2000));
+    CHECK(id != MP_OBJ_NULL && mp_obj_get_int(id) == 0);
+    CHECK(CALL(mp_module_btm, "close", I(0)) != MP_OBJ_NULL);
+    mock_settle();
+
+    // the SDP answer of an open() that timed out is not taken for the next one's
+    mock_peer_t *slow = mock_peer_add(SLOW_ADDR, "ESP32_SLOW", 5, "1234");
+    mock_peer_t *late = mock_peer_add(LATE_ADDR, "ESP32_LATE", 6, "1234");
+    slow->delay_ms = 100; // SDP answers after 300 ms
+    late->delay_ms = 150; // after 450 ms, so the stale answer comes first
+    CHECK(CALL(mp_module_btm, "open", mock_str(SLOW_ADDR), mock_str("1234"), I(100)) == MP_OBJ_NULL);
+    CHECK(mock_errno() == MP_ETIMEDOUT);
+    id = CALL(mp_module_btm, "open", mock_str(LATE_ADDR), mock_str("1234"), I(3000));
+    CHECK(id != MP_OBJ_NULL && late->handle != 0);
+    CHECK(slow->handle == 0);
+    if (id != MP_OBJ_NULL) {
+        CHECK(CALL(mp_module_btm, "close", id) != MP_OBJ_NULL);
+    }
+    mock_settle();
+    slow->in_range = false;
+    late->in_range = false;
+
+    // IRQ_SCAN comes for the devices the filter keeps and at the end, not for the others
+    mp_obj_t h[] = { MP_OBJ_FROM_PTR(&on_scan_obj), mock_qstr("trigger"), mock_attr(&mp_module_btm, "IRQ_SCAN") };
+    mock_call(&mp_module_btm, "irq", 1, 1, h);
+    mp_obj_t sa[] = { I(61440), mock_qstr("name_prefix"), mock_str("NOBODY") };
+    CHECK(mock_call(&mp_module_btm, "scan", 1, 1, sa) == mp_const_true);
+    mp_hal_delay_ms(100); // the two results are in, the inquiry runs on
+    mock_sched_run();
+    CHECK(scan_irqs == 0);
+    CHECK(MOCK_WAIT_FOR(scan_irqs == 1, 1000)); // the end
+    CALL(mp_module_btm, "irq", mp_const_none);
+
+    CHECK(CALL0(mp_module_btm, "deinit") == mp_const_true);
+    CHECK(CALL0(mp_module_btm, "up") == mp_const_false);
+    mock_settle();
+}
+
+int main(void) {
+    for (int i = 0; i < TX_LEN; i++) {
+        tx[i] = i * 7 + (i >> 8);
+    }
+    test_bts();
+    test_framing();
+    test_conns();
+    test_btm();
+    printf("loopback: %d checks, %d failed\n", mock_checked, mock_failed);
+    return mock_failed != 0;
+}
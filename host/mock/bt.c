@@ -0,0 +1,1153 @@
+/*
+ * Host build: the controller, Bluedroid, GAP and SPP of ESP-IDF 4.4 and
+ * the remote devices around them.
+ *
+ * Calls are checked against the state of the stack as ESP-IDF checks
+ * them and answered with the events ESP-IDF sends, in its order. Events
+ * go through a queue to one Bluetooth thread that calls the registered
+ * callbacks, as the BTC task does, each at the time it is due. The
+ * steps of a connect that depend on the remote run on that thread too,
+ * so a test can change a remote device while a connect is under way.
+ *
+ * A client connect goes ESP_SPP_CL_INIT_EVT, then the page: on a page
+ * timeout ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT with an error and
+ * ESP_SPP_CLOSE_EVT. Once the ACL is up ESP_BT_GAP_PIN_REQ_EVT unless the
+ * device is bonded, ESP_BT_GAP_AUTH_CMPL_EVT, and ESP_SPP_OPEN_EVT, or
+ * ESP_SPP_CLOSE_EVT and ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT when the PIN
+ * or the channel is wrong. A remote master connecting to the server goes
+ * ACL, AUTH_CMPL and ESP_SPP_SRV_OPEN_EVT.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_bt_device.h"
+#include "esp_gap_bt_api.h"
+#include "esp_spp_api.h"
+#include "nvs_flash.h"
+#include "py/mphal.h"
+#include "mock.h"
+
+#define HOP_MS      2   /* one step of a remote device that has no delay_ms set */
+#define PAGE_MS     50  /* page timeout */
+#define INQ_STEP_MS 5   /* between inquiry results */
+#define SETTLE_MS   5000
+#define LINKS       16
+#define BONDS       16
+#define INQ_COD     0x1f00
+
+enum { EV_SPP, EV_GAP, EV_FN };
+
+typedef struct _ev_t {
+    struct _ev_t *next;
+    uint32_t due;
+    int kind;
+    int event;
+    uint32_t inq;             /* inquiry it belongs to, 0 for none */
+    esp_spp_cb_param_t spp;
+    esp_bt_gap_cb_param_t gap;
+    uint8_t *data;            /* of ESP_SPP_DATA_IND_EVT */
+    esp_bt_gap_dev_prop_t prop[3];
+    uint32_t cod;
+    int8_t rssi;
+    uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+    void (*fn)(uint32_t handle);
+    uint32_t handle;
+} ev_t;
+
+/* an SPP connection, from esp_spp_connect or a remote master */
+enum { LINK_FREE, LINK_PAGE, LINK_PIN, LINK_OPEN };
+
+typedef struct _link_t {
+    int state;
+    uint32_t handle;
+    mock_peer_t *peer;
+    uint8_t scn;  /* the channel asked for */
+    bool server;  /* the remote master opened it */
+} link_t;
+
+static struct {
+    pthread_mutex_t m;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    ev_t *queue;
+    bool busy;    /* a callback is running */
+
+    esp_bt_controller_status_t ctrl;
+    bool ble_released;
+    esp_bluedroid_status_t bd;
+    esp_bt_gap_cb_t gap_cb;
+    esp_spp_cb_t *spp_cb;
+    bool spp_up;
+    bool srv_on;
+    esp_bt_connection_mode_t c_mode;
+    esp_bt_discovery_mode_t d_mode;
+    char name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+    uint8_t pin[ESP_BT_PIN_CODE_LEN];
+    uint8_t pin_len;
+    uint32_t inq;         /* the inquiry running, 0 for none */
+    uint32_t inq_count;
+    uint32_t next_handle;
+    int write_fail;
+    int start_fail;       /* start calls still to turn down with ESP_FAIL */
+
+    mock_peer_t peer[MOCK_PEERS];
+    link_t link[LINKS];
+    esp_bd_addr_t bond[BONDS];
+    int bonds;
+} bt = { .m = PTHREAD_MUTEX_INITIALIZER, .next_handle = 0x81 };
+
+static const esp_bd_addr_t local_addr = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 };
+
+/* the queue, all with bt.m held */
+
+static void *bt_task(void *arg);
+
+static void post(ev_t *e, uint32_t delay_ms) {
+    e->due = mp_hal_ticks_ms() + delay_ms;
+    if (bt.running == false) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&bt.cond, &attr);
+        pthread_create(&bt.thread, NULL, bt_task, NULL);
+        pthread_detach(bt.thread);
+        bt.running = true;
+    }
+    ev_t **pp = &bt.queue;
+    while (*pp != NULL && (int32_t) ((*pp)->due - e->due) <= 0) {
+        pp = &(*pp)->next; // in order of due time, first posted first among equals
+    }
+    e->next = *pp;
+    *pp = e;
+    pthread_cond_signal(&bt.cond);
+}
+
+static ev_t *ev_new(int kind, int event) {
+    ev_t *e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        abort();
+    }
+    e->kind = kind;
+    e->event = event;
+    return e;
+}
+
+static void post_spp(esp_spp_cb_event_t event, const esp_spp_cb_param_t *param, uint32_t delay_ms) {
+    ev_t *e = ev_new(EV_SPP, event);
+    e->spp = *param;
+    post(e, delay_ms);
+}
+
+static void post_gap(esp_bt_gap_cb_event_t event, const esp_bt_gap_cb_param_t *param, uint32_t delay_ms) {
+    ev_t *e = ev_new(EV_GAP, event);
+    e->gap = *param;
+    post(e, delay_ms);
+}
+
+static void post_fn(void (*fn)(uint32_t), uint32_t handle, uint32_t delay_ms) {
+    ev_t *e = ev_new(EV_FN, 0);
+    e->fn = fn;
+    e->handle = handle;
+    post(e, delay_ms);
+}
+
+static void ev_free(ev_t *e) {
+    free(e->data);
+    free(e);
+}
+
+static void purge(void) {
+    while (bt.queue != NULL) {
+        ev_t *e = bt.queue;
+        bt.queue = e->next;
+        ev_free(e);
+    }
+}
+
+static void *bt_task(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&bt.m);
+    for (;;) {
+        if (bt.queue == NULL) {
+            pthread_cond_wait(&bt.cond, &bt.m);
+            continue;
+        }
+        int32_t wait = (int32_t) (bt.queue->due - mp_hal_ticks_ms());
+        if (wait > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += (long) wait * 1000000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&bt.cond, &bt.m, &ts);
+            continue;
+        }
+        ev_t *e = bt.queue;
+        bt.queue = e->next;
+        if (e->inq != 0 && e->inq != bt.inq) {
+            ev_free(e); // from an inquiry that was cancelled
+            continue;
+        }
+        if (e->kind == EV_GAP && e->event == ESP_BT_GAP_DISC_STATE_CHANGED_EVT
+            && e->gap.disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED && e->inq != 0) {
+            bt.inq = 0;
+        }
+        esp_bt_gap_cb_t gap_cb = bt.gap_cb;
+        esp_spp_cb_t *spp_cb = bt.spp_cb;
+        bt.busy = true;
+        pthread_mutex_unlock(&bt.m);
+        if (e->kind == EV_FN) {
+            e->fn(e->handle);
+        } else if (e->kind == EV_SPP && spp_cb != NULL) {
+            spp_cb(e->event, &e->spp);
+        } else if (e->kind == EV_GAP && gap_cb != NULL) {
+            gap_cb(e->event, &e->gap);
+        }
+        ev_free(e);
+        pthread_mutex_lock(&bt.m);
+        bt.busy = false;
+    }
+    return NULL;
+}
+
+/* remote devices, links and bonds, with bt.m held */
+
+static mock_peer_t *peer_find(const uint8_t *addr) {
+    for (int i = 0; i < MOCK_PEERS; i++) {
+        if (bt.peer[i].used && memcmp(bt.peer[i].addr, addr, ESP_BD_ADDR_LEN) == 0) {
+            return &bt.peer[i];
+        }
+    }
+    return NULL;
+}
+
+static link_t *link_find(uint32_t handle) {
+    for (int i = 0; handle != 0 && i < LINKS; i++) {
+        if (bt.link[i].state != LINK_FREE && bt.link[i].handle == handle) {
+            return &bt.link[i];
+        }
+    }
+    return NULL;
+}
+
+static link_t *link_new(mock_peer_t *peer, uint8_t scn, bool server) {
+    for (int i = 0; i < LINKS; i++) {
+        if (bt.link[i].state == LINK_FREE) {
+            link_t *l = &bt.link[i];
+            l->state = LINK_PAGE;
+            l->handle = bt.next_handle++;
+            l->peer = peer;
+            l->scn = scn;
+            l->server = server;
+            return l;
+        }
+    }
+    return NULL;
+}
+
+static bool bonded(const uint8_t *addr) {
+    for (int i = 0; i < bt.bonds; i++) {
+        if (memcmp(bt.bond[i], addr, ESP_BD_ADDR_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bond_add(const uint8_t *addr) {
+    if (bonded(addr) || bt.bonds == BONDS) {
+        return;
+    }
+    memcpy(bt.bond[bt.bonds++], addr, ESP_BD_ADDR_LEN);
+}
+
+static uint32_t hop(const mock_peer_t *peer) {
+    return peer != NULL && peer->delay_ms > 0 ? peer->delay_ms : HOP_MS;
+}
+
+static void post_acl(const uint8_t *addr, bool up, esp_bt_status_t stat, uint32_t delay_ms) {
+    esp_bt_gap_cb_param_t p = { 0 };
+    if (up) {
+        p.acl_conn_cmpl_stat.stat = stat;
+        p.acl_conn_cmpl_stat.handle = 0x80;
+        memcpy(p.acl_conn_cmpl_stat.bda, addr, ESP_BD_ADDR_LEN);
+        post_gap(ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT, &p, delay_ms);
+    } else {
+        p.acl_disconn_cmpl_stat.reason = stat;
+        p.acl_disconn_cmpl_stat.handle = 0x80;
+        memcpy(p.acl_disconn_cmpl_stat.bda, addr, ESP_BD_ADDR_LEN);
+        post_gap(ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT, &p, delay_ms);
+    }
+}
+
+static void post_auth(const mock_peer_t *peer, bool ok, uint32_t delay_ms) {
+    esp_bt_gap_cb_param_t p = { 0 };
+    memcpy(p.auth_cmpl.bda, peer->addr, ESP_BD_ADDR_LEN);
+    p.auth_cmpl.stat = ok ? ESP_BT_STATUS_SUCCESS : ESP_BT_STATUS_FAIL;
+    snprintf((char *) p.auth_cmpl.device_name, sizeof(p.auth_cmpl.device_name), "%s", peer->name);
+    post_gap(ESP_BT_GAP_AUTH_CMPL_EVT, &p, delay_ms);
+}
+
+/* the link closes, ESP_SPP_CLOSE_EVT and the ACL going down after it */
+static void link_close(link_t *l, esp_spp_status_t status, bool acl, uint32_t delay_ms) {
+    esp_spp_cb_param_t p = { 0 };
+    p.close.status = status;
+    p.close.handle = l->handle;
+    post_spp(ESP_SPP_CLOSE_EVT, &p, delay_ms);
+    if (acl && l->peer != NULL) {
+        post_acl(l->peer->addr, false, 0x13, delay_ms + hop(l->peer));
+    }
+    if (l->peer != NULL && l->peer->handle == l->handle) {
+        l->peer->handle = 0;
+    }
+    l->state = LINK_FREE;
+}
+
+/* the channel is opened once the link is authenticated */
+static void link_open(link_t *l, uint32_t delay_ms) {
+    mock_peer_t *peer = l->peer;
+    if (l->server == false && (peer->scn == 0 || l->scn != peer->scn)) {
+        link_close(l, ESP_SPP_FAILURE, true, delay_ms); // RFCOMM refused the channel
+        return;
+    }
+    esp_spp_cb_param_t p = { 0 };
+    l->state = LINK_OPEN;
+    peer->handle = l->handle;
+    if (l->server) {
+        p.srv_open.status = ESP_SPP_SUCCESS;
+        p.srv_open.handle = l->handle;
+        p.srv_open.new_listen_handle = bt.next_handle++;
+        memcpy(p.srv_open.rem_bda, peer->addr, ESP_BD_ADDR_LEN);
+        post_spp(ESP_SPP_SRV_OPEN_EVT, &p, delay_ms);
+    } else {
+        p.open.status = ESP_SPP_SUCCESS;
+        p.open.handle = l->handle;
+        memcpy(p.open.rem_bda, peer->addr, ESP_BD_ADDR_LEN);
+        post_spp(ESP_SPP_OPEN_EVT, &p, delay_ms);
+    }
+}
+
+/* Bluetooth thread, the page of esp_spp_connect is answered */
+static void connect_page(uint32_t handle) {
+    pthread_mutex_lock(&bt.m);
+    link_t *l = link_find(handle);
+    if (l != NULL && l->state == LINK_PAGE) {
+        mock_peer_t *peer = l->peer;
+        if (peer == NULL || peer->in_range == false) {
+            l->peer = NULL;
+            esp_bt_gap_cb_param_t p = { 0 };
+            p.acl_conn_cmpl_stat.stat = ESP_BT_STATUS_FAIL; // page timeout
+            post_gap(ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT, &p, 0);
+            link_close(l, ESP_SPP_FAILURE, false, 0);
+        } else {
+            post_acl(peer->addr, true, ESP_BT_STATUS_SUCCESS, 0);
+            if (bonded(peer->addr)) {
+                post_auth(peer, true, hop(peer));
+                link_open(l, 2 * hop(peer));
+            } else {
+                esp_bt_gap_cb_param_t p = { 0 };
+                memcpy(p.pin_req.bda, peer->addr, ESP_BD_ADDR_LEN);
+                p.pin_req.min_16_digit = false;
+                l->state = LINK_PIN;
+                post_gap(ESP_BT_GAP_PIN_REQ_EVT, &p, hop(peer));
+            }
+        }
+    }
+    pthread_mutex_unlock(&bt.m);
+}
+
+/* controller */
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+    pthread_mutex_lock(&bt.m);
+    esp_err_t err = ESP_OK;
+    if (bt.ctrl != ESP_BT_CONTROLLER_STATUS_IDLE) {
+        err = ESP_ERR_INVALID_STATE;
+    } else if (bt.ble_released && mode == ESP_BT_MODE_BLE) {
+        err = ESP_ERR_INVALID_STATE; // given back already, as IDF 4.4 answers
+    } else if (mode == ESP_BT_MODE_BLE || mode == ESP_BT_MODE_BTDM) {
+        bt.ble_released = true;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (cfg == NULL) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (bt.ctrl == ESP_BT_CONTROLLER_STATUS_IDLE) {
+        bt.ctrl = ESP_BT_CONTROLLER_STATUS_INITED;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_controller_deinit(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.ctrl == ESP_BT_CONTROLLER_STATUS_INITED) {
+        bt.ctrl = ESP_BT_CONTROLLER_STATUS_IDLE;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (mode != ESP_BT_MODE_CLASSIC_BT && (mode != ESP_BT_MODE_BTDM || bt.ble_released)) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (bt.ctrl == ESP_BT_CONTROLLER_STATUS_INITED) {
+        bt.ctrl = ESP_BT_CONTROLLER_STATUS_ENABLED;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_controller_disable(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.ctrl == ESP_BT_CONTROLLER_STATUS_ENABLED && bt.bd == ESP_BLUEDROID_STATUS_UNINITIALIZED) {
+        bt.ctrl = ESP_BT_CONTROLLER_STATUS_INITED;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_bt_controller_status_t esp_bt_controller_get_status(void) {
+    pthread_mutex_lock(&bt.m);
+    esp_bt_controller_status_t st = bt.ctrl;
+    pthread_mutex_unlock(&bt.m);
+    return st;
+}
+
+/* Bluedroid */
+
+esp_bluedroid_status_t esp_bluedroid_get_status(void) {
+    pthread_mutex_lock(&bt.m);
+    esp_bluedroid_status_t st = bt.bd;
+    pthread_mutex_unlock(&bt.m);
+    return st;
+}
+
+esp_err_t esp_bluedroid_init(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.ctrl == ESP_BT_CONTROLLER_STATUS_ENABLED && bt.bd == ESP_BLUEDROID_STATUS_UNINITIALIZED) {
+        bt.bd = ESP_BLUEDROID_STATUS_INITIALIZED;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+/* the callbacks are forgotten, as btc_deinit() does */
+esp_err_t esp_bluedroid_deinit(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.bd == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        bt.bd = ESP_BLUEDROID_STATUS_UNINITIALIZED;
+        bt.gap_cb = NULL;
+        bt.spp_cb = NULL;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bluedroid_enable(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.bd == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        bt.bd = ESP_BLUEDROID_STATUS_ENABLED;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+/* every link and SPP go down with it, nothing more is delivered */
+esp_err_t esp_bluedroid_disable(void) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bt.bd == ESP_BLUEDROID_STATUS_ENABLED) {
+        bt.bd = ESP_BLUEDROID_STATUS_INITIALIZED;
+        bt.spp_up = false;
+        bt.srv_on = false;
+        bt.inq = 0;
+        bt.c_mode = ESP_BT_NON_CONNECTABLE;
+        bt.d_mode = ESP_BT_NON_DISCOVERABLE;
+        for (int i = 0; i < LINKS; i++) {
+            if (bt.link[i].peer != NULL) {
+                bt.link[i].peer->handle = 0;
+            }
+            bt.link[i].state = LINK_FREE;
+        }
+        purge();
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+static bool bd_enabled(void) {
+    return bt.bd == ESP_BLUEDROID_STATUS_ENABLED;
+}
+
+const uint8_t *esp_bt_dev_get_address(void) {
+    return local_addr;
+}
+
+esp_err_t esp_bt_dev_set_device_name(const char *name) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (name == NULL || strlen(name) > ESP_BT_GAP_MAX_BDNAME_LEN) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (bd_enabled()) {
+        snprintf(bt.name, sizeof(bt.name), "%s", name);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+/* GAP */
+
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled()) {
+        bt.gap_cb = callback;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t c_mode, esp_bt_discovery_mode_t d_mode) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled()) {
+        bt.c_mode = c_mode;
+        bt.d_mode = d_mode;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_gap_set_pin(esp_bt_pin_type_t pin_type, uint8_t pin_code_len, esp_bt_pin_code_t pin_code) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (pin_code_len > ESP_BT_PIN_CODE_LEN) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (bd_enabled()) {
+        bt.pin_len = pin_type == ESP_BT_PIN_TYPE_FIXED ? pin_code_len : 0;
+        memcpy(bt.pin, pin_code, pin_code_len);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_bt_gap_pin_reply(esp_bd_addr_t bd_addr, bool accept, uint8_t pin_code_len, esp_bt_pin_code_t pin_code) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (int i = 0; i < LINKS; i++) {
+        link_t *l = &bt.link[i];
+        if (l->state != LINK_PIN || memcmp(l->peer->addr, bd_addr, ESP_BD_ADDR_LEN) != 0) {
+            continue;
+        }
+        mock_peer_t *peer = l->peer;
+        bool ok = accept && pin_code_len == strlen(peer->pin) && memcmp(pin_code, peer->pin, pin_code_len) == 0;
+        post_auth(peer, ok, hop(peer));
+        if (ok) {
+            bond_add(peer->addr);
+            link_open(l, 2 * hop(peer));
+        } else {
+            link_close(l, ESP_SPP_FAILURE, true, 2 * hop(peer));
+        }
+        break;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+/* one ESP_BT_GAP_DISC_RES_EVT, the name in the EIR as an ESP32 gets it */
+static void post_disc_res(const mock_peer_t *peer, uint32_t delay_ms) {
+    ev_t *e = ev_new(EV_GAP, ESP_BT_GAP_DISC_RES_EVT);
+    size_t len = strlen(peer->name);
+    e->inq = bt.inq;
+    memcpy(e->gap.disc_res.bda, peer->addr, ESP_BD_ADDR_LEN);
+    e->cod = INQ_COD;
+    e->rssi = peer->rssi;
+    e->eir[0] = len + 1;
+    e->eir[1] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+    memcpy(e->eir + 2, peer->name, len);
+    e->prop[0] = (esp_bt_gap_dev_prop_t) { ESP_BT_GAP_DEV_PROP_COD, sizeof(e->cod), &e->cod };
+    e->prop[1] = (esp_bt_gap_dev_prop_t) { ESP_BT_GAP_DEV_PROP_RSSI, 1, &e->rssi };
+    e->prop[2] = (esp_bt_gap_dev_prop_t) { ESP_BT_GAP_DEV_PROP_EIR, len + 2, e->eir };
+    e->gap.disc_res.num_prop = 3;
+    e->gap.disc_res.prop = e->prop;
+    post(e, delay_ms);
+}
+
+/* inq_len is in 1.28 s steps on air, here it is INQ_STEP_MS for each */
+/* under bt.m, true if mock_start_fail() wants this call turned down */
+static bool start_fails(void) {
+    if (bt.start_fail > 0) {
+        bt.start_fail--;
+        return true;
+    }
+    return false;
+}
+
+esp_err_t esp_bt_gap_start_discovery(esp_bt_inq_mode_t mode, uint8_t inq_len, uint8_t num_rsps) {
+    (void) mode;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false || bt.inq != 0) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (start_fails()) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_FAIL;
+    }
+    if (inq_len < 1 || inq_len > 0x30) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_ARG;
+    }
+    bt.inq = ++bt.inq_count;
+    esp_bt_gap_cb_param_t p = { 0 };
+    p.disc_st_chg.state = ESP_BT_GAP_DISCOVERY_STARTED;
+    post_gap(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &p, 0);
+    uint32_t t = 0;
+    int found = 0;
+    for (int i = 0; i < MOCK_PEERS && (num_rsps == 0 || found < num_rsps); i++) {
+        if (bt.peer[i].used && bt.peer[i].in_range) {
+            t += INQ_STEP_MS;
+            post_disc_res(&bt.peer[i], t + bt.peer[i].delay_ms);
+            found++;
+        }
+    }
+    ev_t *e = ev_new(EV_GAP, ESP_BT_GAP_DISC_STATE_CHANGED_EVT);
+    e->inq = bt.inq;
+    e->gap.disc_st_chg.state = ESP_BT_GAP_DISCOVERY_STOPPED;
+    post(e, (num_rsps != 0 && found == num_rsps) ? t + 1 : (uint32_t) inq_len * INQ_STEP_MS + t + 1);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+/* the results still to come are dropped, STOPPED comes at once */
+esp_err_t esp_bt_gap_cancel_discovery(void) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (bt.inq != 0) {
+        bt.inq = 0;
+        esp_bt_gap_cb_param_t p = { 0 };
+        p.disc_st_chg.state = ESP_BT_GAP_DISCOVERY_STOPPED;
+        post_gap(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &p, 0);
+    }
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+uint8_t *esp_bt_gap_resolve_eir_data(uint8_t *eir, esp_bt_eir_type_t type, uint8_t *length) {
+    if (eir == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < ESP_BT_GAP_EIR_DATA_LEN && eir[i] != 0; i += eir[i] + 1) {
+        if (eir[i + 1] == type) {
+            if (length != NULL) {
+                *length = eir[i] - 1;
+            }
+            return &eir[i + 2];
+        }
+    }
+    return NULL;
+}
+
+int esp_bt_gap_get_bond_device_num(void) {
+    pthread_mutex_lock(&bt.m);
+    int n = bd_enabled() ? bt.bonds : ESP_FAIL;
+    pthread_mutex_unlock(&bt.m);
+    return n;
+}
+
+esp_err_t esp_bt_gap_get_bond_device_list(int *dev_num, esp_bd_addr_t *dev_list) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (*dev_num > bt.bonds) {
+        *dev_num = bt.bonds;
+    }
+    memcpy(dev_list, bt.bond, *dev_num * sizeof(esp_bd_addr_t));
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_gap_remove_bond_device(esp_bd_addr_t bd_addr) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_bt_gap_cb_param_t p = { 0 };
+    memcpy(p.remove_bond_dev_cmpl.bda, bd_addr, ESP_BD_ADDR_LEN);
+    p.remove_bond_dev_cmpl.status = ESP_BT_STATUS_FAIL;
+    for (int i = 0; i < bt.bonds; i++) {
+        if (memcmp(bt.bond[i], bd_addr, ESP_BD_ADDR_LEN) == 0) {
+            memmove(bt.bond[i], bt.bond[i + 1], (bt.bonds - i - 1) * sizeof(esp_bd_addr_t));
+            bt.bonds--;
+            p.remove_bond_dev_cmpl.status = ESP_BT_STATUS_SUCCESS;
+            break;
+        }
+    }
+    post_gap(ESP_BT_GAP_REMOVE_BOND_DEV_COMPLETE_EVT, &p, 0);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+/* SPP */
+
+esp_err_t esp_spp_register_callback(esp_spp_cb_t callback) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled()) {
+        bt.spp_cb = callback;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&bt.m);
+    return err;
+}
+
+esp_err_t esp_spp_init(esp_spp_mode_t mode) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_spp_cb_param_t p = { 0 };
+    p.init.status = (mode != ESP_SPP_MODE_CB || bt.spp_up) ? ESP_SPP_FAILURE : ESP_SPP_SUCCESS;
+    bt.spp_up = true;
+    post_spp(ESP_SPP_INIT_EVT, &p, 0);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+/* every link is closed first, then ESP_SPP_UNINIT_EVT */
+esp_err_t esp_spp_deinit(void) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_spp_cb_param_t p = { 0 };
+    p.uninit.status = bt.spp_up ? ESP_SPP_SUCCESS : ESP_SPP_NEED_INIT;
+    for (int i = 0; bt.spp_up && i < LINKS; i++) {
+        if (bt.link[i].state != LINK_FREE) {
+            link_close(&bt.link[i], ESP_SPP_SUCCESS, true, 0);
+        }
+    }
+    bt.spp_up = false;
+    bt.srv_on = false;
+    post_spp(ESP_SPP_UNINIT_EVT, &p, 1);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_start_srv(esp_spp_sec_t sec_mask, esp_spp_role_t role, uint8_t local_scn, const char *name) {
+    (void) sec_mask;
+    (void) role;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (name == NULL || strlen(name) > ESP_SPP_SERVER_NAME_MAX) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_spp_cb_param_t p = { 0 };
+    p.start.status = bt.spp_up ? ESP_SPP_SUCCESS : ESP_SPP_NEED_INIT;
+    p.start.handle = bt.next_handle++;
+    p.start.scn = local_scn != 0 ? local_scn : 1;
+    bt.srv_on = bt.spp_up;
+    post_spp(ESP_SPP_START_EVT, &p, 0);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_stop_srv(void) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_spp_cb_param_t p = { 0 };
+    p.start.status = bt.srv_on ? ESP_SPP_SUCCESS : ESP_SPP_NO_SERVER;
+    bt.srv_on = false;
+    post_spp(ESP_SPP_SRV_STOP_EVT, &p, 0);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_start_discovery(esp_bd_addr_t bd_addr) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (start_fails()) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_FAIL;
+    }
+    mock_peer_t *peer = peer_find(bd_addr);
+    esp_spp_cb_param_t p = { 0 };
+    if (bt.spp_up == false) {
+        p.disc_comp.status = ESP_SPP_NEED_INIT;
+    } else if (peer == NULL || peer->in_range == false) {
+        p.disc_comp.status = ESP_SPP_FAILURE; // page timeout
+    } else if (peer->scn == 0) {
+        p.disc_comp.status = ESP_SPP_NO_SERVER;
+    } else {
+        p.disc_comp.status = ESP_SPP_SUCCESS;
+        p.disc_comp.scn_num = 1;
+        p.disc_comp.scn[0] = peer->scn;
+        p.disc_comp.service_name[0] = "SPP";
+    }
+    post_spp(ESP_SPP_DISCOVERY_COMP_EVT, &p, peer != NULL && peer->in_range ? 3 * hop(peer) : PAGE_MS);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_connect(esp_spp_sec_t sec_mask, esp_spp_role_t role, uint8_t remote_scn, esp_bd_addr_t peer_bd_addr) {
+    (void) sec_mask;
+    (void) role;
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (start_fails()) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_FAIL;
+    }
+    mock_peer_t *peer = peer_find(peer_bd_addr);
+    link_t *l = bt.spp_up ? link_new(peer, remote_scn, false) : NULL;
+    esp_spp_cb_param_t p = { 0 };
+    p.cl_init.status = l != NULL ? ESP_SPP_SUCCESS : (bt.spp_up ? ESP_SPP_NO_RESOURCE : ESP_SPP_NEED_INIT);
+    p.cl_init.handle = l != NULL ? l->handle : 0;
+    post_spp(ESP_SPP_CL_INIT_EVT, &p, 0);
+    if (l != NULL) {
+        post_fn(connect_page, l->handle, peer != NULL && peer->in_range ? hop(peer) : PAGE_MS);
+    }
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_disconnect(uint32_t handle) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    link_t *l = link_find(handle);
+    if (l != NULL) {
+        link_close(l, ESP_SPP_SUCCESS, l->state != LINK_PAGE, hop(l->peer));
+    } else {
+        esp_spp_cb_param_t p = { 0 };
+        p.close.status = ESP_SPP_NO_CONNECTION;
+        p.close.handle = handle;
+        post_spp(ESP_SPP_CLOSE_EVT, &p, 0);
+    }
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_write(uint32_t handle, int len, uint8_t *p_data) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false) {
+        pthread_mutex_unlock(&bt.m);
+        return ESP_ERR_INVALID_STATE;
+    }
+    link_t *l = link_find(handle);
+    esp_spp_cb_param_t p = { 0 };
+    p.write.handle = handle;
+    if (l == NULL || l->state != LINK_OPEN) {
+        p.write.status = ESP_SPP_NO_CONNECTION;
+    } else if (bt.write_fail > 0) {
+        bt.write_fail--;
+        p.write.status = ESP_SPP_FAILURE;
+        p.write.cong = l->peer->cong;
+    } else {
+        mock_peer_t *peer = l->peer;
+        p.write.status = ESP_SPP_SUCCESS;
+        p.write.len = len;
+        p.write.cong = peer->cong;
+        if (peer->echo) {
+            ev_t *e = ev_new(EV_SPP, ESP_SPP_DATA_IND_EVT);
+            e->data = malloc(len);
+            memcpy(e->data, p_data, len);
+            e->spp.data_ind.status = ESP_SPP_SUCCESS;
+            e->spp.data_ind.handle = handle;
+            e->spp.data_ind.len = len;
+            e->spp.data_ind.data = e->data;
+            post(e, 1);
+        } else {
+            if (peer->rx_len + len > peer->rx_alloc) {
+                peer->rx_alloc = (peer->rx_len + len) * 2;
+                peer->rx = realloc(peer->rx, peer->rx_alloc);
+            }
+            memcpy(peer->rx + peer->rx_len, p_data, len);
+            peer->rx_len += len;
+        }
+    }
+    post_spp(ESP_SPP_WRITE_EVT, &p, 0);
+    pthread_mutex_unlock(&bt.m);
+    return ESP_OK;
+}
+
+/* the test side */
+
+void mock_addr(const char *s, uint8_t *addr) {
+    unsigned a[ESP_BD_ADDR_LEN];
+    if (sscanf(s, "%x:%x:%x:%x:%x:%x", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) != ESP_BD_ADDR_LEN) {
+        fprintf(stderr, "bad address %s\n", s);
+        abort();
+    }
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        addr[i] = a[i];
+    }
+}
+
+void mock_bt_reset(void) {
+    pthread_mutex_lock(&bt.m);
+    purge();
+    for (int i = 0; i < MOCK_PEERS; i++) {
+        free(bt.peer[i].rx);
+    }
+    memset(bt.peer, 0, sizeof(bt.peer));
+    memset(bt.link, 0, sizeof(bt.link));
+    bt.bonds = 0;
+    bt.ctrl = ESP_BT_CONTROLLER_STATUS_IDLE;
+    bt.ble_released = false;
+    bt.bd = ESP_BLUEDROID_STATUS_UNINITIALIZED;
+    bt.gap_cb = NULL;
+    bt.spp_cb = NULL;
+    bt.spp_up = false;
+    bt.srv_on = false;
+    bt.inq = 0;
+    bt.write_fail = 0;
+    bt.start_fail = 0;
+    pthread_mutex_unlock(&bt.m);
+    nvs_flash_erase();
+}
+
+mock_peer_t *mock_peer_add(const char *addr, const char *name, uint8_t scn, const char *pin) {
+    mock_peer_t *peer = NULL;
+    pthread_mutex_lock(&bt.m);
+    for (int i = 0; i < MOCK_PEERS; i++) {
+        if (bt.peer[i].used == false) {
+            peer = &bt.peer[i];
+            memset(peer, 0, sizeof(*peer));
+            peer->used = true;
+            mock_addr(addr, peer->addr);
+            snprintf(peer->name, sizeof(peer->name), "%s", name);
+            snprintf(peer->pin, sizeof(peer->pin), "%s", pin);
+            peer->scn = scn;
+            peer->in_range = true;
+            peer->rssi = -60;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bt.m);
+    return peer;
+}
+
+mock_peer_t *mock_peer(const char *addr) {
+    esp_bd_addr_t a;
+    mock_addr(addr, a);
+    pthread_mutex_lock(&bt.m);
+    mock_peer_t *peer = peer_find(a);
+    pthread_mutex_unlock(&bt.m);
+    return peer;
+}
+
+bool mock_peer_connect(mock_peer_t *peer, const char *pin) {
+    pthread_mutex_lock(&bt.m);
+    if (bd_enabled() == false || bt.srv_on == false || bt.c_mode != ESP_BT_CONNECTABLE || peer->in_range == false) {
+        pthread_mutex_unlock(&bt.m);
+        return false; // the page is not answered
+    }
+    link_t *l = link_new(peer, 0, true);
+    uint32_t t = hop(peer);
+    post_acl(peer->addr, true, ESP_BT_STATUS_SUCCESS, 0);
+    bool ok = bonded(peer->addr)
+        || (pin != NULL && strlen(pin) == bt.pin_len && memcmp(pin, bt.pin, bt.pin_len) == 0);
+    post_auth(peer, ok, t);
+    if (ok && l != NULL) {
+        bond_add(peer->addr);
+        link_open(l, 2 * t);
+    } else {
+        post_acl(peer->addr, false, 0x05, 2 * t); // authentication failure
+        if (l != NULL) {
+            l->state = LINK_FREE;
+        }
+    }
+    pthread_mutex_unlock(&bt.m);
+    return ok && l != NULL;
+}
+
+void mock_peer_send(mock_peer_t *peer, const void *data, size_t len) {
+    const uint8_t *d = data;
+    pthread_mutex_lock(&bt.m);
+    for (size_t off = 0; peer->handle != 0 && off < len; off += ESP_SPP_MAX_MTU) {
+        size_t n = len - off < ESP_SPP_MAX_MTU ? len - off : ESP_SPP_MAX_MTU;
+        ev_t *e = ev_new(EV_SPP, ESP_SPP_DATA_IND_EVT);
+        e->data = malloc(n);
+        memcpy(e->data, d + off, n);
+        e->spp.data_ind.status = ESP_SPP_SUCCESS;
+        e->spp.data_ind.handle = peer->handle;
+        e->spp.data_ind.len = n;
+        e->spp.data_ind.data = e->data;
+        post(e, 0);
+    }
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_peer_drop(mock_peer_t *peer) {
+    pthread_mutex_lock(&bt.m);
+    link_t *l = link_find(peer->handle);
+    if (l != NULL) {
+        link_close(l, ESP_SPP_SUCCESS, true, 0);
+    }
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_peer_cong(mock_peer_t *peer, bool cong) {
+    pthread_mutex_lock(&bt.m);
+    peer->cong = cong;
+    if (peer->handle != 0) {
+        esp_spp_cb_param_t p = { 0 };
+        p.cong.status = ESP_SPP_SUCCESS;
+        p.cong.handle = peer->handle;
+        p.cong.cong = cong;
+        post_spp(ESP_SPP_CONG_EVT, &p, 0);
+    }
+    pthread_mutex_unlock(&bt.m);
+}
+
+size_t mock_peer_recv(mock_peer_t *peer, void *buf, size_t max) {
+    pthread_mutex_lock(&bt.m);
+    size_t n = peer->rx_len < max ? peer->rx_len : max;
+    memcpy(buf, peer->rx, n);
+    memmove(peer->rx, peer->rx + n, peer->rx_len - n);
+    peer->rx_len -= n;
+    pthread_mutex_unlock(&bt.m);
+    return n;
+}
+
+void mock_bond(const char *addr) {
+    esp_bd_addr_t a;
+    mock_addr(addr, a);
+    pthread_mutex_lock(&bt.m);
+    bond_add(a);
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_start_fail(int n) {
+    pthread_mutex_lock(&bt.m);
+    bt.start_fail = n;
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_write_fail(int n) {
+    pthread_mutex_lock(&bt.m);
+    bt.write_fail = n;
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_post_spp(esp_spp_cb_event_t event, const esp_spp_cb_param_t *param, uint32_t delay_ms) {
+    pthread_mutex_lock(&bt.m);
+    post_spp(event, param, delay_ms);
+    pthread_mutex_unlock(&bt.m);
+}
+
+void mock_post_gap(esp_bt_gap_cb_event_t event, const esp_bt_gap_cb_param_t *param, uint32_t delay_ms) {
+    pthread_mutex_lock(&bt.m);
+    post_gap(event, param, delay_ms);
+    pthread_mutex_unlock(&bt.m);
+}
+
+uint32_t mock_next_handle(void) {
+    pthread_mutex_lock(&bt.m);
+    uint32_t h = bt.next_handle;
+    pthread_mutex_unlock(&bt.m);
+    return h;
+}
+
+void mock_settle(void) {
+    uint32_t t0 = mp_hal_ticks_ms();
+    for (;;) {
+        bool idle = mock_bt_idle();
+        mock_sched_run();
+        if (idle) {
+            return;
+        }
+        if (mp_hal_ticks_ms() - t0 > SETTLE_MS) {
+            fprintf(stderr, "mock_settle: the Bluetooth thread is still busy after %d ms\n", SETTLE_MS);
+            mock_failed++;
+            return;
+        }
+        mp_hal_delay_ms(1);
+    }
+}
+
+bool mock_bt_idle(void) {
+    pthread_mutex_lock(&bt.m);
+    bool idle = bt.queue == NULL && bt.busy == false;
+    pthread_mutex_unlock(&bt.m);
+    return idle;
+}
+
+void mock_spp_event(esp_spp_cb_event_t event, esp_spp_cb_param_t *param) {
+    pthread_mutex_lock(&bt.m);
+    esp_spp_cb_t *spp_cb = bt.spp_cb;
+    pthread_mutex_unlock(&bt.m);
+    if (spp_cb != NULL) {
+        spp_cb(event, param);
+    }
+}
+
+bool mock_discoverable(void) {
+    pthread_mutex_lock(&bt.m);
+    bool on = bd_enabled() && bt.c_mode == ESP_BT_CONNECTABLE && bt.d_mode != ESP_BT_NON_DISCOVERABLE;
+    pthread_mutex_unlock(&bt.m);
+    return on;
+}
+
+bool mock_spp_cb_is(esp_spp_cb_t *cb) {
+    pthread_mutex_lock(&bt.m);
+    bool is = bt.spp_cb == cb;
+    pthread_mutex_unlock(&bt.m);
+    return is;
+}
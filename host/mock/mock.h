@@ -0,0 +1,135 @@
+/*
+ * Host build of bts and btm against mocks of MicroPython, FreeRTOS,
+ * NVS and Bluedroid. This is what the test drivers see of the mocks.
+ *
+ * The modules run as they do on the ESP32: the test is the MicroPython
+ * task and calls the module functions, the SPP and GAP callbacks come
+ * from a Bluetooth thread, timer callbacks from a timer thread. The
+ * remote devices are simulated in mock/bt.c, each API call posts the
+ * events the real stack answers with, in the same order.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "py/obj.h"
+#include "py/runtime.h"
+#include "py/mphal.h"
+#include "esp_gap_bt_api.h"
+#include "esp_spp_api.h"
+
+extern const mp_obj_module_t mp_module_bts;
+extern const mp_obj_module_t mp_module_btm;
+
+/* MicroPython side */
+
+/* module.name(*args, **kw), args holds the positional ones, then key, value pairs */
+mp_obj_t mock_call(const mp_obj_module_t *module, const char *name, size_t n_args, size_t n_kw, const mp_obj_t *args);
+/* self.name(*args), a method from the type's locals dict */
+mp_obj_t mock_method(mp_obj_t self, const char *name, size_t n_args, const mp_obj_t *args);
+mp_obj_t mock_attr(const mp_obj_module_t *module, const char *name);
+/* the exception of the last mock_call or mock_method that raised, NULL if it returned */
+mp_obj_exception_t *mock_exc(void);
+/* its errno if it was an OSError, else 0 */
+int mock_errno(void);
+/* run what esp_spp_cb or a timer scheduled, as the VM does between bytecodes */
+void mock_sched_run(void);
+
+mp_obj_t mock_str(const char *s);
+mp_obj_t mock_bytes(const void *data, size_t len);
+mp_obj_t mock_qstr(const char *name); /* for keyword names */
+/* str, bytes or qstr o holds exactly s */
+bool mock_eq(mp_obj_t o, const void *s, size_t len);
+mp_obj_t mock_dict_get(mp_obj_t dict, const char *key);
+mp_int_t mock_dict_int(mp_obj_t dict, const char *key);
+
+/* Bluetooth side, the remote devices */
+
+#define MOCK_PEERS 8
+
+typedef struct _mock_peer_t {
+    bool used;
+    esp_bd_addr_t addr;
+    char name[32];
+    char pin[17];
+    uint8_t scn;       /* its SPP server channel */
+    bool in_range;     /* answers inquiry, SDP and pages */
+    int8_t rssi;
+    uint32_t delay_ms; /* its answers come that much later */
+    bool echo;         /* writes to it come straight back */
+    bool cong;
+    uint32_t handle;   /* SPP handle while connected, 0 else */
+    uint8_t *rx;       /* what was written to it */
+    size_t rx_len;
+    size_t rx_alloc;
+} mock_peer_t;
+
+/* all remote devices, bonds and NVS gone, the controller and Bluedroid down */
+void mock_bt_reset(void);
+mock_peer_t *mock_peer_add(const char *addr, const char *name, uint8_t scn, const char *pin);
+mock_peer_t *mock_peer(const char *addr);
+/*
+ * a remote master connects to the local SPP server with pin, NULL for
+ * none; false if the server did not answer the page or pairing failed
+ */
+bool mock_peer_connect(mock_peer_t *peer, const char *pin);
+/* data from the remote, cut into MTU sized ESP_SPP_DATA_IND_EVTs */
+void mock_peer_send(mock_peer_t *peer, const void *data, size_t len);
+/* the link is lost, from its side */
+void mock_peer_drop(mock_peer_t *peer);
+/* the link to it becomes congested or clear, ESP_SPP_CONG_EVT */
+void mock_peer_cong(mock_peer_t *peer, bool cong);
+/* what was written to it since the last call, up to max bytes */
+size_t mock_peer_recv(mock_peer_t *peer, void *buf, size_t max);
+void mock_bond(const char *addr);
+
+/* the next n esp_spp_write calls get ESP_SPP_WRITE_EVT with an error */
+void mock_write_fail(int n);
+/*
+ * the next n esp_bt_gap_start_discovery, esp_spp_start_discovery and
+ * esp_spp_connect calls return ESP_FAIL and post nothing
+ */
+void mock_start_fail(int n);
+/* raw events, as if the stack sent them, after delay_ms */
+void mock_post_spp(esp_spp_cb_event_t event, const esp_spp_cb_param_t *param, uint32_t delay_ms);
+void mock_post_gap(esp_bt_gap_cb_event_t event, const esp_bt_gap_cb_param_t *param, uint32_t delay_ms);
+/* the handle the next client connect gets */
+uint32_t mock_next_handle(void);
+/* wait until the Bluetooth thread has nothing left to do, running the scheduler */
+void mock_settle(void);
+/* the Bluetooth thread has nothing queued and is not in a callback */
+bool mock_bt_idle(void);
+/*
+ * an SPP event straight into the registered callback on this thread, as
+ * the stack would send it; only while mock_bt_idle(), for timing the handler
+ */
+void mock_spp_event(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
+/* scan mode and callbacks as the stack has them */
+bool mock_discoverable(void);
+bool mock_spp_cb_is(esp_spp_cb_t *cb);
+void mock_addr(const char *s, uint8_t *addr);
+
+/* wait for cond for at most ms, running the scheduler, false on timeout */
+#define MOCK_WAIT_FOR(cond, ms) ({ \
+        uint32_t _t0 = mp_hal_ticks_ms(); \
+        bool _ok; \
+        while (!(_ok = (cond)) && mp_hal_ticks_ms() - _t0 < (ms)) { \
+            mock_sched_run(); \
+            mp_hal_delay_ms(1); \
+        } \
+        _ok; \
+    })
+
+/* test bookkeeping */
+
+extern int mock_failed;
+extern int mock_checked;
+
+#define CHECK(cond) do { \
+        mock_checked++; \
+        if (!(cond)) { \
+            mock_failed++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
@@ -0,0 +1,840 @@
+/*
+ * Host build: the MicroPython runtime under the modules. Objects come
+ * from malloc and are never collected, exceptions are nlr jumps as in
+ * the real VM, scheduled callbacks wait in a ring until the test runs
+ * them with mock_sched_run(), which is where the VM would run them.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "py/obj.h"
+#include "py/runtime.h"
+#include "py/stream.h"
+#include "py/mphal.h"
+#include "py/mperrno.h"
+#include "mock.h"
+
+int mock_failed;
+int mock_checked;
+
+mp_state_port_t mp_state_port;
+
+const mp_obj_base_t mp_const_none_obj = { &mp_type_NoneType };
+const mp_obj_base_t mp_const_false_obj = { &mp_type_bool };
+const mp_obj_base_t mp_const_true_obj = { &mp_type_bool };
+
+#define TYPE(t, n) const mp_obj_type_t t = { .base = { &mp_type_type }, .name = n }
+TYPE(mp_type_type, 0);
+TYPE(mp_type_NoneType, 0);
+TYPE(mp_type_bool, 0);
+TYPE(mp_type_int, 0);
+TYPE(mp_type_str, 0);
+TYPE(mp_type_bytes, 0);
+TYPE(mp_type_bytearray, 0);
+TYPE(mp_type_tuple, 0);
+TYPE(mp_type_list, 0);
+TYPE(mp_type_dict, 0);
+TYPE(mp_type_module, 0);
+TYPE(mp_type_fun_builtin_0, 0);
+TYPE(mp_type_fun_builtin_1, 0);
+TYPE(mp_type_fun_builtin_2, 0);
+TYPE(mp_type_fun_builtin_3, 0);
+TYPE(mp_type_fun_builtin_var, 0);
+TYPE(mp_type_fun_builtin_kw, 0);
+TYPE(mp_type_BaseException, 0);
+TYPE(mp_type_MemoryError, 0);
+TYPE(mp_type_OSError, 0);
+TYPE(mp_type_RuntimeError, 0);
+TYPE(mp_type_TypeError, 0);
+TYPE(mp_type_ValueError, 0);
+
+/* qstrs */
+
+static const char *const qstr_names[] = {
+    "",
+#define QDEF(id, str) str,
+#include "genhdr/qstrdefs.generated.h"
+#undef QDEF
+};
+
+const char *qstr_str(qstr q) {
+    return q < MP_ARRAY_SIZE(qstr_names) ? qstr_names[q] : "";
+}
+
+qstr qstr_find_strn(const char *str, size_t str_len) {
+    for (qstr q = 1; q < MP_ARRAY_SIZE(qstr_names); q++) {
+        if (strlen(qstr_names[q]) == str_len && memcmp(qstr_names[q], str, str_len) == 0) {
+            return q;
+        }
+    }
+    return MP_QSTRnull;
+}
+
+/* memory */
+
+void *m_malloc(size_t num_bytes) {
+    void *p = calloc(1, num_bytes ? num_bytes : 1);
+    if (p == NULL) {
+        mp_raise_msg(&mp_type_MemoryError, NULL);
+    }
+    return p;
+}
+
+void vstr_init(vstr_t *vstr, size_t alloc) {
+    vstr->alloc = alloc + 1;
+    vstr->len = 0;
+    vstr->buf = m_malloc(vstr->alloc);
+    vstr->fixed_buf = false;
+}
+
+void vstr_init_len(vstr_t *vstr, size_t len) {
+    vstr_init(vstr, len);
+    vstr->len = len;
+}
+
+void vstr_clear(vstr_t *vstr) {
+    if (vstr->fixed_buf == false) {
+        free(vstr->buf);
+    }
+    vstr->buf = NULL;
+}
+
+/* nlr, one chain per thread as in the real VM */
+
+static __thread nlr_buf_t *nlr_top;
+
+void nlr_push_tail(nlr_buf_t *top) {
+    top->prev = nlr_top;
+    nlr_top = top;
+}
+
+void nlr_pop(void) {
+    nlr_top = nlr_top->prev;
+}
+
+void nlr_jump(void *val) {
+    nlr_buf_t *top = nlr_top;
+    if (top == NULL) {
+        mp_obj_exception_t *e = val;
+        fprintf(stderr, "uncaught exception: %s\n", e->msg);
+        abort();
+    }
+    top->ret_val = val;
+    nlr_top = top->prev;
+    longjmp(top->jmpbuf, 1);
+}
+
+/* exceptions */
+
+static NORETURN void raise(const mp_obj_type_t *type, int errno_, const char *fmt, va_list ap) {
+    mp_obj_exception_t *e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        abort();
+    }
+    e->base.type = type;
+    e->errno_ = errno_;
+    if (fmt != NULL) {
+        vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+    }
+    nlr_jump(e);
+}
+
+void mp_raise_msg(const mp_obj_type_t *exc_type, mp_rom_error_text_t msg) {
+    mp_raise_msg_varg(exc_type, msg == NULL ? NULL : "%s", msg);
+}
+
+void mp_raise_msg_varg(const mp_obj_type_t *exc_type, mp_rom_error_text_t fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    raise(exc_type, 0, fmt, ap);
+}
+
+void mp_raise_ValueError(mp_rom_error_text_t msg) {
+    mp_raise_msg(&mp_type_ValueError, msg);
+}
+
+void mp_raise_TypeError(mp_rom_error_text_t msg) {
+    mp_raise_msg(&mp_type_TypeError, msg);
+}
+
+static NORETURN void raise_errno(int errno_, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    raise(&mp_type_OSError, errno_, fmt, ap);
+}
+
+void mp_raise_OSError(int errno_) {
+    raise_errno(errno_, "[Errno %d]", errno_);
+}
+
+/* objects */
+
+const mp_obj_type_t *mp_obj_get_type(mp_const_obj_t o) {
+    if (MP_OBJ_IS_SMALL_INT(o)) {
+        return &mp_type_int;
+    }
+    if (MP_OBJ_IS_QSTR(o)) {
+        return &mp_type_str;
+    }
+    return ((const mp_obj_base_t *) o)->type;
+}
+
+bool mp_obj_is_str(mp_const_obj_t o) {
+    return mp_obj_get_type(o) == &mp_type_str;
+}
+
+static bool is_fun(mp_const_obj_t o) {
+    const mp_obj_type_t *t = mp_obj_get_type(o);
+    return t == &mp_type_fun_builtin_0 || t == &mp_type_fun_builtin_1 || t == &mp_type_fun_builtin_2
+           || t == &mp_type_fun_builtin_3 || t == &mp_type_fun_builtin_var || t == &mp_type_fun_builtin_kw;
+}
+
+bool mp_obj_is_callable(mp_obj_t o) {
+    return is_fun(o);
+}
+
+/* str, bytes or bytearray data, false for anything else */
+static bool str_data(mp_const_obj_t o, const byte **data, size_t *len) {
+    if (MP_OBJ_IS_QSTR(o)) {
+        *data = (const byte *) qstr_str(MP_OBJ_QSTR_VALUE(o));
+        *len = strlen((const char *) *data);
+        return true;
+    }
+    const mp_obj_type_t *t = mp_obj_get_type(o);
+    if (t == &mp_type_str || t == &mp_type_bytes) {
+        const mp_obj_str_t *s = o;
+        *data = s->data;
+        *len = s->len;
+        return true;
+    }
+    if (t == &mp_type_bytearray) {
+        const mp_obj_array_t *a = o;
+        *data = a->items;
+        *len = a->len;
+        return true;
+    }
+    return false;
+}
+
+bool mp_obj_is_true(mp_obj_t o) {
+    if (o == mp_const_false || o == mp_const_none) {
+        return false;
+    }
+    if (o == mp_const_true) {
+        return true;
+    }
+    if (MP_OBJ_IS_SMALL_INT(o)) {
+        return MP_OBJ_SMALL_INT_VALUE(o) != 0;
+    }
+    const byte *data;
+    size_t len;
+    if (str_data(o, &data, &len)) {
+        return len > 0;
+    }
+    const mp_obj_type_t *t = mp_obj_get_type(o);
+    if (t == &mp_type_tuple) {
+        return ((mp_obj_tuple_t *) o)->len > 0;
+    }
+    if (t == &mp_type_list) {
+        return ((mp_obj_list_t *) o)->len > 0;
+    }
+    if (t == &mp_type_dict) {
+        return ((mp_obj_dict_t *) o)->map.used > 0;
+    }
+    return true;
+}
+
+bool mp_obj_equal(mp_obj_t o1, mp_obj_t o2) {
+    if (o1 == o2) {
+        return true;
+    }
+    const byte *d1, *d2;
+    size_t l1, l2;
+    if (mp_obj_is_str(o1) && mp_obj_is_str(o2) && str_data(o1, &d1, &l1) && str_data(o2, &d2, &l2)) {
+        return l1 == l2 && memcmp(d1, d2, l1) == 0;
+    }
+    return false;
+}
+
+mp_int_t mp_obj_get_int(mp_const_obj_t arg) {
+    if (MP_OBJ_IS_SMALL_INT(arg)) {
+        return MP_OBJ_SMALL_INT_VALUE(arg);
+    }
+    if (arg == mp_const_false) {
+        return 0;
+    }
+    if (arg == mp_const_true) {
+        return 1;
+    }
+    mp_raise_TypeError(MP_ERROR_TEXT("can't convert to int"));
+}
+
+/* a 64 bit host has 63 bit small ints, every value the modules make fits */
+mp_obj_t mp_obj_new_int(mp_int_t value) {
+    return MP_OBJ_NEW_SMALL_INT(value);
+}
+
+mp_obj_t mp_obj_new_int_from_uint(mp_uint_t value) {
+    return MP_OBJ_NEW_SMALL_INT(value);
+}
+
+mp_obj_t mp_obj_new_int_from_ll(long long val) {
+    return MP_OBJ_NEW_SMALL_INT(val);
+}
+
+mp_obj_t mp_obj_new_int_from_ull(unsigned long long val) {
+    return MP_OBJ_NEW_SMALL_INT(val);
+}
+
+static mp_obj_t new_str(const mp_obj_type_t *type, const void *data, size_t len) {
+    mp_obj_str_t *s = m_new_obj(mp_obj_str_t);
+    byte *buf = m_malloc(len + 1);
+    if (len > 0) {
+        memcpy(buf, data, len);
+    }
+    s->base.type = type;
+    s->len = len;
+    s->data = buf;
+    return MP_OBJ_FROM_PTR(s);
+}
+
+mp_obj_t mp_obj_new_str(const char *data, size_t len) {
+    return new_str(&mp_type_str, data, len);
+}
+
+mp_obj_t mp_obj_new_bytes(const byte *data, size_t len) {
+    return new_str(&mp_type_bytes, data, len);
+}
+
+mp_obj_t mp_obj_new_bytearray(size_t n, const void *items) {
+    mp_obj_array_t *a = m_new_obj(mp_obj_array_t);
+    a->base.type = &mp_type_bytearray;
+    a->len = n;
+    a->items = m_malloc(n);
+    if (items != NULL) {
+        memcpy(a->items, items, n);
+    }
+    return MP_OBJ_FROM_PTR(a);
+}
+
+mp_obj_t mp_obj_new_str_from_vstr(const mp_obj_type_t *type, vstr_t *vstr) {
+    mp_obj_str_t *s = m_new_obj(mp_obj_str_t);
+    vstr->buf[vstr->len] = '\0';
+    s->base.type = type;
+    s->len = vstr->len;
+    s->data = (const byte *) vstr->buf;
+    vstr->buf = NULL;
+    return MP_OBJ_FROM_PTR(s);
+}
+
+const char *mp_obj_str_get_data(mp_obj_t self_in, size_t *len) {
+    const byte *data;
+    if (mp_obj_get_type(self_in) == &mp_type_bytearray || str_data(self_in, &data, len) == false) {
+        mp_raise_TypeError(MP_ERROR_TEXT("can't convert to str implicitly"));
+    }
+    return (const char *) data;
+}
+
+const char *mp_obj_str_get_str(mp_obj_t self_in) {
+    size_t len;
+    return mp_obj_str_get_data(self_in, &len);
+}
+
+mp_obj_t mp_obj_new_tuple(size_t n, const mp_obj_t *items) {
+    mp_obj_tuple_t *t = m_malloc(sizeof(*t) + n * sizeof(mp_obj_t));
+    t->base.type = &mp_type_tuple;
+    t->len = n;
+    for (size_t i = 0; i < n && items != NULL; i++) {
+        t->items[i] = items[i];
+    }
+    return MP_OBJ_FROM_PTR(t);
+}
+
+mp_obj_t mp_obj_new_list(size_t n, mp_obj_t *items) {
+    mp_obj_list_t *l = m_new_obj(mp_obj_list_t);
+    l->base.type = &mp_type_list;
+    l->alloc = n < 4 ? 4 : n;
+    l->len = n;
+    l->items = m_new(mp_obj_t, l->alloc);
+    for (size_t i = 0; i < n; i++) {
+        l->items[i] = items == NULL ? MP_OBJ_NULL : items[i];
+    }
+    return MP_OBJ_FROM_PTR(l);
+}
+
+mp_obj_t mp_obj_list_append(mp_obj_t self_in, mp_obj_t arg) {
+    mp_obj_list_t *l = MP_OBJ_TO_PTR(self_in);
+    if (l->len == l->alloc) {
+        l->alloc *= 2;
+        l->items = realloc(l->items, l->alloc * sizeof(mp_obj_t));
+    }
+    l->items[l->len++] = arg;
+    return mp_const_none;
+}
+
+void mp_obj_get_array(mp_obj_t o, size_t *len, mp_obj_t **items) {
+    const mp_obj_type_t *t = mp_obj_get_type(o);
+    if (t == &mp_type_tuple) {
+        mp_obj_tuple_t *tu = MP_OBJ_TO_PTR(o);
+        *len = tu->len;
+        *items = tu->items;
+    } else if (t == &mp_type_list) {
+        mp_obj_list_t *l = MP_OBJ_TO_PTR(o);
+        *len = l->len;
+        *items = l->items;
+    } else {
+        mp_raise_TypeError(MP_ERROR_TEXT("object isn't a tuple or list"));
+    }
+}
+
+static mp_map_elem_t *map_find(mp_map_t *map, mp_obj_t key) {
+    for (size_t i = 0; i < map->used; i++) {
+        if (mp_obj_equal(map->table[i].key, key)) {
+            return &map->table[i];
+        }
+    }
+    return NULL;
+}
+
+mp_obj_t mp_obj_new_dict(size_t n_args) {
+    mp_obj_dict_t *d = m_new_obj(mp_obj_dict_t);
+    d->base.type = &mp_type_dict;
+    d->map.alloc = n_args < 4 ? 4 : n_args;
+    d->map.table = m_new(mp_map_elem_t, d->map.alloc);
+    return MP_OBJ_FROM_PTR(d);
+}
+
+mp_obj_t mp_obj_dict_store(mp_obj_t self_in, mp_obj_t key, mp_obj_t value) {
+    mp_obj_dict_t *d = MP_OBJ_TO_PTR(self_in);
+    mp_map_elem_t *e = map_find(&d->map, key);
+    if (e == NULL) {
+        if (d->map.used == d->map.alloc) {
+            d->map.alloc *= 2;
+            d->map.table = realloc(d->map.table, d->map.alloc * sizeof(mp_map_elem_t));
+        }
+        e = &d->map.table[d->map.used++];
+        e->key = key;
+    }
+    e->value = value;
+    return self_in;
+}
+
+/* MP_OBJ_NULL for a missing key, the tests check for that */
+mp_obj_t mp_obj_dict_get(mp_obj_t self_in, mp_obj_t index) {
+    mp_obj_dict_t *d = MP_OBJ_TO_PTR(self_in);
+    mp_map_elem_t *e = map_find(&d->map, index);
+    return e == NULL ? MP_OBJ_NULL : e->value;
+}
+
+bool mp_get_buffer(mp_obj_t obj, mp_buffer_info_t *bufinfo, mp_uint_t flags) {
+    const mp_obj_type_t *t = mp_obj_get_type(obj);
+    if (t == &mp_type_bytearray) {
+        mp_obj_array_t *a = MP_OBJ_TO_PTR(obj);
+        bufinfo->buf = a->items;
+        bufinfo->len = a->len;
+        bufinfo->typecode = 'B';
+        return true;
+    }
+    if ((flags & MP_BUFFER_WRITE) == 0 && (t == &mp_type_str || t == &mp_type_bytes)) {
+        mp_obj_str_t *s = MP_OBJ_TO_PTR(obj);
+        bufinfo->buf = (void *) s->data;
+        bufinfo->len = s->len;
+        bufinfo->typecode = 'B';
+        return true;
+    }
+    return false;
+}
+
+void mp_get_buffer_raise(mp_obj_t obj, mp_buffer_info_t *bufinfo, mp_uint_t flags) {
+    if (mp_get_buffer(obj, bufinfo, flags) == false) {
+        mp_raise_TypeError(MP_ERROR_TEXT("object with buffer protocol required"));
+    }
+}
+
+/* arguments and calls */
+
+void mp_arg_parse_all(size_t n_pos, const mp_obj_t *pos, mp_map_t *kws, size_t n_allowed,
+    const mp_arg_t *allowed, mp_arg_val_t *out_vals) {
+    size_t pos_found = 0, kws_found = 0;
+    for (size_t i = 0; i < n_allowed; i++) {
+        mp_obj_t given;
+        if (i < n_pos && (allowed[i].flags & MP_ARG_KW_ONLY) == 0) {
+            given = pos[i];
+            pos_found++;
+        } else {
+            mp_map_elem_t *kw = kws == NULL ? NULL : map_find(kws, MP_OBJ_NEW_QSTR(allowed[i].qst));
+            if (kw == NULL) {
+                if (allowed[i].flags & MP_ARG_REQUIRED) {
+                    mp_raise_msg_varg(&mp_type_TypeError, "'%s' argument required", qstr_str(allowed[i].qst));
+                }
+                out_vals[i] = allowed[i].defval;
+                continue;
+            }
+            given = kw->value;
+            kws_found++;
+        }
+        switch (allowed[i].flags & MP_ARG_KIND_MASK) {
+            case MP_ARG_BOOL:
+                out_vals[i].u_bool = mp_obj_is_true(given);
+                break;
+            case MP_ARG_INT:
+                out_vals[i].u_int = mp_obj_get_int(given);
+                break;
+            default:
+                out_vals[i].u_obj = given;
+                break;
+        }
+    }
+    if (pos_found < n_pos) {
+        mp_raise_TypeError(MP_ERROR_TEXT("extra positional arguments given"));
+    }
+    if (kws != NULL && kws_found < kws->used) {
+        mp_raise_TypeError(MP_ERROR_TEXT("extra keyword arguments given"));
+    }
+}
+
+mp_obj_t mp_call_function_n_kw(mp_obj_t fun, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    if (is_fun(fun) == false) {
+        mp_raise_TypeError(MP_ERROR_TEXT("object isn't callable"));
+    }
+    const mp_obj_fun_builtin_t *f = MP_OBJ_TO_PTR(fun);
+    const mp_obj_type_t *t = f->base.type;
+    if (n_args < f->n_args_min || n_args > f->n_args_max) {
+        mp_raise_TypeError(MP_ERROR_TEXT("function takes wrong number of arguments"));
+    }
+    if (t == &mp_type_fun_builtin_kw) {
+        mp_map_elem_t table[n_kw + 1];
+        mp_map_t kw = { n_kw, n_kw, table };
+        for (size_t i = 0; i < n_kw; i++) {
+            table[i].key = args[n_args + 2 * i];
+            table[i].value = args[n_args + 2 * i + 1];
+        }
+        return f->fun.kw(n_args, args, &kw);
+    }
+    if (n_kw > 0) {
+        mp_raise_TypeError(MP_ERROR_TEXT("function doesn't take keyword arguments"));
+    }
+    if (t == &mp_type_fun_builtin_0) {
+        return f->fun._0();
+    } else if (t == &mp_type_fun_builtin_1) {
+        return f->fun._1(args[0]);
+    } else if (t == &mp_type_fun_builtin_2) {
+        return f->fun._2(args[0], args[1]);
+    } else if (t == &mp_type_fun_builtin_3) {
+        return f->fun._3(args[0], args[1], args[2]);
+    }
+    return f->fun.var(n_args, args);
+}
+
+mp_obj_t mp_call_function_0(mp_obj_t fun) {
+    return mp_call_function_n_kw(fun, 0, 0, NULL);
+}
+
+mp_obj_t mp_call_function_1(mp_obj_t fun, mp_obj_t arg) {
+    return mp_call_function_n_kw(fun, 1, 0, &arg);
+}
+
+/* the scheduler, filled from any thread, run on the MicroPython one */
+
+#define SCHED_DEPTH 8
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned head, tail;
+    struct {
+        mp_obj_t fun;
+        mp_obj_t arg;
+    } q[SCHED_DEPTH];
+} sched = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+bool mp_sched_schedule(mp_obj_t function, mp_obj_t arg) {
+    bool ok = false;
+    pthread_mutex_lock(&sched.lock);
+    if (sched.tail - sched.head < SCHED_DEPTH) {
+        sched.q[sched.tail % SCHED_DEPTH].fun = function;
+        sched.q[sched.tail % SCHED_DEPTH].arg = arg;
+        sched.tail++;
+        ok = true;
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return ok;
+}
+
+void mp_handle_pending(bool raise_exc) {
+    (void) raise_exc;
+    for (;;) {
+        pthread_mutex_lock(&sched.lock);
+        if (sched.head == sched.tail) {
+            pthread_mutex_unlock(&sched.lock);
+            return;
+        }
+        mp_obj_t fun = sched.q[sched.head % SCHED_DEPTH].fun;
+        mp_obj_t arg = sched.q[sched.head % SCHED_DEPTH].arg;
+        sched.head++;
+        pthread_mutex_unlock(&sched.lock);
+        mp_call_function_1(fun, arg);
+    }
+}
+
+/* hal, ticks count from the first call */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t start_ns;
+
+/* before any thread, ticks start at 1 s so that 0 never means now */
+__attribute__((constructor)) static void ticks_init(void) {
+    start_ns = now_ns() - 1000000000u;
+}
+
+static uint64_t since_start_ns(void) {
+    return now_ns() - start_ns;
+}
+
+mp_uint_t mp_hal_ticks_ms(void) {
+    return (uint32_t) (since_start_ns() / 1000000u);
+}
+
+mp_uint_t mp_hal_ticks_us(void) {
+    return (uint32_t) (since_start_ns() / 1000u);
+}
+
+/* nanoseconds stand in for cycles, wrapping at 32 bits as on the ESP32 */
+mp_uint_t mp_hal_ticks_cpu(void) {
+    return (uint32_t) since_start_ns();
+}
+
+void mp_hal_delay_ms(mp_uint_t ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+/* streams, the generic methods over mp_stream_p_t */
+
+static const mp_stream_p_t *stream_p(mp_obj_t self) {
+    const mp_obj_type_t *t = mp_obj_get_type(self);
+    if (t->protocol == NULL) {
+        mp_raise_TypeError(MP_ERROR_TEXT("stream operation not supported"));
+    }
+    return t->protocol;
+}
+
+static mp_obj_t stream_read(size_t n_args, const mp_obj_t *args) {
+    const mp_stream_p_t *p = stream_p(args[0]);
+    size_t size = n_args > 1 && args[1] != mp_const_none ? mp_obj_get_int(args[1]) : 4096;
+    vstr_t vstr;
+    vstr_init_len(&vstr, size);
+    int err;
+    mp_uint_t n = p->read(args[0], vstr.buf, size, &err);
+    if (n == MP_STREAM_ERROR) {
+        vstr_clear(&vstr);
+        if (err == MP_EAGAIN) {
+            return mp_const_none;
+        }
+        mp_raise_OSError(err);
+    }
+    vstr.len = n;
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+const mp_obj_fun_builtin_t mp_stream_read_obj = { { &mp_type_fun_builtin_var }, 1, 2, { .var = stream_read } };
+
+static mp_obj_t stream_readinto(size_t n_args, const mp_obj_t *args) {
+    const mp_stream_p_t *p = stream_p(args[0]);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_WRITE);
+    size_t size = bufinfo.len;
+    if (n_args > 2 && (size_t) mp_obj_get_int(args[2]) < size) {
+        size = mp_obj_get_int(args[2]);
+    }
+    int err;
+    mp_uint_t n = p->read(args[0], bufinfo.buf, size, &err);
+    if (n == MP_STREAM_ERROR) {
+        if (err == MP_EAGAIN) {
+            return mp_const_none;
+        }
+        mp_raise_OSError(err);
+    }
+    return MP_OBJ_NEW_SMALL_INT(n);
+}
+const mp_obj_fun_builtin_t mp_stream_readinto_obj = { { &mp_type_fun_builtin_var }, 2, 3, { .var = stream_readinto } };
+
+static mp_obj_t stream_readline(size_t n_args, const mp_obj_t *args) {
+    const mp_stream_p_t *p = stream_p(args[0]);
+    mp_int_t max = n_args > 1 ? mp_obj_get_int(args[1]) : -1;
+    vstr_t vstr;
+    vstr_init(&vstr, 16);
+    while (max < 0 || (mp_int_t) vstr.len < max) {
+        if (vstr.len + 1 >= vstr.alloc) {
+            vstr.alloc *= 2;
+            vstr.buf = realloc(vstr.buf, vstr.alloc);
+        }
+        int err;
+        mp_uint_t n = p->read(args[0], vstr.buf + vstr.len, 1, &err);
+        if (n == MP_STREAM_ERROR) {
+            if (err == MP_EAGAIN && vstr.len == 0) {
+                vstr_clear(&vstr);
+                return mp_const_none;
+            } else if (err == MP_EAGAIN) {
+                break;
+            }
+            vstr_clear(&vstr);
+            mp_raise_OSError(err);
+        }
+        if (n == 0) {
+            break;
+        }
+        if (vstr.buf[vstr.len++] == '\n') {
+            break;
+        }
+    }
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+const mp_obj_fun_builtin_t mp_stream_unbuffered_readline_obj = { { &mp_type_fun_builtin_var }, 1, 2, { .var = stream_readline } };
+
+static mp_obj_t stream_write(size_t n_args, const mp_obj_t *args) {
+    const mp_stream_p_t *p = stream_p(args[0]);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_READ);
+    int err;
+    mp_uint_t n = p->write(args[0], bufinfo.buf, bufinfo.len, &err);
+    if (n == MP_STREAM_ERROR) {
+        if (err == MP_EAGAIN) {
+            return mp_const_none;
+        }
+        mp_raise_OSError(err);
+    }
+    return MP_OBJ_NEW_SMALL_INT(n);
+}
+const mp_obj_fun_builtin_t mp_stream_write_obj = { { &mp_type_fun_builtin_var }, 2, 2, { .var = stream_write } };
+
+static mp_obj_t stream_ioctl(mp_obj_t self, mp_uint_t request) {
+    int err;
+    if (stream_p(self)->ioctl(self, request, 0, &err) == MP_STREAM_ERROR) {
+        mp_raise_OSError(err);
+    }
+    return mp_const_none;
+}
+
+static mp_obj_t stream_flush(mp_obj_t self) {
+    return stream_ioctl(self, MP_STREAM_FLUSH);
+}
+const mp_obj_fun_builtin_t mp_stream_flush_obj = { { &mp_type_fun_builtin_1 }, 1, 1, { ._1 = stream_flush } };
+
+static mp_obj_t stream_close(mp_obj_t self) {
+    return stream_ioctl(self, MP_STREAM_CLOSE);
+}
+const mp_obj_fun_builtin_t mp_stream_close_obj = { { &mp_type_fun_builtin_1 }, 1, 1, { ._1 = stream_close } };
+
+static mp_obj_t stream_exit(size_t n_args, const mp_obj_t *args) {
+    (void) n_args;
+    return stream_close(args[0]);
+}
+const mp_obj_fun_builtin_t mp_stream___exit___obj = { { &mp_type_fun_builtin_var }, 4, 4, { .var = stream_exit } };
+
+static mp_obj_t identity(mp_obj_t self) {
+    return self;
+}
+const mp_obj_fun_builtin_t mp_identity_obj = { { &mp_type_fun_builtin_1 }, 1, 1, { ._1 = identity } };
+
+/* the test side */
+
+static mp_obj_exception_t *last_exc;
+
+static mp_obj_t call(mp_obj_t fun, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    nlr_buf_t nlr;
+    last_exc = NULL;
+    if (nlr_push(&nlr) == 0) {
+        mp_obj_t ret = mp_call_function_n_kw(fun, n_args, n_kw, args);
+        nlr_pop();
+        return ret;
+    }
+    last_exc = nlr.ret_val;
+    return MP_OBJ_NULL;
+}
+
+static mp_obj_t dict_lookup(const mp_obj_dict_t *dict, const char *name) {
+    qstr q = qstr_find_strn(name, strlen(name));
+    mp_map_elem_t *e = q == MP_QSTRnull ? NULL : map_find((mp_map_t *) &dict->map, MP_OBJ_NEW_QSTR(q));
+    if (e == NULL) {
+        fprintf(stderr, "no attribute %s\n", name);
+        abort();
+    }
+    return e->value;
+}
+
+mp_obj_t mock_attr(const mp_obj_module_t *module, const char *name) {
+    return dict_lookup(module->globals, name);
+}
+
+mp_obj_t mock_call(const mp_obj_module_t *module, const char *name, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    return call(dict_lookup(module->globals, name), n_args, n_kw, args);
+}
+
+mp_obj_t mock_method(mp_obj_t self, const char *name, size_t n_args, const mp_obj_t *args) {
+    mp_obj_t all[n_args + 1];
+    all[0] = self;
+    memcpy(all + 1, args, n_args * sizeof(mp_obj_t));
+    return call(dict_lookup(mp_obj_get_type(self)->locals_dict, name), n_args + 1, 0, all);
+}
+
+mp_obj_exception_t *mock_exc(void) {
+    return last_exc;
+}
+
+int mock_errno(void) {
+    return last_exc != NULL && last_exc->base.type == &mp_type_OSError ? last_exc->errno_ : 0;
+}
+
+/* an exception from a handler is printed and swallowed, as the VM does for IRQs */
+void mock_sched_run(void) {
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        mp_handle_pending(true);
+        nlr_pop();
+    } else {
+        mp_obj_exception_t *e = nlr.ret_val;
+        fprintf(stderr, "uncaught exception in scheduled callback: %s\n", e->msg);
+        mock_failed++;
+    }
+}
+
+mp_obj_t mock_str(const char *s) {
+    return mp_obj_new_str(s, strlen(s));
+}
+
+mp_obj_t mock_bytes(const void *data, size_t len) {
+    return mp_obj_new_bytes(data, len);
+}
+
+mp_obj_t mock_qstr(const char *name) {
+    qstr q = qstr_find_strn(name, strlen(name));
+    if (q == MP_QSTRnull) {
+        fprintf(stderr, "no qstr %s\n", name);
+        abort();
+    }
+    return MP_OBJ_NEW_QSTR(q);
+}
+
+bool mock_eq(mp_obj_t o, const void *s, size_t len) {
+    const byte *data;
+    size_t n;
+    return o != MP_OBJ_NULL && str_data(o, &data, &n) && n == len && memcmp(data, s, len) == 0;
+}
+
+mp_obj_t mock_dict_get(mp_obj_t dict, const char *key) {
+    if (dict == MP_OBJ_NULL || mp_obj_get_type(dict) != &mp_type_dict) {
+        return MP_OBJ_NULL;
+    }
+    return mp_obj_dict_get(dict, mock_qstr(key));
+}
+
+mp_int_t mock_dict_int(mp_obj_t dict, const char *key) {
+    mp_obj_t v = mock_dict_get(dict, key);
+    return v == MP_OBJ_NULL ? -1 : mp_obj_get_int(v);
+}
@@ -0,0 +1,208 @@
+/*
+ * Host build: NVS as a table of blobs in memory, which outlives
+ * deinit() and init() as the flash does, plus the small ESP-IDF helpers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define NVS_ENTRIES 32
+#define NVS_NAMESPACES 8
+
+typedef struct {
+    bool used;
+    nvs_handle_t ns;
+    char key[16];
+    size_t len;
+    uint8_t data[512];
+} nvs_entry_t;
+
+static struct {
+    pthread_mutex_t m;
+    bool up;
+    char ns[NVS_NAMESPACES][16];
+    nvs_entry_t entry[NVS_ENTRIES];
+} nvs = { .m = PTHREAD_MUTEX_INITIALIZER };
+
+esp_err_t nvs_flash_init(void) {
+    pthread_mutex_lock(&nvs.m);
+    nvs.up = true;
+    pthread_mutex_unlock(&nvs.m);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&nvs.m);
+    memset(nvs.entry, 0, sizeof(nvs.entry));
+    memset(nvs.ns, 0, sizeof(nvs.ns));
+    nvs.up = false;
+    pthread_mutex_unlock(&nvs.m);
+    return ESP_OK;
+}
+
+/* handles are the namespace index + 1, NVS_RW set when opened for writing */
+#define NVS_RW 0x100
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs.m);
+    if (nvs.up == false) {
+        err = ESP_ERR_NVS_NOT_INITIALIZED;
+    } else {
+        int free_ns = -1;
+        for (int i = 0; i < NVS_NAMESPACES; i++) {
+            if (nvs.ns[i][0] != '\0' && strncmp(nvs.ns[i], name, sizeof(nvs.ns[i]) - 1) == 0) {
+                free_ns = i;
+                break;
+            }
+            if (nvs.ns[i][0] == '\0' && free_ns < 0) {
+                free_ns = i;
+            }
+        }
+        if (free_ns >= 0 && (nvs.ns[free_ns][0] != '\0' || open_mode == NVS_READWRITE)) {
+            snprintf(nvs.ns[free_ns], sizeof(nvs.ns[free_ns]), "%s", name);
+            *out_handle = (free_ns + 1) | (open_mode == NVS_READWRITE ? NVS_RW : 0);
+            err = ESP_OK;
+        }
+    }
+    pthread_mutex_unlock(&nvs.m);
+    return err;
+}
+
+static nvs_entry_t *nvs_find(nvs_handle_t handle, const char *key) {
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        if (nvs.entry[i].used && nvs.entry[i].ns == (handle & ~NVS_RW) && strcmp(nvs.entry[i].key, key) == 0) {
+            return &nvs.entry[i];
+        }
+    }
+    return NULL;
+}
+
+/* a NULL out_value asks for the length, a short buffer is an error */
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs.m);
+    nvs_entry_t *e = nvs_find(handle, key);
+    if (e == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (out_value == NULL) {
+        *length = e->len;
+    } else if (*length < e->len) {
+        *length = e->len;
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(out_value, e->data, e->len);
+        *length = e->len;
+    }
+    pthread_mutex_unlock(&nvs.m);
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&nvs.m);
+    nvs_entry_t *e = nvs_find(handle, key);
+    for (int i = 0; e == NULL && i < NVS_ENTRIES; i++) {
+        if (nvs.entry[i].used == false) {
+            e = &nvs.entry[i];
+        }
+    }
+    if ((handle & NVS_RW) == 0) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else if (e == NULL) {
+        err = ESP_ERR_NVS_NO_FREE_PAGES;
+    } else if (length > sizeof(e->data)) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        e->used = true;
+        e->ns = handle & ~NVS_RW;
+        snprintf(e->key, sizeof(e->key), "%s", key);
+        memcpy(e->data, value, length);
+        e->len = length;
+    }
+    pthread_mutex_unlock(&nvs.m);
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs.m);
+    nvs_entry_t *e = nvs_find(handle, key);
+    if (e != NULL) {
+        e->used = false;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs.m);
+    return err;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    (void) handle;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    (void) handle;
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NVS_NOT_INITIALIZED: return "ESP_ERR_NVS_NOT_INITIALIZED";
+        case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_READ_ONLY: return "ESP_ERR_NVS_READ_ONLY";
+        case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+        case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+        case ESP_ERR_NVS_NEW_VERSION_FOUND: return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+    }
+    return "UNKNOWN ERROR";
+}
+
+uint32_t esp_random(void) {
+    static __thread unsigned seed = 0x5eed;
+    return ((uint32_t) rand_r(&seed) << 16) ^ (uint32_t) rand_r(&seed);
+}
+
+int mock_log_on(void) {
+    static int on = -1;
+    if (on < 0) {
+        on = getenv("BT_SPP_MOCK_LOG") != NULL;
+    }
+    return on;
+}
+
+static void log_buffer(const char *tag, const void *buffer, uint16_t buff_len, bool hex) {
+    if (mock_log_on() == 0) {
+        return;
+    }
+    const uint8_t *b = buffer;
+    fprintf(stderr, "I %s: ", tag);
+    for (uint16_t i = 0; i < buff_len; i++) {
+        if (hex) {
+            fprintf(stderr, "%02x ", b[i]);
+        } else {
+            fputc(b[i] >= 32 && b[i] < 127 ? b[i] : '.', stderr);
+        }
+    }
+    fputc('\n', stderr);
+}
+
+void esp_log_buffer_hex(const char *tag, const void *buffer, uint16_t buff_len) {
+    log_buffer(tag, buffer, buff_len, true);
+}
+
+void esp_log_buffer_char(const char *tag, const void *buffer, uint16_t buff_len) {
+    log_buffer(tag, buffer, buff_len, false);
+}
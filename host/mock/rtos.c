@@ -0,0 +1,316 @@
+/*
+ * Host build: the FreeRTOS calls of the modules on pthreads. Semaphores
+ * and event groups are a mutex and a condition on CLOCK_MONOTONIC, the
+ * software timers share one thread like the FreeRTOS timer task, so a
+ * slow callback delays the others as it would on the ESP32.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "freertos/timers.h"
+
+void vPortEnterCritical(portMUX_TYPE *mux) {
+    pthread_mutex_lock(&mux->m);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux) {
+    pthread_mutex_unlock(&mux->m);
+}
+
+static void cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline(TickType_t ticks) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long) (ticks % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+/* wait on cond until it is signalled or until is reached, false on timeout */
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *m, TickType_t ticks, const struct timespec *until) {
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, m);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, m, until) != ETIMEDOUT;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t) ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay) {
+    struct timespec ts = { xTicksToDelay / 1000, (long) (xTicksToDelay % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+/* semaphores */
+
+struct sem_def {
+    pthread_mutex_t m;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount) {
+    struct sem_def *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&s->m, NULL);
+    cond_init(&s->cond);
+    s->count = uxInitialCount;
+    s->max = uxMaxCount;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t xBlockTime) {
+    struct timespec until = deadline(xBlockTime);
+    BaseType_t ret = pdTRUE;
+    pthread_mutex_lock(&s->m);
+    while (s->count == 0) {
+        if (xBlockTime == 0 || cond_wait(&s->cond, &s->m, xBlockTime, &until) == false) {
+            ret = s->count > 0 ? pdTRUE : pdFALSE;
+            break;
+        }
+    }
+    if (ret == pdTRUE) {
+        s->count--;
+    }
+    pthread_mutex_unlock(&s->m);
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+    BaseType_t ret = pdFALSE;
+    pthread_mutex_lock(&s->m);
+    if (s->count < s->max) {
+        s->count++;
+        pthread_cond_signal(&s->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&s->m);
+    return ret;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s) {
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->m);
+    free(s);
+}
+
+/* event groups */
+
+struct event_group_def {
+    pthread_mutex_t m;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    struct event_group_def *g = calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&g->m, NULL);
+    cond_init(&g->cond);
+    return g;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, const EventBits_t uxBitsToSet) {
+    pthread_mutex_lock(&g->m);
+    g->bits |= uxBitsToSet;
+    EventBits_t bits = g->bits;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->m);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, const EventBits_t uxBitsToClear) {
+    pthread_mutex_lock(&g->m);
+    EventBits_t bits = g->bits;
+    g->bits &= ~uxBitsToClear;
+    pthread_mutex_unlock(&g->m);
+    return bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g) {
+    pthread_mutex_lock(&g->m);
+    EventBits_t bits = g->bits;
+    pthread_mutex_unlock(&g->m);
+    return bits;
+}
+
+static bool bits_met(EventBits_t bits, EventBits_t want, BaseType_t all) {
+    return all ? (bits & want) == want : (bits & want) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, const EventBits_t uxBitsToWaitFor,
+    const BaseType_t xClearOnExit, const BaseType_t xWaitForAllBits, TickType_t xTicksToWait) {
+    struct timespec until = deadline(xTicksToWait);
+    pthread_mutex_lock(&g->m);
+    while (bits_met(g->bits, uxBitsToWaitFor, xWaitForAllBits) == false) {
+        if (xTicksToWait == 0 || cond_wait(&g->cond, &g->m, xTicksToWait, &until) == false) {
+            break;
+        }
+    }
+    EventBits_t bits = g->bits;
+    if (xClearOnExit && bits_met(bits, uxBitsToWaitFor, xWaitForAllBits)) {
+        g->bits &= ~uxBitsToWaitFor;
+    }
+    pthread_mutex_unlock(&g->m);
+    return bits;
+}
+
+/* software timers */
+
+struct tmr_def {
+    struct tmr_def *next;
+    TimerCallbackFunction_t cb;
+    void *id;
+    TickType_t period;
+    TickType_t expiry;
+    bool reload;
+    bool active;
+};
+
+static struct {
+    pthread_mutex_t m;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    struct tmr_def *list;
+} tmr = { .m = PTHREAD_MUTEX_INITIALIZER };
+
+static void *tmr_task(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&tmr.m);
+    for (;;) {
+        TickType_t now = xTaskGetTickCount();
+        struct tmr_def *due = NULL;
+        TickType_t wait = portMAX_DELAY;
+        for (struct tmr_def *t = tmr.list; t != NULL; t = t->next) {
+            if (t->active == false) {
+                continue;
+            }
+            int32_t left = (int32_t) (t->expiry - now);
+            if (left <= 0) {
+                due = t;
+                break;
+            }
+            if ((TickType_t) left < wait) {
+                wait = left;
+            }
+        }
+        if (due != NULL) {
+            if (due->reload) {
+                due->expiry += due->period;
+            } else {
+                due->active = false;
+            }
+            pthread_mutex_unlock(&tmr.m);
+            due->cb(due);
+            pthread_mutex_lock(&tmr.m);
+            continue;
+        }
+        struct timespec until = deadline(wait);
+        cond_wait(&tmr.cond, &tmr.m, wait, &until);
+    }
+    return NULL;
+}
+
+TimerHandle_t xTimerCreate(const char *pcTimerName, const TickType_t xTimerPeriodInTicks,
+    const UBaseType_t uxAutoReload, void *pvTimerID, TimerCallbackFunction_t pxCallbackFunction) {
+    (void) pcTimerName;
+    struct tmr_def *t = calloc(1, sizeof(*t));
+    if (t == NULL || xTimerPeriodInTicks == 0) {
+        free(t);
+        return NULL;
+    }
+    t->cb = pxCallbackFunction;
+    t->id = pvTimerID;
+    t->period = xTimerPeriodInTicks;
+    t->reload = uxAutoReload;
+    pthread_mutex_lock(&tmr.m);
+    if (tmr.running == false) {
+        cond_init(&tmr.cond);
+        pthread_create(&tmr.thread, NULL, tmr_task, NULL);
+        pthread_detach(tmr.thread);
+        tmr.running = true;
+    }
+    t->next = tmr.list;
+    tmr.list = t;
+    pthread_mutex_unlock(&tmr.m);
+    return t;
+}
+
+BaseType_t xTimerReset(TimerHandle_t t, TickType_t xTicksToWait) {
+    (void) xTicksToWait;
+    pthread_mutex_lock(&tmr.m);
+    t->expiry = xTaskGetTickCount() + t->period;
+    t->active = true;
+    pthread_cond_signal(&tmr.cond);
+    pthread_mutex_unlock(&tmr.m);
+    return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t t, TickType_t xTicksToWait) {
+    return xTimerReset(t, xTicksToWait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t t, TickType_t xTicksToWait) {
+    (void) xTicksToWait;
+    pthread_mutex_lock(&tmr.m);
+    t->active = false;
+    pthread_mutex_unlock(&tmr.m);
+    return pdPASS;
+}
+
+/* as in FreeRTOS this also starts a dormant timer */
+BaseType_t xTimerChangePeriod(TimerHandle_t t, TickType_t xNewPeriod, TickType_t xTicksToWait) {
+    if (xNewPeriod == 0) {
+        return pdFAIL;
+    }
+    pthread_mutex_lock(&tmr.m);
+    t->period = xNewPeriod;
+    pthread_mutex_unlock(&tmr.m);
+    return xTimerReset(t, xTicksToWait);
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t t) {
+    pthread_mutex_lock(&tmr.m);
+    BaseType_t active = t->active;
+    pthread_mutex_unlock(&tmr.m);
+    return active;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t t) {
+    return t->id;
+}
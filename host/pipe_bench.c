@@ -0,0 +1,116 @@
+/*
+ * Benchmark of the receive path, before and after the pipe copies in two
+ * spans. Each round puts one frame into a DEFAULT_PIPE_SIZE pipe, as
+ * esp_spp_cb does for ESP_SPP_DATA_IND_EVT, and takes it out again as
+ * get_bin() does.
+ *
+ * before: a byte at a time with a modulo per index, and get_bin() reading
+ *         into a buffer on the stack, then copying it into the bytes object
+ * after:  pipe_put/pipe_get as they are now, straight into the object
+ *
+ * The figures are from the host CPU, not the ESP32, so only the ratio
+ * between the two says something about the firmware.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "../src/bt_spp_server.c"
+
+#define BYTES (64u << 20) /* per frame size and variant */
+
+/* the ring before, head and tail are indexes into the buffer */
+typedef struct {
+    char *buffer;
+    atomic_int head;
+    atomic_int tail;
+    int size;
+} old_pipe_t;
+
+static int old_put(old_pipe_t *p, const uint8_t *items, int count)
+{
+    int head = atomic_load_explicit(&p->head, memory_order_acquire);
+    int tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    int i;
+    for (i = 0; i < count; i++) {
+        int next_tail = (tail + 1) % p->size;
+        if (next_tail == head) {
+            break; // pipe full
+        }
+        p->buffer[tail] = (char) items[i];
+        tail = next_tail;
+    }
+    atomic_store_explicit(&p->tail, tail, memory_order_release);
+    return i;
+}
+
+static int old_get(old_pipe_t *p, uint8_t *items, int count)
+{
+    int tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    int head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int i;
+    for (i = 0; i < count; i++) {
+        if (head == tail) {
+            break; // pipe empty
+        }
+        items[i] = (uint8_t) p->buffer[head];
+        head = (head + 1) % p->size;
+    }
+    atomic_store_explicit(&p->head, head, memory_order_release);
+    return i;
+}
+
+static uint8_t frame[ESP_SPP_MAX_MTU];
+static uint8_t object[ESP_SPP_MAX_MTU]; /* stands in for the bytes object */
+static volatile uint32_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* a noinline call each, so neither side is folded into the loop */
+static __attribute__((noinline)) int before(old_pipe_t *p, int len) {
+    old_put(p, frame, len);
+    uint8_t items[len];
+    int n = old_get(p, items, len);
+    memcpy(object, items, n);
+    return n;
+}
+
+static __attribute__((noinline)) int after(pipe_obj_t *p, int len) {
+    pipe_put(p, frame, len);
+    return pipe_get(p, object, len);
+}
+
+static double run(int len, bool old) {
+    old_pipe_t op = { .buffer = malloc(DEFAULT_PIPE_SIZE), .size = DEFAULT_PIPE_SIZE };
+    pipe_obj_t np = { 0 };
+    pipe_alloc(&np, DEFAULT_PIPE_SIZE);
+    uint32_t rounds = BYTES / len;
+    uint32_t sum = 0;
+    double t = now();
+    for (uint32_t i = 0; i < rounds; i++) {
+        sum += old ? before(&op, len) : after(&np, len);
+        sum += object[i % len];
+    }
+    t = now() - t;
+    sink = sum;
+    free(op.buffer);
+    pipe_free(&np);
+    vSemaphoreDelete(np.drained);
+    return t * 1e9 / rounds; // ns per frame
+}
+
+int main(void) {
+    static const int lens[] = { 16, 128, 512, ESP_SPP_MAX_MTU };
+    for (int i = 0; i < ESP_SPP_MAX_MTU; i++) {
+        frame[i] = i;
+    }
+    printf("%6s %14s %14s %8s %12s\n", "frame", "before ns", "after ns", "speedup", "after MB/s");
+    for (size_t i = 0; i < MP_ARRAY_SIZE(lens); i++) {
+        double b = run(lens[i], true);
+        double a = run(lens[i], false);
+        printf("%6d %14.1f %14.1f %7.1fx %12.0f\n", lens[i], b, a, b / a, lens[i] * 1e3 / a);
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Stress test of the receive pipe: one thread puts as esp_spp_cb does,
+ * one gets as the MicroPython task does, both with random chunk sizes.
+ * The ring is small so it wraps and fills all the time, and head/tail
+ * start just below 2^32 so the free running counters wrap as well.
+ * Every byte read is checked against the sequence written.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include "../src/bt_spp_server.c"
+#include "mock/mock.h"
+
+#define RING 64
+#define TOTAL (16u << 20)    /* bytes through the pipe per run */
+#define CHUNK (RING + RING / 2) /* larger than the ring, so puts fall short */
+#define START 0xffffffc5u    /* counters wrap early, index 5 so fills split */
+
+typedef struct {
+    pipe_obj_t p;
+    bool flow;
+    uint32_t short_puts;  /* put found the ring full */
+    uint32_t put_wraps;   /* a put split in two spans */
+    uint32_t get_wraps;   /* a get split in two spans */
+    uint32_t bad;         /* bytes read out of sequence */
+    uint32_t first_bad;
+} run_t;
+
+/* the byte at position n of the stream, so the reader can check any span */
+static inline uint8_t seq(uint32_t n) {
+    return (uint8_t) (n ^ (n >> 8) ^ (n >> 16));
+}
+
+static uint32_t rnd(uint32_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static void *producer(void *arg) {
+    run_t *r = arg;
+    uint8_t chunk[CHUNK];
+    uint32_t s = 0x1234567;
+    uint32_t sent = 0;
+    while (sent < TOTAL) {
+        int n = 1 + rnd(&s) % CHUNK;
+        if (n > (int) (TOTAL - sent)) {
+            n = TOTAL - sent;
+        }
+        for (int i = 0; i < n; i++) {
+            chunk[i] = seq(sent + i);
+        }
+        uint32_t pos = atomic_load(&r->p.tail) & r->p.mask;
+        int added = r->flow ? pipe_put_flow(&r->p, chunk, n) : pipe_put(&r->p, chunk, n);
+        if (added < n) {
+            r->short_puts++;
+        }
+        if (pos + added > RING) {
+            r->put_wraps++;
+        }
+        sent += added; // in drop mode the rest is put again, not lost
+        if (added == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    run_t *r = arg;
+    uint8_t chunk[CHUNK];
+    uint32_t s = 0x7654321;
+    uint32_t got = 0;
+    while (got < TOTAL) {
+        int n = 1 + rnd(&s) % CHUNK;
+        uint32_t pos = atomic_load(&r->p.head) & r->p.mask;
+        int taken = pipe_get(&r->p, chunk, n);
+        if (pos + taken > RING) {
+            r->get_wraps++;
+        }
+        for (int i = 0; i < taken; i++) {
+            if (chunk[i] != seq(got + i)) {
+                if (r->bad++ == 0) {
+                    r->first_bad = got + i;
+                }
+            }
+        }
+        got += taken;
+        if (taken == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void stress(bool flow) {
+    run_t r = { .flow = flow };
+    CHECK(pipe_alloc(&r.p, RING));
+    CHECK(r.p.size == RING && r.p.mask == RING - 1);
+    r.p.flow = flow;
+    atomic_store(&r.p.head, START);
+    atomic_store(&r.p.tail, START);
+
+    pthread_t pt, ct;
+    pthread_create(&pt, NULL, producer, &r);
+    pthread_create(&ct, NULL, consumer, &r);
+    pthread_join(pt, NULL);
+    pthread_join(ct, NULL);
+
+    printf("pipe %s: %u bytes, %u short puts, %u/%u split puts/gets, %u bad\n",
+        flow ? "flow" : "drop", TOTAL, r.short_puts, r.put_wraps, r.get_wraps, r.bad);
+    CHECK(r.bad == 0);
+    if (r.bad) {
+        fprintf(stderr, "first bad byte at %u\n", r.first_bad);
+    }
+    CHECK(pipe_count(&r.p) == 0);
+    CHECK(atomic_load(&r.p.tail) == START + TOTAL); // wrapped past 2^32
+    CHECK(r.put_wraps > 0 && r.get_wraps > 0);
+    if (flow == false) {
+        CHECK(r.short_puts > 0); // the ring was full
+    }
+    pipe_free(&r.p);
+    vSemaphoreDelete(r.p.drained);
+}
+
+/* a full ring takes nothing more, an empty one gives nothing */
+static void edges(void) {
+    pipe_obj_t p = { 0 };
+    uint8_t in[RING + 1], out[RING + 1];
+    for (int i = 0; i < RING + 1; i++) {
+        in[i] = seq(i);
+    }
+    CHECK(pipe_alloc(&p, RING - 3)); // rounded up
+    CHECK(p.size == RING);
+    CHECK(pipe_get(&p, out, 1) == 0);
+    CHECK(pipe_put(&p, in, RING + 1) == RING);
+    CHECK(pipe_count(&p) == RING);
+    CHECK(pipe_put(&p, in, 1) == 0);
+    CHECK(pipe_get(&p, out, RING + 1) == RING);
+    CHECK(memcmp(in, out, RING) == 0);
+    CHECK(pipe_count(&p) == 0);
+    pipe_free(&p);
+    vSemaphoreDelete(p.drained);
+}
+
+int main(void) {
+    edges();
+    stress(false);
+    stress(true);
+    printf("pipe_stress: %d checks, %d failed\n", mock_checked, mock_failed);
+    return mock_failed != 0;
+}
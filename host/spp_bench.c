@@ -0,0 +1,236 @@
+/*
+ * Benchmark of the bts data path against the host mocks: the module code
+ * as it is, with a master connected over the mock stack.
+ *
+ * calls:      per call cost of data(), get_bin(), get_str() and send_bin(),
+ *             and of esp_spp_cb for ESP_SPP_DATA_IND_EVT, run straight on
+ *             this thread with the Bluetooth thread idle
+ * latency:    a frame from the master until get_bin() has it, and on to
+ *             the master getting the answer back
+ * throughput: bulk data both ways, flow=True on the way in and send_bin()
+ *             waiting for a free slot on the way out
+ *
+ * Prints p50/p90/p99 of each as JSON, to the file in argv[1] or stdout.
+ * The figures are host nanoseconds, not ESP32 cycles: compare runs on the
+ * same machine, before and after a change.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "mock/mock.h"
+
+#define MASTER_ADDR "aa:bb:cc:00:00:02"
+#define CALLS 20000  /* samples per call */
+#define ROUNDS 2000  /* latency round trips */
+#define FRAME 64     /* bytes per call and round */
+#define BULK (4u << 20)
+#define CHUNK 990    /* one MTU */
+
+#define I(n) MP_OBJ_NEW_SMALL_INT(n)
+#define CALL(m, name, ...) ({ \
+        mp_obj_t _a[] = { __VA_ARGS__ }; \
+        mock_call(&m, name, MP_ARRAY_SIZE(_a), 0, _a); \
+    })
+#define CALL0(m, name) mock_call(&m, name, 0, 0, NULL)
+
+static uint64_t samples[CALLS];
+static uint8_t buf[BULK];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* spin rather than sleep, so a wait does not round up to a tick */
+static void idle(void) {
+    while (!mock_bt_idle()) {
+        sched_yield();
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* one JSON object of the n samples, sorted in place */
+static void report(FILE *f, const char *name, uint64_t *s, size_t n, bool last) {
+    uint64_t sum = 0;
+    qsort(s, n, sizeof(*s), cmp_u64);
+    for (size_t i = 0; i < n; i++) {
+        sum += s[i];
+    }
+    fprintf(f, "    \"%s\": {\"n\": %zu, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, "
+        "\"p99\": %llu, \"max\": %llu, \"mean\": %llu}%s\n", name, n,
+        (unsigned long long) s[0], (unsigned long long) s[n * 50 / 100],
+        (unsigned long long) s[n * 90 / 100], (unsigned long long) s[n * 99 / 100],
+        (unsigned long long) s[n - 1], (unsigned long long) (sum / n), last ? "" : ",");
+}
+
+/* ESP_SPP_DATA_IND_EVT for FRAME bytes from the master */
+static uint64_t data_ind(mock_peer_t *master) {
+    esp_spp_cb_param_t p = { 0 };
+    p.data_ind.status = ESP_SPP_SUCCESS;
+    p.data_ind.handle = master->handle;
+    p.data_ind.len = FRAME;
+    p.data_ind.data = buf;
+    uint64_t t0 = now_ns();
+    mock_spp_event(ESP_SPP_DATA_IND_EVT, &p);
+    return now_ns() - t0;
+}
+
+static void bench_calls(FILE *f, mock_peer_t *master) {
+    mp_obj_t n = I(FRAME);
+    mp_obj_t msg = mock_bytes(buf, FRAME);
+    uint64_t t0;
+
+    fprintf(f, "  \"calls\": {\n");
+    for (int i = 0; i < CALLS; i++) {
+        samples[i] = data_ind(master);
+        CALL(mp_module_bts, "get_bin", n);
+    }
+    report(f, "data_ind", samples, CALLS, false);
+
+    for (int i = 0; i < CALLS; i++) {
+        data_ind(master);
+        t0 = now_ns();
+        CALL0(mp_module_bts, "data");
+        samples[i] = now_ns() - t0;
+        CALL(mp_module_bts, "get_bin", n);
+    }
+    report(f, "data", samples, CALLS, false);
+
+    for (int i = 0; i < CALLS; i++) {
+        data_ind(master);
+        t0 = now_ns();
+        CALL(mp_module_bts, "get_bin", n);
+        samples[i] = now_ns() - t0;
+    }
+    report(f, "get_bin", samples, CALLS, false);
+
+    for (int i = 0; i < CALLS; i++) {
+        data_ind(master);
+        t0 = now_ns();
+        CALL(mp_module_bts, "get_str", n);
+        samples[i] = now_ns() - t0;
+    }
+    report(f, "get_str", samples, CALLS, false);
+
+    for (int i = 0; i < CALLS; i++) {
+        t0 = now_ns();
+        CALL(mp_module_bts, "send_bin", msg);
+        samples[i] = now_ns() - t0;
+        idle();
+        mock_peer_recv(master, buf, sizeof(buf));
+    }
+    report(f, "send_bin", samples, CALLS, true);
+    fprintf(f, "  },\n");
+}
+
+static void bench_latency(FILE *f, mock_peer_t *master) {
+    static uint64_t rx[ROUNDS], rt[ROUNDS];
+    mp_obj_t n = I(FRAME);
+    mp_obj_t msg = mock_bytes(buf, FRAME);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        uint64_t t0 = now_ns();
+        mock_peer_send(master, buf, FRAME);
+        while (CALL(mp_module_bts, "get_bin", n) == mp_const_none) {
+            sched_yield();
+        }
+        rx[i] = now_ns() - t0;
+        CALL(mp_module_bts, "send_bin", msg);
+        size_t got = 0;
+        while (got < FRAME) {
+            got += mock_peer_recv(master, buf, sizeof(buf));
+        }
+        rt[i] = now_ns() - t0;
+    }
+    fprintf(f, "  \"latency\": {\n");
+    report(f, "rx", rx, ROUNDS, false);
+    report(f, "round_trip", rt, ROUNDS, true);
+    fprintf(f, "  },\n");
+}
+
+static void bench_throughput(FILE *f, mock_peer_t *master) {
+    mp_obj_t n = I(CHUNK);
+    mp_obj_t msg = mock_bytes(buf, CHUNK);
+    size_t got = 0;
+
+    uint64_t t0 = now_ns();
+    mock_peer_send(master, buf, BULK);
+    while (got < BULK) {
+        mp_obj_t o = CALL(mp_module_bts, "get_bin", n);
+        if (o == mp_const_none) {
+            sched_yield();
+        } else {
+            mp_buffer_info_t bi;
+            mp_get_buffer_raise(o, &bi, MP_BUFFER_READ);
+            got += bi.len;
+        }
+    }
+    uint64_t rx_ns = now_ns() - t0;
+
+    size_t sent = 0;
+    got = 0;
+    t0 = now_ns();
+    while (sent < BULK) {
+        sent += mp_obj_get_int(CALL(mp_module_bts, "send_bin", msg, I(1000)));
+        got += mock_peer_recv(master, buf, sizeof(buf));
+    }
+    while (got < sent) {
+        got += mock_peer_recv(master, buf, sizeof(buf));
+    }
+    uint64_t tx_ns = now_ns() - t0;
+
+    fprintf(f, "  \"throughput\": {\n");
+    fprintf(f, "    \"bytes\": %u,\n", BULK);
+    fprintf(f, "    \"rx_bytes_per_s\": %llu,\n", (unsigned long long) (BULK * 1000000000ull / rx_ns));
+    fprintf(f, "    \"tx_bytes_per_s\": %llu\n", (unsigned long long) ((uint64_t) got * 1000000000ull / tx_ns));
+    fprintf(f, "  },\n");
+}
+
+int main(int argc, char **argv) {
+    FILE *f = stdout;
+    if (argc > 1 && (f = fopen(argv[1], "w")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t) ('a' + i % 26);
+    }
+
+    mock_bt_reset();
+    mp_obj_t a[] = { mock_str("ESP32_SPP"), mock_str("1234"), mock_qstr("flow"), mp_const_true };
+    CHECK(mock_call(&mp_module_bts, "init", 2, 1, a) == mp_const_true);
+    mock_settle();
+    mock_peer_t *master = mock_peer_add(MASTER_ADDR, "pc", 0, "");
+    CHECK(mock_peer_connect(master, "1234"));
+    CHECK(MOCK_WAIT_FOR(CALL0(mp_module_bts, "ready") == mp_const_true, 1000));
+    mock_settle();
+    if (mock_failed) {
+        fprintf(stderr, "spp_bench: no connection\n");
+        return 1;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"config\": {\"calls\": %d, \"rounds\": %d, \"frame\": %d, \"unit\": \"ns\"},\n",
+        CALLS, ROUNDS, FRAME);
+    bench_calls(f, master);
+    bench_latency(f, master);
+    bench_throughput(f, master);
+    mp_obj_t t = CALL0(mp_module_bts, "timing");
+    fprintf(f, "  \"timing\": {\"rx_frames\": %ld, \"cb_max\": %ld}\n",
+        (long) mock_dict_int(t, "rx_frames"), (long) mock_dict_int(t, "cb_max"));
+    fprintf(f, "}\n");
+
+    CALL0(mp_module_bts, "deinit");
+    mock_settle();
+    if (f != stdout) {
+        fclose(f);
+    }
+    return mock_failed != 0;
+}
@@ -0,0 +1,3540 @@
+/*
+   MIT License
+
+   Copyright (c) 2023 Sharil Tumin
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   This is client, master, or central of Bluetooth Classic using SPP
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "freertos/event_groups.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_bt_api.h"
+#include "esp_bt_device.h"
+#include "esp_spp_api.h"
+#include "esp_random.h"
+
+#include "py/obj.h"
+#include "py/runtime.h"
+#include "py/mperrno.h"
+#include "py/stream.h"
+#include "py/mphal.h"
+
+/*
+ * BT_SPP_TRACE picks what the driver reports, at build time:
+ *   0  nothing (default, the prod firmware)
+ *   1  every SPP and GAP event as an 8 byte record in a RAM ring, read
+ *      with trace() and turned into a timeline by tools/bt_spp_trace.py
+ *   2  as 1, and every event logged with ESP_LOG (the debug firmware)
+ * Logging over the UART is slow enough to change timing; the trace ring
+ * is not.
+ */
+#ifndef BT_SPP_TRACE
+#define BT_SPP_TRACE 0
+#endif
+
+#if BT_SPP_TRACE >= 2
+#include "esp_log.h"
+#define TAG "SPP_CLIENT"
+static int evn_cnt = 0;
+#define LOG_EVT(name) do { evn_cnt++; ESP_LOGI(TAG, "%d - " name, evn_cnt); } while (0)
+#define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+#define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+#define LOG_HEX(buf, len) esp_log_buffer_hex(TAG, buf, len)
+#define LOG_CHAR(buf, len) esp_log_buffer_char(TAG, buf, len)
+#else
+#define LOG_EVT(name)
+#define LOGI(...)
+#define LOGE(...)
+#define LOG_HEX(buf, len)
+#define LOG_CHAR(buf, len)
+#endif
+
+#define DEFAULT_PIPE_SIZE 1024
+#define MAX_PIPE_SIZE (64 * 1024)
+#define FLOW_WAIT_MS 1000 /* longest a frame is held back in flow mode */
+
+#define FRAME_NONE 0 /* raw byte stream */
+#define FRAME_LEN  1 /* 2 byte big-endian length, then the message */
+#define FRAME_COBS 2 /* COBS encoded message, then a 0 byte */
+#define FRAME_MAX_LEN 0xFFFF
+
+/*
+ * Single-producer/single-consumer ring. The SPP callback is the only
+ * writer of tail, the MicroPython task the only writer of head, so no
+ * lock is needed: each side publishes its index with a release store
+ * and reads the other side's index with an acquire load.
+ *
+ * The size is a power of two and head/tail run freely, so the fill level
+ * is simply tail - head and a position in the buffer is index & mask.
+ *
+ * In flow mode the producer waits on drained once the pipe is above the
+ * high watermark, and the consumer gives it when it gets below the low one.
+ */
+typedef struct _pipe_obj_t {
+    char *buffer;
+    atomic_uint head; /* bytes read so far, owned by the consumer */
+    atomic_uint tail; /* bytes written so far, owned by the producer */
+    uint32_t size;
+    uint32_t mask;
+    bool flow;        /* hold back the sender instead of dropping */
+    uint32_t high;
+    uint32_t low;
+    atomic_bool stalled; /* producer is waiting for drained */
+    SemaphoreHandle_t drained;
+    uint8_t framing;
+    uint8_t hdr_got;     /* FRAME_LEN header bytes seen, producer only */
+    uint32_t need;       /* FRAME_LEN header, then bytes still to come */
+    bool mid;            /* the stream is inside a message, producer only */
+    bool skip;           /* dropping the rest of a message, producer only */
+    uint32_t mark;       /* tail after the last whole message, producer only */
+    atomic_uint msgs;    /* complete messages written, owned by the producer */
+    atomic_uint msgs_read; /* messages taken by get_msg(), owned by the consumer */
+    atomic_bool resync;  /* get_msg() found the pipe full without a whole message */
+    uint32_t held;       /* frames held back in flow mode, producer only */
+    uint32_t resyncs;    /* messages dropped to stay in step, producer only */
+} pipe_obj_t;
+
+/* (re)allocate the buffer, size is rounded up to a power of two */
+static bool pipe_alloc(pipe_obj_t *p, uint32_t size)
+{
+    uint32_t pow2 = 1;
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+    if (p->buffer == NULL || p->size != pow2) {
+        free(p->buffer);
+        p->buffer = malloc(sizeof(char) * pow2);
+        if (p->buffer == NULL) {
+            pow2 = 0;
+        }
+        p->size = pow2;
+        p->mask = pow2 ? pow2 - 1 : 0;
+    }
+    if (p->drained == NULL) {
+        p->drained = xSemaphoreCreateBinary();
+    }
+    p->high = p->size - p->size / 4;
+    p->low = p->size / 4;
+    p->hdr_got = 0;
+    p->need = 0;
+    p->mid = false;
+    p->skip = false;
+    p->mark = 0;
+    atomic_store(&p->msgs, 0);
+    atomic_store(&p->msgs_read, 0);
+    atomic_store(&p->resync, false);
+    atomic_store(&p->head, 0);
+    atomic_store(&p->tail, 0);
+    return p->buffer != NULL;
+}
+
+/* let a producer waiting in flow mode go, consumer side */
+static void pipe_wake(pipe_obj_t *p)
+{
+    if (atomic_exchange(&p->stalled, false)) {
+        xSemaphoreGive(p->drained);
+    }
+}
+
+static void pipe_free(pipe_obj_t *p)
+{
+    free(p->buffer);
+    p->buffer = NULL;
+    p->size = 0;
+    p->mask = 0;
+    atomic_store(&p->head, 0);
+    atomic_store(&p->tail, 0);
+}
+
+static uint32_t pipe_count(pipe_obj_t *p)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    return tail - head;
+}
+
+/*
+ * Copy in at most two spans: from tail to the end of the buffer, then
+ * from the start of the buffer. Called from esp_spp_cb only, never blocks.
+ */
+static int pipe_put(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    int room = p->size - (tail - head);
+    if (count > room) {
+        count = room; // pipe full, the rest is dropped
+    }
+    if (count <= 0) {
+        return 0;
+    }
+    int pos = tail & p->mask;
+    int first = p->size - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(p->buffer + pos, items, first);
+    memcpy(p->buffer, items + first, count - first);
+    atomic_store_explicit(&p->tail, tail + count, memory_order_release);
+    return count;
+}
+
+/* the same two spans the other way round, MicroPython task only */
+static int pipe_get(pipe_obj_t *p, uint8_t *items, int count)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int used = tail - head;
+    if (count > used) {
+        count = used;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+    int pos = head & p->mask;
+    int first = p->size - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(items, p->buffer + pos, first);
+    memcpy(items + first, p->buffer, count - first);
+    atomic_store_explicit(&p->head, head + count, memory_order_release);
+    if (p->flow && (tail - head - count) <= p->low) {
+        pipe_wake(p);
+    }
+    return count;
+}
+
+/*
+ * Holding a frame back only helps if the reader can make room. With
+ * framing it only takes whole messages out, so a pipe with none in it
+ * would not drain however long we wait.
+ */
+static bool pipe_drains(pipe_obj_t *p)
+{
+    if (p->framing == FRAME_NONE) {
+        return true;
+    }
+    return atomic_load(&p->msgs) != atomic_load(&p->msgs_read) && atomic_load(&p->resync) == false;
+}
+
+/*
+ * Flow controlled put, called from esp_spp_cb only. The stack returns the
+ * RFCOMM credit for a frame to the peer when esp_spp_cb returns, so holding
+ * on to the frame while the pipe is above the high watermark throttles the
+ * sender instead of dropping bytes. If the reader does not drain the pipe
+ * within FLOW_WAIT_MS the rest is dropped, so the stack is never stuck.
+ * The wait blocks the BTC task, which runs every SPP and GAP callback, so
+ * all connections and events stall with it, not only this pipe.
+ */
+static int pipe_put_flow(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    int added = pipe_put(p, items, count);
+    if (added < count || pipe_count(p) > p->high) {
+        p->held++;
+    }
+    while (p->flow && (added < count || pipe_count(p) > p->high) && pipe_drains(p)) {
+        atomic_store(&p->stalled, true);
+        if (pipe_count(p) > p->low) { // the reader may have drained it meanwhile
+            if (xSemaphoreTake(p->drained, pdMS_TO_TICKS(FLOW_WAIT_MS)) != pdTRUE) {
+                atomic_store(&p->stalled, false);
+                break;
+            }
+        }
+        added += pipe_put(p, items + added, count - added);
+    }
+    return added;
+}
+/*
+ * Optional message framing, chosen at init(). FRAME_LEN puts a 2 byte
+ * big-endian length in front of each message, FRAME_COBS COBS encodes
+ * each message and ends it with a 0 byte.
+ *
+ * Only whole messages stay in the pipe, so get_msg() cannot get out of
+ * step. frame_next follows the message boundaries in everything that
+ * comes in, kept or not. When a message does not fit, frame_put takes
+ * back what made it in, back to mark, and skips the rest of it. msgs
+ * counts the messages kept, so get_msg() knows one is there without
+ * searching.
+ */
+
+/* bytes up to and including the end of the message, *end if it ends there */
+static int frame_next(pipe_obj_t *p, const uint8_t *items, int count, bool *end)
+{
+    *end = false;
+    if (p->framing == FRAME_COBS) {
+        const uint8_t *zero = memchr(items, 0, count);
+        if (zero == NULL) {
+            return count;
+        }
+        *end = true;
+        return zero - items + 1;
+    }
+    int n = 0; // FRAME_LEN
+    while (n < count && p->hdr_got < 2) {
+        p->need = (p->need << 8) | items[n++];
+        p->hdr_got++;
+    }
+    if (p->hdr_got == 2) {
+        uint32_t take = count - n;
+        if (take > p->need) {
+            take = p->need;
+        }
+        p->need -= take;
+        n += take;
+        if (p->need == 0) {
+            p->hdr_got = 0; // header and payload complete
+            *end = true;
+        }
+    }
+    return n;
+}
+
+/* drop the message that is not whole, and with rest what is still to come of it */
+static void frame_undo(pipe_obj_t *p, bool rest)
+{
+    atomic_store_explicit(&p->tail, p->mark, memory_order_release);
+    p->skip = rest;
+    p->resyncs++;
+}
+
+/*
+ * Framed put, called from esp_spp_cb only. Returns the bytes kept less
+ * those taken back, so below 0 if a message begun in an earlier frame
+ * was dropped.
+ */
+static int frame_put(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    uint32_t start = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    if (atomic_exchange(&p->resync, false) && (start != p->mark || p->mid)) {
+        frame_undo(p, p->mid);
+    }
+    while (count > 0) {
+        bool end;
+        int n = frame_next(p, items, count, &end);
+        if (p->skip) {
+            p->skip = !end;
+        } else {
+            int added = p->flow ? pipe_put_flow(p, items, n) : pipe_put(p, items, n);
+            if (added < n) {
+                frame_undo(p, !end);
+            } else if (end) {
+                p->mark = atomic_load_explicit(&p->tail, memory_order_relaxed);
+                atomic_fetch_add_explicit(&p->msgs, 1, memory_order_release);
+            }
+        }
+        p->mid = !end;
+        items += n;
+        count -= n;
+    }
+    return (int32_t) (atomic_load_explicit(&p->tail, memory_order_relaxed) - start);
+}
+
+/*
+ * Offset of the first delim after head, -1 if it is not in the pipe.
+ * memchr looks for the first byte of delim in each of the two spans and
+ * the rest of delim is compared through the mask, so a match may straddle
+ * the end of the buffer. MicroPython task only.
+ */
+static int pipe_find(pipe_obj_t *p, const uint8_t *delim, int dlen)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int used = tail - head;
+    int pos = head & p->mask;
+    int first = p->size - pos;
+    if (first > used) {
+        first = used;
+    }
+    const char *span = p->buffer + pos;
+    int span_len = first;
+    int offset = 0; // of span from head
+    for (int n = 0; n < 2; n++) {
+        const char *from = span;
+        const char *hit;
+        while ((hit = memchr(from, delim[0], span + span_len - from)) != NULL) {
+            int at = offset + (hit - span);
+            if (at + dlen > used) {
+                return -1; // not all of delim is here yet
+            }
+            int i = 1;
+            while (i < dlen && (uint8_t) p->buffer[(head + at + i) & p->mask] == delim[i]) {
+                i++;
+            }
+            if (i == dlen) {
+                return at;
+            }
+            from = hit + 1;
+        }
+        span = p->buffer;
+        span_len = used - first;
+        offset = first;
+    }
+    return -1;
+}
+
+/* COBS encode len bytes into out with the 0 delimiter, returns the length */
+static size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t code_at = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] != 0) {
+            out[o++] = in[i];
+            code++;
+        }
+        if (in[i] == 0 || code == 0xFF) {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+        }
+    }
+    out[code_at] = code;
+    out[o++] = 0;
+    return o;
+}
+
+/* COBS decode in place, len without the delimiter, -1 if malformed */
+static int cobs_decode(uint8_t *buf, int len)
+{
+    int i = 0;
+    int o = 0;
+    while (i < len) {
+        int code = buf[i++];
+        if (code == 0 || i + code - 1 > len) {
+            return -1;
+        }
+        for (int j = 1; j < code; j++) {
+            buf[o++] = buf[i++];
+        }
+        if (code < 0xFF && i < len) {
+            buf[o++] = 0;
+        }
+    }
+    return o;
+}
+
+
+#define SPP_DATA_LEN ESP_SPP_MAX_MTU
+#define TX_SLOTS 4 /* frames queued for sending */
+#define TX_TRIES 3 /* writes of a frame that fail before it is given up */
+
+/*
+ * A frame to send. Frames come from a pool and are shared: broadcast()
+ * copies the data in once and puts the same frame on every connection's
+ * queue. refs counts the queues still holding it, the frame goes back to
+ * the pool when the last one has written it.
+ */
+typedef struct _tx_buf_t {
+    uint16_t len;
+    uint8_t refs; /* 0 while in the pool, under tx_lock */
+    uint8_t data[SPP_DATA_LEN]; /* ESP_SPP_MAX_MTU = 990 bytes */
+} tx_buf_t;
+
+/*
+ * Transmit queue, one per connection. send_str/send_bin put a frame at
+ * tail and return at once; esp_spp_cb drops the frame at head on
+ * ESP_SPP_WRITE_EVT and starts the next write. None is started while the
+ * link is congested, ESP_SPP_CONG_EVT restarts the queue.
+ */
+typedef struct _txq_obj_t {
+    tx_buf_t *slot[TX_SLOTS];
+    uint32_t head;  /* frames written so far, advanced by esp_spp_cb */
+    uint32_t tail;  /* frames queued so far, advanced by send */
+    bool cong;      /* waiting for ESP_SPP_CONG_EVT */
+    uint8_t tries;  /* failed writes of the frame at head */
+    uint32_t refused; /* frames esp_spp_write turned down, counted in tx_failed */
+} txq_obj_t;
+
+/*
+ * Link statistics of one connection since init() or stats(True). Only
+ * the Bluetooth task counts, so plain words will do; a reset may lose an
+ * event that comes in at the same moment.
+ */
+typedef struct _stats_obj_t {
+    uint32_t rx_frames;
+    uint32_t rx_bytes;    /* into the pipe */
+    uint32_t rx_dropped;  /* bytes that did not fit, with framing all of their message */
+    uint32_t tx_frames;   /* confirmed by ESP_SPP_WRITE_EVT */
+    uint32_t tx_bytes;
+    uint32_t tx_failed;   /* ESP_SPP_WRITE_EVT with an error status, stats() adds txq.refused */
+    uint32_t cong_on;
+    uint32_t cong_off;
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t auth_failed;
+} stats_obj_t;
+
+#define OCC_BINS 18 /* log2 buckets, enough for MAX_PIPE_SIZE */
+
+/*
+ * Fill level of one connection's pipe, sampled after each frame went
+ * in. Bucket 0 counts an empty pipe, bucket n a fill level from 2^(n-1)
+ * to 2^n - 1 bytes. Time above the flow high watermark runs from the
+ * first sample above it to the first one below it again.
+ */
+typedef struct _occ_data_t {
+    uint32_t peak;
+    uint32_t hist[OCC_BINS];
+    bool above;
+    uint32_t above_since; /* mp_hal_ticks_us() of the first sample above */
+    uint64_t above_us;    /* finished spells above the watermark */
+} occ_data_t;
+
+typedef struct _occ_obj_t {
+    occ_data_t d;
+    portMUX_TYPE lock;
+} occ_obj_t;
+
+#define MAX_CONNS 4 /* slaves the master can be connected to at once */
+
+/*
+ * One slave. The slot is taken by open() and holds the handle from
+ * ESP_SPP_OPEN_EVT until ESP_SPP_CLOSE_EVT, or, with reconnect() on,
+ * until close() once the link has dropped.
+ */
+typedef struct _conn_obj_t {
+    uint32_t handle; /* 0 while not connected */
+    bool ready;
+    pipe_obj_t pipe;
+    txq_obj_t txq;
+    stats_obj_t stats;
+    occ_obj_t occ;
+    /* the slave, kept at ESP_SPP_OPEN_EVT to reconnect to it */
+    esp_bd_addr_t addr;
+    char name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+    uint8_t name_len; /* 0 if opened by address */
+    uint8_t pin[17];
+    uint8_t rc_state; /* RC_* */
+    uint8_t rc_fails; /* attempts failed since the link dropped */
+    uint32_t rc_due;  /* mp_hal_ticks_ms() of the next attempt */
+    uint32_t rc_lost; /* mp_hal_ticks_us() when the link dropped */
+} conn_obj_t;
+
+/* not on the GC heap, esp_spp_cb runs outside the MicroPython task */
+static conn_obj_t conn[MAX_CONNS] = {
+    [0 ... MAX_CONNS - 1] = { .occ = { .lock = portMUX_INITIALIZER_UNLOCKED } }
+};
+static int n_conns = 1;  /* slots in use, set at init() */
+static int opening = -1; /* slot of the open() in progress */
+
+#define RC_OFF  0 /* not reconnecting */
+#define RC_WAIT 1 /* backing off till rc_due */
+#define RC_TRY  2 /* attempt running, opening is the slot */
+
+/*
+ * The pool holds TX_SLOTS frames per connection, so a queue with a free
+ * slot always finds a free frame. The connections take turns at sending:
+ * one esp_spp_write is outstanding over all of them, and the next frame
+ * comes from the first connection after the one that wrote last.
+ * tx_lock guards the queues, the frame counts and the turn.
+ */
+static tx_buf_t *tx_pool = NULL;
+static int tx_pool_len = 0;
+static portMUX_TYPE tx_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool tx_busy = false; /* esp_spp_write issued, waiting for ESP_SPP_WRITE_EVT */
+static int tx_turn = 0;      /* connection of the last write */
+static SemaphoreHandle_t tx_room = NULL; /* given when a slot is freed */
+
+static conn_obj_t *conn_find(uint32_t handle)
+{
+    for (int i = 0; i < n_conns; i++) {
+        if (conn[i].handle == handle) {
+            return &conn[i];
+        }
+    }
+    return NULL;
+}
+
+/* the frame at head is done with, written or given up */
+static void txq_next(conn_obj_t *c)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    if (q->head != q->tail) {
+        q->slot[q->head % TX_SLOTS]->refs--;
+        q->head++;
+    }
+    q->tries = 0;
+    portEXIT_CRITICAL(&tx_lock);
+    xSemaphoreGive(tx_room);
+}
+
+/* start the next write unless one is outstanding */
+static void txq_kick(void)
+{
+    bool refused;
+    do {
+        conn_obj_t *c = NULL;
+        tx_buf_t *buf = NULL;
+        portENTER_CRITICAL(&tx_lock);
+        for (int i = 1; !tx_busy && i <= n_conns; i++) {
+            int id = (tx_turn + i) % n_conns;
+            txq_obj_t *q = &conn[id].txq;
+            if (conn[id].handle != 0 && !q->cong && q->head != q->tail) {
+                tx_busy = true;
+                tx_turn = id;
+                c = &conn[id];
+                buf = q->slot[q->head % TX_SLOTS];
+            }
+        }
+        portEXIT_CRITICAL(&tx_lock);
+        refused = buf != NULL && esp_spp_write(c->handle, buf->len, buf->data) != ESP_OK;
+        if (refused) {
+            portENTER_CRITICAL(&tx_lock);
+            tx_busy = false;
+            c->txq.refused++;
+            portEXIT_CRITICAL(&tx_lock);
+            txq_next(c); // no ESP_SPP_WRITE_EVT comes for it, on to the next frame
+        }
+    } while (refused);
+}
+
+/*
+ * ESP_SPP_WRITE_EVT. A frame that failed is written again, once the link
+ * is not congested, until it has failed TX_TRIES times.
+ */
+static void txq_done(conn_obj_t *c, bool ok, bool cong)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    tx_busy = false;
+    q->cong = cong;
+    bool next = ok || ++q->tries >= TX_TRIES;
+    portEXIT_CRITICAL(&tx_lock);
+    if (next) {
+        txq_next(c);
+    }
+    txq_kick(); // the next frame, or this one again
+}
+
+/* ESP_SPP_CONG_EVT */
+static void txq_cong(conn_obj_t *c, bool cong)
+{
+    portENTER_CRITICAL(&tx_lock);
+    c->txq.cong = cong;
+    portEXIT_CRITICAL(&tx_lock);
+    txq_kick();
+}
+
+/* drop whatever is queued, the connection is gone; handle is 0 already */
+static void txq_reset(conn_obj_t *c)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    if (q->head != q->tail && tx_busy && &conn[tx_turn] == c) {
+        tx_busy = false; // its ESP_SPP_WRITE_EVT will not come
+    }
+    while (q->head != q->tail) {
+        q->slot[q->head % TX_SLOTS]->refs--;
+        q->head++;
+    }
+    q->cong = false;
+    q->tries = 0;
+    portEXIT_CRITICAL(&tx_lock);
+    if (tx_room != NULL) {
+        xSemaphoreGive(tx_room);
+    }
+}
+
+/* frame pool for conns connections, MicroPython task */
+static bool txq_alloc(int conns)
+{
+    int len = conns * TX_SLOTS;
+    if (tx_pool_len != len) {
+        free(tx_pool);
+        tx_pool = malloc(sizeof(tx_buf_t) * len);
+        tx_pool_len = (tx_pool != NULL) ? len : 0;
+    }
+    for (int i = 0; i < tx_pool_len; i++) {
+        tx_pool[i].refs = 0;
+    }
+    if (tx_room == NULL) {
+        tx_room = xSemaphoreCreateBinary();
+    }
+    tx_busy = false;
+    tx_turn = 0;
+    return tx_pool != NULL && tx_room != NULL;
+}
+
+static void txq_free(void)
+{
+    free(tx_pool);
+    tx_pool = NULL;
+    tx_pool_len = 0;
+}
+
+/* free slots, MicroPython task */
+static uint32_t txq_room(txq_obj_t *q)
+{
+    portENTER_CRITICAL(&tx_lock);
+    uint32_t room = TX_SLOTS - (q->tail - q->head);
+    portEXIT_CRITICAL(&tx_lock);
+    return room;
+}
+
+/*
+ * Wait at most timeout_ms until each of the n queues has a free slot,
+ * MicroPython task only, with the GIL released.
+ */
+static bool txq_wait(conn_obj_t **cs, int n, int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    for (;;) {
+        bool full = false;
+        portENTER_CRITICAL(&tx_lock);
+        for (int i = 0; i < n; i++) {
+            txq_obj_t *q = &cs[i]->txq;
+            full |= (q->tail - q->head) >= TX_SLOTS;
+        }
+        portEXIT_CRITICAL(&tx_lock);
+        if (!full) {
+            return true;
+        }
+        TickType_t spent = xTaskGetTickCount() - start;
+        if (spent >= wait) {
+            return false;
+        }
+        MP_THREAD_GIL_EXIT();
+        xSemaphoreTake(tx_room, wait - spent);
+        MP_THREAD_GIL_ENTER();
+    }
+}
+
+/*
+ * Copy one frame into a pool frame and queue it on each of the n
+ * connections, which must all have room. A connection that closed in the
+ * meantime is skipped. MicroPython task only.
+ */
+static bool txq_put(conn_obj_t **cs, int n, const uint8_t *data, int len)
+{
+    tx_buf_t *buf = NULL;
+    portENTER_CRITICAL(&tx_lock);
+    for (int i = 0; i < tx_pool_len; i++) {
+        if (tx_pool[i].refs == 0) {
+            buf = &tx_pool[i];
+            buf->refs = 1; // taken, held by us until it is queued
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&tx_lock);
+    if (buf == NULL) {
+        return false;
+    }
+    memcpy(buf->data, data, len);
+    buf->len = len;
+    portENTER_CRITICAL(&tx_lock);
+    for (int i = 0; i < n; i++) {
+        txq_obj_t *q = &cs[i]->txq;
+        if (cs[i]->handle != 0 && (q->tail - q->head) < TX_SLOTS) {
+            q->slot[q->tail % TX_SLOTS] = buf;
+            q->tail++;
+            buf->refs++;
+        }
+    }
+    buf->refs--; // ours, back to the pool if nobody took it
+    portEXIT_CRITICAL(&tx_lock);
+    return true;
+}
+
+#define IRQ_RX         0x01 /* min_bytes in the pipe, or the line went idle */
+#define IRQ_CONNECT    0x02
+#define IRQ_DISCONNECT 0x04
+#define IRQ_SCAN       0x08 /* scan() found a device, or ended */
+
+/*
+ * Receive and connection IRQ. esp_spp_cb only ORs the event into pending
+ * and schedules irq_dispatch if it is not scheduled already. Events that
+ * come in before the handler has run are merged, so a burst of frames
+ * costs one call. The handler gets the merged events as its argument.
+ */
+typedef struct _irq_obj_t {
+    uint8_t trigger;       /* events wanted, 0 with no handler */
+    uint32_t min_bytes;
+    uint32_t idle_ms;
+    atomic_uint pending;   /* events not yet handed to the handler */
+    atomic_bool scheduled; /* irq_dispatch is waiting in the scheduler */
+    TimerHandle_t idle;    /* runs out idle_ms after the last frame */
+} irq_obj_t;
+
+static irq_obj_t irq_obj;
+static irq_obj_t *irq = &irq_obj;
+
+/* runs from the MicroPython scheduler, with the GIL */
+STATIC mp_obj_t irq_dispatch(mp_obj_t arg) {
+    atomic_store(&irq->scheduled, false);
+    uint32_t events = atomic_exchange(&irq->pending, 0);
+    mp_obj_t handler = MP_STATE_PORT(btm_irq_handler);
+    if (events != 0 && handler != MP_OBJ_NULL && handler != mp_const_none) {
+       mp_call_function_1(handler, MP_OBJ_NEW_SMALL_INT(events));
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(irq_dispatch_obj, irq_dispatch);
+
+/* esp_spp_cb or the idle timer, never blocks */
+static void irq_fire(irq_obj_t *q, uint32_t events)
+{
+    events &= q->trigger;
+    if (events == 0) {
+        return;
+    }
+    atomic_fetch_or(&q->pending, events);
+    if (!atomic_exchange(&q->scheduled, true)) {
+        if (!mp_sched_schedule(MP_OBJ_FROM_PTR(&irq_dispatch_obj), mp_const_none)) {
+            atomic_store(&q->scheduled, false); // scheduler full, next event tries again
+        }
+    }
+}
+
+/* after a frame went into the pipe */
+static void irq_rx(irq_obj_t *q, pipe_obj_t *p)
+{
+    if ((q->trigger & IRQ_RX) == 0) {
+        return;
+    }
+    uint32_t count = pipe_count(p);
+    if (count >= q->min_bytes || count == p->size) {
+        irq_fire(q, IRQ_RX);
+    }
+    if (q->idle != NULL && q->idle_ms > 0) {
+        xTimerReset(q->idle, 0); // restart the idle time
+    }
+}
+
+/* timer task, idle_ms without a new frame */
+static void irq_idle_cb(TimerHandle_t t)
+{
+    for (int i = 0; i < n_conns; i++) {
+        if (pipe_count(&conn[i].pipe) > 0) {
+            irq_fire(irq, IRQ_RX);
+            break;
+        }
+    }
+}
+
+/* no more events, MicroPython task */
+static void irq_off(irq_obj_t *q)
+{
+    q->trigger = 0;
+    if (q->idle != NULL) {
+        xTimerStop(q->idle, portMAX_DELAY);
+    }
+    atomic_store(&q->pending, 0);
+}
+
+/*
+ * Data path timing for benchmarks, since init() or timing(True). The
+ * ESP_SPP_DATA_IND_EVT cost is in CPU cycles, the rest in microseconds.
+ */
+typedef struct _timing_data_t {
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+    uint32_t rx_first;   /* mp_hal_ticks_us() of the first frame in */
+    uint32_t rx_last;
+    uint64_t cb_cycles;  /* summed over rx_frames */
+    uint32_t cb_max;
+    uint32_t tx_frames;  /* writes confirmed by ESP_SPP_WRITE_EVT */
+    uint32_t tx_bytes;
+    uint32_t tx_first;
+    uint32_t tx_last;
+} timing_data_t;
+
+typedef struct _timing_obj_t {
+    timing_data_t d;
+    portMUX_TYPE lock;
+} timing_obj_t;
+
+static timing_obj_t timing_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static timing_obj_t *timing = &timing_obj;
+
+/* esp_spp_cb, a frame of len bytes took cycles to handle */
+static void timing_rx(timing_obj_t *t, uint32_t len, uint32_t cycles)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    if (t->d.rx_frames == 0) {
+        t->d.rx_first = now;
+    }
+    t->d.rx_last = now;
+    t->d.rx_frames++;
+    t->d.rx_bytes += len;
+    t->d.cb_cycles += cycles;
+    if (cycles > t->d.cb_max) {
+        t->d.cb_max = cycles;
+    }
+    portEXIT_CRITICAL(&t->lock);
+}
+
+/* esp_spp_cb, a write of len bytes is done */
+static void timing_tx(timing_obj_t *t, uint32_t len)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    if (t->d.tx_frames == 0) {
+        t->d.tx_first = now;
+    }
+    t->d.tx_last = now;
+    t->d.tx_frames++;
+    t->d.tx_bytes += len;
+    portEXIT_CRITICAL(&t->lock);
+}
+
+static void timing_reset(timing_obj_t *t)
+{
+    portENTER_CRITICAL(&t->lock);
+    memset(&t->d, 0, sizeof(t->d));
+    portEXIT_CRITICAL(&t->lock);
+}
+
+/* events that match no connection, counted in the total only */
+static stats_obj_t stats_none;
+
+static stats_obj_t *conn_stats(conn_obj_t *c)
+{
+    return (c != NULL) ? &c->stats : &stats_none;
+}
+
+/* every field of stats_obj_t is a uint32_t counter */
+static void stats_add(stats_obj_t *sum, const stats_obj_t *s)
+{
+    uint32_t *d = (uint32_t *) sum;
+    const uint32_t *a = (const uint32_t *) s;
+    for (size_t i = 0; i < sizeof(*s) / sizeof(uint32_t); i++) {
+        d[i] += a[i];
+    }
+}
+
+/* esp_spp_cb, after a frame went into the pipe */
+static void occ_sample(occ_obj_t *o, pipe_obj_t *p)
+{
+    uint32_t count = pipe_count(p);
+    int bin = (count == 0) ? 0 : 32 - __builtin_clz(count);
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&o->lock);
+    if (count > o->d.peak) {
+        o->d.peak = count;
+    }
+    o->d.hist[bin < OCC_BINS ? bin : OCC_BINS - 1]++;
+    if (count > p->high && !o->d.above) {
+        o->d.above = true;
+        o->d.above_since = now;
+    } else if (count <= p->high && o->d.above) {
+        o->d.above = false;
+        o->d.above_us += now - o->d.above_since;
+    }
+    portEXIT_CRITICAL(&o->lock);
+}
+
+static void occ_reset(occ_obj_t *o)
+{
+    portENTER_CRITICAL(&o->lock);
+    memset(&o->d, 0, sizeof(o->d));
+    portEXIT_CRITICAL(&o->lock);
+}
+
+#if BT_SPP_TRACE >= 1
+#define TRACE_LEN 256 /* records kept, then the oldest is overwritten */
+#define TRACE_SPP 0
+#define TRACE_GAP 1
+
+/* one event, 8 bytes little-endian as tools/bt_spp_trace.py reads them */
+typedef struct _trace_rec_t {
+    uint32_t us;    /* mp_hal_ticks_us() */
+    uint8_t src;    /* TRACE_SPP or TRACE_GAP */
+    uint8_t event;  /* esp_spp_cb_event_t or esp_bt_gap_cb_event_t */
+    uint16_t arg;   /* length, congestion flag or status, by event */
+} trace_rec_t;
+
+typedef struct _trace_obj_t {
+    trace_rec_t rec[TRACE_LEN];
+    uint32_t count; /* records written so far */
+    portMUX_TYPE lock;
+} trace_obj_t;
+
+static trace_obj_t trace_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static trace_obj_t *trace = &trace_obj;
+
+/* Bluetooth task, from both callbacks */
+static void trace_put(trace_obj_t *t, uint8_t src, uint8_t event, uint16_t arg)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    trace_rec_t *r = &t->rec[t->count % TRACE_LEN];
+    r->us = now;
+    r->src = src;
+    r->event = event;
+    r->arg = arg;
+    t->count++;
+    portEXIT_CRITICAL(&t->lock);
+}
+
+static uint16_t trace_spp_arg(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_SPP_DATA_IND_EVT:
+        return param->data_ind.len;
+    case ESP_SPP_WRITE_EVT:
+        return param->write.len;
+    case ESP_SPP_CONG_EVT:
+        return param->cong.cong;
+    case ESP_SPP_DISCOVERY_COMP_EVT:
+        return param->disc_comp.status;
+    case ESP_SPP_OPEN_EVT:
+        return param->open.status;
+    case ESP_SPP_SRV_OPEN_EVT:
+        return param->srv_open.status;
+    case ESP_SPP_CLOSE_EVT:
+        return param->close.status;
+    default:
+        return 0;
+    }
+}
+
+static uint16_t trace_gap_arg(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_BT_GAP_AUTH_CMPL_EVT:
+        return param->auth_cmpl.stat;
+    case ESP_BT_GAP_DISC_STATE_CHANGED_EVT:
+        return param->disc_st_chg.state;
+    default:
+        return 0;
+    }
+}
+
+#define TRACE_SPP_EVT(event, param) trace_put(trace, TRACE_SPP, event, trace_spp_arg(event, param))
+#define TRACE_GAP_EVT(event, param) trace_put(trace, TRACE_GAP, event, trace_gap_arg(event, param))
+#else
+#define TRACE_SPP_EVT(event, param)
+#define TRACE_GAP_EVT(event, param)
+#endif
+
+static const esp_spp_mode_t esp_spp_mode = ESP_SPP_MODE_CB;
+static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHENTICATE;
+static const esp_spp_role_t role_master = ESP_SPP_ROLE_MASTER;
+static const esp_bt_inq_mode_t inq_mode = ESP_BT_INQ_MODE_GENERAL_INQUIRY;
+static const uint8_t inq_len = 30;
+static const uint8_t inq_num_rsps = 0;
+
+// use to get slave after discovery
+static char slave_device_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+static uint8_t slave_device_name_len;  
+
+typedef struct _master_obj_t {
+   char name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+   char slave_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+   uint8_t slave_name_len;
+   uint8_t slave_pin_code[17];
+   esp_bd_addr_t slave_addr;
+   bool slave_found; /* slave_addr is set, discovery may stop */
+   int max_bonds;
+} master_obj_t;
+
+master_obj_t *master; /* will get value at btm.init() */
+
+static bool master_storage = false; /* master storage allocation flag */
+
+static bool master_up = false;   /* master not up, can do init */
+
+static SemaphoreHandle_t spp_down = NULL; /* given at ESP_SPP_UNINIT_EVT */
+static bool master_auth = false; /* master not authenticated */
+
+/*
+ * Slaves connected to before: address, SPP channel (SCN) and name. open()
+ * with a name or address found here connects straight away, without the
+ * inquiry and the SDP search. Newest first, kept in NVS across reboots.
+ */
+#define SCN_CACHE_LEN 8
+#define SCN_NAME_LEN 32 /* a longer name is only found by address */
+#define SCN_NVS_SPACE "btm"
+#define SCN_NVS_KEY "scn_cache"
+
+typedef struct _scn_entry_t {
+    esp_bd_addr_t addr;
+    uint8_t scn;  /* 0 for an unused entry */
+    char name[SCN_NAME_LEN + 1];
+} scn_entry_t;
+
+static scn_entry_t scn_cache[SCN_CACHE_LEN];
+static portMUX_TYPE scn_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* read the cache back at init(), an empty one if there is none yet */
+static void scn_load(void)
+{
+    nvs_handle_t h;
+    size_t len = sizeof(scn_cache);
+    memset(scn_cache, 0, sizeof(scn_cache));
+    if (nvs_open(SCN_NVS_SPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(h, SCN_NVS_KEY, scn_cache, &len) != ESP_OK || len != sizeof(scn_cache)) {
+        memset(scn_cache, 0, sizeof(scn_cache)); // none, or from an older layout
+    }
+    nvs_close(h);
+}
+
+/* only when the cache changed, which is at most once per open() */
+static void scn_save(void)
+{
+    scn_entry_t copy[SCN_CACHE_LEN];
+    nvs_handle_t h;
+    portENTER_CRITICAL(&scn_lock);
+    memcpy(copy, scn_cache, sizeof(copy));
+    portEXIT_CRITICAL(&scn_lock);
+    if (nvs_open(SCN_NVS_SPACE, NVS_READWRITE, &h) != ESP_OK) {
+        LOGE("SCN cache not saved");
+        return;
+    }
+    if (nvs_set_blob(h, SCN_NVS_KEY, copy, sizeof(copy)) == ESP_OK) {
+        nvs_commit(h);
+    }
+    nvs_close(h);
+}
+
+/*
+ * Look a slave up by name, or by addr when name is NULL. On a hit addr
+ * and scn are filled in.
+ */
+static bool scn_lookup(const char *name, size_t name_len, uint8_t *addr, uint8_t *scn)
+{
+    bool found = false;
+    portENTER_CRITICAL(&scn_lock);
+    for (int i = 0; i < SCN_CACHE_LEN && !found; i++) {
+        scn_entry_t *e = &scn_cache[i];
+        if (e->scn == 0) {
+            break;
+        }
+        if (name != NULL) {
+            found = strlen(e->name) == name_len && memcmp(e->name, name, name_len) == 0;
+        } else {
+            found = memcmp(e->addr, addr, ESP_BD_ADDR_LEN) == 0;
+        }
+        if (found) {
+            memcpy(addr, e->addr, ESP_BD_ADDR_LEN);
+            *scn = e->scn;
+        }
+    }
+    portEXIT_CRITICAL(&scn_lock);
+    return found;
+}
+
+/* take the entry for addr out, its name if it had one is kept in name */
+static bool scn_remove(const uint8_t *addr, char *name)
+{
+    int i = 0;
+    while (i < SCN_CACHE_LEN && scn_cache[i].scn != 0 && memcmp(scn_cache[i].addr, addr, ESP_BD_ADDR_LEN) != 0) {
+        i++;
+    }
+    if (i == SCN_CACHE_LEN || scn_cache[i].scn == 0) {
+        return false;
+    }
+    if (name != NULL) {
+        strcpy(name, scn_cache[i].name);
+    }
+    memmove(&scn_cache[i], &scn_cache[i + 1], sizeof(scn_entry_t) * (SCN_CACHE_LEN - 1 - i));
+    memset(&scn_cache[SCN_CACHE_LEN - 1], 0, sizeof(scn_entry_t));
+    return true;
+}
+
+/*
+ * ESP_SPP_DISCOVERY_COMP_EVT found the channel. The slave goes in front,
+ * the oldest falls out of a full cache. With no name (name_len 0) the
+ * name it had is kept.
+ */
+static void scn_store(const uint8_t *addr, uint8_t scn, const char *name, size_t name_len)
+{
+    char old[SCN_NAME_LEN + 1] = "";
+    portENTER_CRITICAL(&scn_lock);
+    scn_remove(addr, old);
+    memmove(&scn_cache[1], &scn_cache[0], sizeof(scn_entry_t) * (SCN_CACHE_LEN - 1));
+    scn_entry_t *e = &scn_cache[0];
+    memcpy(e->addr, addr, ESP_BD_ADDR_LEN);
+    e->scn = scn;
+    if (name_len > 0 && name_len <= SCN_NAME_LEN) {
+        memcpy(e->name, name, name_len);
+        e->name[name_len] = '\0';
+    } else {
+        strcpy(e->name, name_len > 0 ? "" : old);
+    }
+    portEXIT_CRITICAL(&scn_lock);
+    scn_save();
+}
+
+/* the cached channel did not work, the slave must have changed */
+static void scn_drop(const uint8_t *addr)
+{
+    portENTER_CRITICAL(&scn_lock);
+    bool dropped = scn_remove(addr, NULL);
+    portEXIT_CRITICAL(&scn_lock);
+    if (dropped) {
+        scn_save();
+    }
+}
+
+/* "aa:bb:cc:dd:ee:ff" or 6 bytes into addr, false for anything else */
+static bool addr_parse(mp_obj_t obj, uint8_t *addr)
+{
+    size_t len;
+    const char *s = mp_obj_str_get_data(obj, &len);
+    if (mp_obj_is_str(obj) == false) {
+        if (len != ESP_BD_ADDR_LEN) {
+            return false;
+        }
+        memcpy(addr, s, ESP_BD_ADDR_LEN);
+        return true;
+    }
+    unsigned int b[ESP_BD_ADDR_LEN];
+    int end = 0;
+    if (len != 17 || sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x%n", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6 || end != 17) {
+        return false;
+    }
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        addr[i] = b[i];
+    }
+    return true;
+}
+
+static mp_obj_t addr_str(const uint8_t *addr)
+{
+    char s[18];
+    snprintf(s, sizeof(s), "%02x:%02x:%02x:%02x:%02x:%02x", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+    return mp_obj_new_str(s, 17);
+}
+
+#define OPEN_INQUIRY 0 /* inquiry for the name, SDP, connect */
+#define OPEN_SDP     1 /* address known: SDP, connect */
+#define OPEN_CACHED  2 /* address and channel known: connect */
+
+/* one open(), the phases in us, 0 for those it did not go through */
+typedef struct _setup_rec_t {
+    uint8_t path;        /* OPEN_*, the way it went in the end */
+    int err;             /* 0 if it connected, else the MP_E* it failed with */
+    uint32_t us;         /* open() to connected or failed */
+    uint32_t inquiry_us; /* inquiry to the name matched */
+    uint16_t seen;       /* names checked up to the match */
+    uint32_t sdp_us;     /* SDP search for the channel */
+    uint32_t auth_us;    /* esp_spp_connect to ESP_BT_GAP_AUTH_CMPL_EVT */
+    uint32_t rfcomm_us;  /* from there to ESP_SPP_OPEN_EVT */
+    uint32_t page_us;    /* esp_spp_connect to ESP_SPP_OPEN_EVT */
+    bool pin;            /* the slave asked for the PIN, it was not bonded */
+} setup_rec_t;
+
+#define SETUP_DONE (1 << 0) /* an open() connected or failed */
+
+/*
+ * How the open() in progress goes and how the last ones went.
+ *
+ * An open() that timed out leaves its SDP search or connect behind, and
+ * ESP_SPP_DISCOVERY_COMP_EVT and ESP_SPP_CL_INIT_EVT do not say whose
+ * they are. Bluedroid answers them in order, so an answer is this
+ * attempt's only if it asked and no older request is still owed. Its
+ * ESP_SPP_OPEN_EVT and ESP_SPP_CLOSE_EVT carry the handle from its
+ * ESP_SPP_CL_INIT_EVT.
+ */
+typedef struct _setup_obj_t {
+    uint8_t path;      /* OPEN_*, of the open() in progress */
+    uint32_t start;    /* mp_hal_ticks_us() at open() */
+    uint32_t sdp;      /* at esp_spp_start_discovery */
+    uint32_t page;     /* at esp_spp_connect */
+    uint32_t auth;     /* at ESP_BT_GAP_AUTH_CMPL_EVT, 0 before */
+    bool auth_failed;
+    bool acl_up;       /* the page was answered, ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT */
+    atomic_uint sdp_owed; /* esp_spp_start_discovery calls not answered yet */
+    atomic_uint cl_owed;  /* esp_spp_connect calls without ESP_SPP_CL_INIT_EVT yet */
+    bool sdp_mine;     /* this attempt waits for its SDP search */
+    bool cl_mine;      /* this attempt waits for its ESP_SPP_CL_INIT_EVT */
+    uint32_t handle;   /* from that ESP_SPP_CL_INIT_EVT, 0 before */
+    setup_rec_t cur;   /* of the open() in progress */
+    setup_rec_t last;  /* of the last open() that connected, us 0 for none yet */
+    setup_rec_t tried; /* of the last open(), connected or not */
+    EventGroupHandle_t done; /* SETUP_DONE, for open() with a timeout */
+} setup_obj_t;
+
+static setup_obj_t setup_obj;
+static setup_obj_t *setup = &setup_obj;
+
+/* the open() in progress connected, err 0, or failed */
+static void setup_end(setup_obj_t *s, int err)
+{
+    s->cur.path = s->path;
+    s->cur.err = err;
+    s->cur.us = mp_hal_ticks_us() - s->start;
+    s->tried = s->cur;
+    if (err == 0) {
+        s->last = s->cur;
+    }
+}
+
+/*
+ * scan() results. esp_bt_gap_cb puts each device that passes the filter
+ * in the table as ESP_BT_GAP_DISC_RES_EVT comes in, a full table loses
+ * the entry seen longest ago. Entries stay valid for ttl_ms, a scan()
+ * that the table can already answer does not start an inquiry at all.
+ */
+#define SCAN_LEN 16
+#define SCAN_NO_RSSI (-128) /* the inquiry result had no RSSI */
+
+typedef struct _scan_entry_t {
+    esp_bd_addr_t addr;
+    bool used;
+    int8_t rssi;
+    uint32_t cod;  /* class of device */
+    uint32_t seen; /* mp_hal_ticks_ms() */
+    char name[SCN_NAME_LEN + 1];
+} scan_entry_t;
+
+typedef struct _scan_obj_t {
+    bool running;
+    char prefix[SCN_NAME_LEN + 1]; /* name filter, "" for any */
+    int min_rssi;    /* SCAN_NO_RSSI for any */
+    int max_results; /* stop the inquiry after that many, 0 for no limit */
+    int found;       /* devices that passed the filter in this scan */
+    uint32_t ttl_ms;
+    scan_entry_t e[SCAN_LEN];
+    portMUX_TYPE lock;
+} scan_obj_t;
+
+static scan_obj_t scan_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static scan_obj_t *scan = &scan_obj;
+
+static bool scan_match(scan_obj_t *s, const char *name, int rssi)
+{
+    size_t len = strlen(s->prefix);
+    if (len > 0 && strncmp(name, s->prefix, len) != 0) {
+        return false;
+    }
+    return s->min_rssi == SCAN_NO_RSSI || (rssi != SCAN_NO_RSSI && rssi >= s->min_rssi);
+}
+
+/*
+ * ESP_BT_GAP_DISC_RES_EVT, false if the device did not pass the filter.
+ * *full turns true once max_results are found.
+ */
+static bool scan_put(scan_obj_t *s, const uint8_t *addr, const char *name, int rssi, uint32_t cod, bool *full)
+{
+    uint32_t now = mp_hal_ticks_ms();
+    bool kept = false;
+    portENTER_CRITICAL(&s->lock);
+    if (s->running && scan_match(s, name, rssi)) {
+        scan_entry_t *e = NULL;
+        for (int i = 0; i < SCAN_LEN && e == NULL; i++) {
+            if (s->e[i].used && memcmp(s->e[i].addr, addr, ESP_BD_ADDR_LEN) == 0) {
+                e = &s->e[i]; // seen before, refresh it
+            }
+        }
+        for (int i = 0; i < SCAN_LEN && e == NULL; i++) {
+            if (!s->e[i].used) {
+                e = &s->e[i];
+            }
+        }
+        if (e == NULL) {
+            e = &s->e[0];
+            for (int i = 1; i < SCAN_LEN; i++) {
+                if (now - s->e[i].seen > now - e->seen) {
+                    e = &s->e[i];
+                }
+            }
+        }
+        memcpy(e->addr, addr, ESP_BD_ADDR_LEN);
+        e->used = true;
+        e->rssi = rssi;
+        e->cod = cod;
+        e->seen = now;
+        strncpy(e->name, name, SCN_NAME_LEN);
+        e->name[SCN_NAME_LEN] = '\0';
+        s->found++;
+        kept = true;
+        *full = s->max_results > 0 && s->found >= s->max_results;
+    }
+    portEXIT_CRITICAL(&s->lock);
+    return kept;
+}
+
+/* drop what is older than ttl_ms, count what passes the filter, under lock */
+static int scan_fresh(scan_obj_t *s)
+{
+    uint32_t now = mp_hal_ticks_ms();
+    int count = 0;
+    for (int i = 0; i < SCAN_LEN; i++) {
+        scan_entry_t *e = &s->e[i];
+        if (e->used && now - e->seen > s->ttl_ms) {
+            e->used = false;
+        }
+        if (e->used && scan_match(s, e->name, e->rssi)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* exact name match among the fresh results, for open() */
+static bool scan_lookup(scan_obj_t *s, const char *name, uint8_t *addr)
+{
+    bool found = false;
+    portENTER_CRITICAL(&s->lock);
+    uint32_t now = mp_hal_ticks_ms();
+    for (int i = 0; i < SCAN_LEN && !found; i++) {
+        scan_entry_t *e = &s->e[i];
+        if (e->used && now - e->seen <= s->ttl_ms && strcmp(e->name, name) == 0) {
+            memcpy(addr, e->addr, ESP_BD_ADDR_LEN);
+            found = true;
+        }
+    }
+    portEXIT_CRITICAL(&s->lock);
+    return found;
+}
+
+/* page the slave and open RFCOMM, from open() or the callbacks */
+static esp_err_t setup_connect(setup_obj_t *s, uint8_t scn, uint8_t *addr)
+{
+    s->page = mp_hal_ticks_us();
+    s->auth = 0;
+    s->auth_failed = false;
+    s->acl_up = false;
+    s->handle = 0;
+    atomic_fetch_add(&s->cl_owed, 1); // before cl_mine, see setup_answer()
+    s->cl_mine = true;
+    esp_err_t ret = esp_spp_connect(sec_mask, role_master, scn, addr);
+    if (ret != ESP_OK) {
+        s->cl_mine = false;
+        atomic_fetch_sub(&s->cl_owed, 1);
+    }
+    return ret;
+}
+
+static esp_err_t setup_sdp(setup_obj_t *s, uint8_t *addr)
+{
+    s->sdp = mp_hal_ticks_us();
+    atomic_fetch_add(&s->sdp_owed, 1);
+    s->sdp_mine = true;
+    esp_err_t ret = esp_spp_start_discovery(addr);
+    if (ret != ESP_OK) {
+        s->sdp_mine = false;
+        atomic_fetch_sub(&s->sdp_owed, 1);
+    }
+    return ret;
+}
+
+/* ESP_SPP_DISCOVERY_COMP_EVT or ESP_SPP_CL_INIT_EVT, true if it answers this attempt */
+static bool setup_answer(atomic_uint *owed, bool *mine)
+{
+    if (atomic_load(owed) == 0) {
+        return false; // not asked for since init()
+    }
+    bool last = atomic_fetch_sub(owed, 1) == 1;
+    if (last && *mine) {
+        *mine = false;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * opening is taken and master holds the slave: connect straight away on
+ * a known channel, search the address for it, or look for the name.
+ * Nothing is under way if the first call fails, the caller ends it.
+ */
+static esp_err_t open_start(uint8_t scn, bool by_addr)
+{
+    setup->start = mp_hal_ticks_us();
+    memset(&setup->cur, 0, sizeof(setup->cur));
+    setup->sdp_mine = false; // what the last attempt left behind is not ours
+    setup->cl_mine = false;
+    setup->handle = 0;
+    if (scn != 0) {
+        setup->path = OPEN_CACHED;
+        LOGI("Master connecting to cached slave, SCN %d", scn);
+        return setup_connect(setup, scn, master->slave_addr);
+    } else if (by_addr) {
+        setup->path = OPEN_SDP;
+        LOGI("Master start SPP discovery");
+        return setup_sdp(setup, master->slave_addr);
+    }
+    setup->path = OPEN_INQUIRY;
+    LOGI("Master start discovery");
+    LOGI("Mode: %d, Len: %d, #Res: %d", inq_mode, inq_len, inq_num_rsps);
+    return esp_bt_gap_start_discovery(inq_mode, inq_len, inq_num_rsps);
+}
+
+/*
+ * Auto-reconnect, see reconnect(). A link that drops without close()
+ * keeps its slot and the slave is paged again at once. Each failed
+ * attempt doubles the wait from base_ms up to max_ms, less a random part
+ * of up to half so that masters that lost a slave together do not page
+ * it in step. After tries failed pages the slave is looked for by name
+ * with an inquiry instead. One attempt runs at a time, in turn with
+ * open() and scan(); the timer runs out when the next one is due.
+ */
+#define RC_HIST 8 /* reconnect times kept */
+
+typedef struct _rc_obj_t {
+    bool on;
+    uint32_t base_ms;
+    uint32_t max_ms;
+    uint32_t tries;
+    TimerHandle_t timer;
+    portMUX_TYPE lock;      /* guards opening and rc_state */
+    uint32_t attempts;      /* since init() */
+    uint32_t count;         /* links brought back since init() */
+    uint32_t hist[RC_HIST]; /* drop to ESP_SPP_OPEN_EVT, us, of the last ones */
+} rc_obj_t;
+
+static rc_obj_t rc_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static rc_obj_t *rc = &rc_obj;
+
+/* take opening for slot id, false if an open() or a scan() is running */
+static bool open_claim(int id)
+{
+    bool ok;
+    portENTER_CRITICAL(&rc->lock);
+    ok = opening < 0 && !scan->running;
+    if (ok) {
+        opening = id;
+        setup->path = OPEN_INQUIRY; // keeps scan() out until open_start() knows
+    }
+    portEXIT_CRITICAL(&rc->lock);
+    return ok;
+}
+
+static uint32_t rc_backoff(uint32_t fails)
+{
+    uint32_t ms = rc->max_ms;
+    if (fails < 32 && (ms >> (fails - 1)) > rc->base_ms) {
+        ms = rc->base_ms << (fails - 1);
+    }
+    return ms - esp_random() % (ms / 2 + 1);
+}
+
+/* arm the timer for the first attempt due, the end of an open() or scan() rearms it */
+static void rc_arm(void)
+{
+    int32_t wait = INT32_MAX;
+    uint32_t now = mp_hal_ticks_ms();
+    if (rc->timer == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&rc->lock);
+    for (int i = 0; opening < 0 && !scan->running && i < n_conns; i++) {
+        int32_t d = (int32_t) (conn[i].rc_due - now);
+        if (conn[i].rc_state == RC_WAIT && d < wait) {
+            wait = d;
+        }
+    }
+    portEXIT_CRITICAL(&rc->lock);
+    if (wait == INT32_MAX) {
+        return;
+    }
+    TickType_t ticks = (wait > 0) ? pdMS_TO_TICKS(wait) : 0;
+    xTimerChangePeriod(rc->timer, (ticks > 0) ? ticks : 1, 0);
+}
+
+/*
+ * The open() in progress failed with err, its slot is free again or backs
+ * off. A no-op if none is in progress.
+ */
+static void open_end(int err)
+{
+    if (opening < 0) {
+        return;
+    }
+    setup_end(setup, err);
+    portENTER_CRITICAL(&rc->lock);
+    if (opening >= 0 && conn[opening].rc_state == RC_TRY) {
+        conn_obj_t *c = &conn[opening];
+        c->rc_fails++;
+        c->rc_due = mp_hal_ticks_ms() + rc_backoff(c->rc_fails);
+        c->rc_state = RC_WAIT;
+    }
+    opening = -1;
+    portEXIT_CRITICAL(&rc->lock);
+    xEventGroupSetBits(setup->done, SETUP_DONE);
+    rc_arm();
+}
+
+/* timer task, start the attempt that is due */
+static void rc_tick(TimerHandle_t t)
+{
+    uint32_t now = mp_hal_ticks_ms();
+    conn_obj_t *c = NULL;
+    portENTER_CRITICAL(&rc->lock);
+    for (int i = 0; opening < 0 && !scan->running && i < n_conns; i++) {
+        if (conn[i].rc_state == RC_WAIT && (int32_t) (now - conn[i].rc_due) >= 0) {
+            c = &conn[i];
+            c->rc_state = RC_TRY;
+            opening = i;
+            setup->path = OPEN_INQUIRY; // as in open_claim()
+        }
+    }
+    portEXIT_CRITICAL(&rc->lock);
+    if (c == NULL) {
+        rc_arm();
+        return;
+    }
+    memcpy(master->slave_addr, c->addr, ESP_BD_ADDR_LEN);
+    memcpy(master->slave_name, c->name, c->name_len);
+    master->slave_name_len = c->name_len;
+    memcpy(master->slave_pin_code, c->pin, sizeof(c->pin));
+    bool by_addr = c->rc_fails < rc->tries || c->name_len == 0;
+    uint8_t scn = 0;
+    if (by_addr) {
+        scn_lookup(NULL, 0, c->addr, &scn);
+    }
+    master->slave_found = by_addr;
+    rc->attempts++;
+    if (open_start(scn, by_addr) != ESP_OK) {
+        open_end(MP_EIO); // a failed attempt, it backs off
+    }
+}
+
+/* ESP_SPP_CLOSE_EVT of a link close() did not ask for */
+static void rc_dropped(conn_obj_t *c)
+{
+    if (rc->on == false) {
+        return;
+    }
+    c->rc_fails = 0;
+    c->rc_due = mp_hal_ticks_ms();
+    c->rc_lost = mp_hal_ticks_us();
+    c->rc_state = RC_WAIT;
+    rc_arm();
+}
+
+/* ESP_SPP_OPEN_EVT for slot c, keep the slave for a reconnect */
+static void open_done(conn_obj_t *c)
+{
+    if (c->rc_state == RC_TRY) {
+        rc->hist[rc->count % RC_HIST] = mp_hal_ticks_us() - c->rc_lost;
+        rc->count++;
+    }
+    c->rc_state = RC_OFF;
+    memcpy(c->addr, master->slave_addr, ESP_BD_ADDR_LEN);
+    memcpy(c->name, master->slave_name, master->slave_name_len);
+    c->name_len = master->slave_name_len;
+    memcpy(c->pin, master->slave_pin_code, sizeof(c->pin));
+}
+
+/* MicroPython task, no more attempts */
+static void rc_stop(void)
+{
+    rc->on = false;
+    if (rc->timer != NULL) {
+        xTimerStop(rc->timer, portMAX_DELAY);
+    }
+    portENTER_CRITICAL(&rc->lock);
+    for (int i = 0; i < MAX_CONNS; i++) {
+        conn[i].rc_state = RC_OFF;
+    }
+    portEXIT_CRITICAL(&rc->lock);
+}
+
+#define BOND_NVS_SPACE SCN_NVS_SPACE
+
+/*
+ * Bonded peers. Bluedroid keeps the link keys in NVS itself, so a bonded
+ * peer authenticates without the PIN. This keeps them in last-used order,
+ * in NVS as well, and unbonds the least recently used when there are more
+ * than max_bonds. A peer is added by pairing with it.
+ */
+#define BOND_MAX 16
+#define BOND_NVS_KEY "bond_lru"
+
+typedef struct _bond_obj_t {
+    esp_bd_addr_t addr[BOND_MAX + 1]; /* most recently used first, one spare for bond_touch */
+    int count;
+    int max;     /* max_bonds from init() */
+    portMUX_TYPE lock;
+} bond_obj_t;
+
+static bond_obj_t bond_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static bond_obj_t *bond = &bond_obj;
+
+static void bond_save(bond_obj_t *b)
+{
+    esp_bd_addr_t copy[BOND_MAX + 1];
+    nvs_handle_t h;
+    portENTER_CRITICAL(&b->lock);
+    int count = b->count;
+    memcpy(copy, b->addr, sizeof(copy));
+    portEXIT_CRITICAL(&b->lock);
+    if (nvs_open(BOND_NVS_SPACE, NVS_READWRITE, &h) != ESP_OK) {
+        LOGE("bond order not saved");
+        return;
+    }
+    if (nvs_set_blob(h, BOND_NVS_KEY, copy, count * ESP_BD_ADDR_LEN) == ESP_OK) {
+        nvs_commit(h);
+    }
+    nvs_close(h);
+}
+
+static int bond_index(bond_obj_t *b, const uint8_t *addr)
+{
+    for (int i = 0; i < b->count; i++) {
+        if (memcmp(b->addr[i], addr, ESP_BD_ADDR_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* the least recently used beyond max go, outside the lock */
+static void bond_trim(bond_obj_t *b)
+{
+    esp_bd_addr_t gone[BOND_MAX + 1];
+    int n = 0;
+    portENTER_CRITICAL(&b->lock);
+    while (b->count > b->max) {
+        b->count--;
+        memcpy(gone[n++], b->addr[b->count], ESP_BD_ADDR_LEN);
+    }
+    portEXIT_CRITICAL(&b->lock);
+    for (int i = 0; i < n; i++) {
+        esp_bt_gap_remove_bond_device(gone[i]);
+    }
+}
+
+/*
+ * After the stack is up: the order saved in NVS, matched against the
+ * bonds the stack really has. Bonds it has that are not in the order yet
+ * go last.
+ */
+static void bond_load(bond_obj_t *b, int max)
+{
+    esp_bd_addr_t saved[BOND_MAX];
+    esp_bd_addr_t stack[BOND_MAX];
+    size_t len = sizeof(saved);
+    int n_saved = 0;
+    nvs_handle_t h;
+    if (nvs_open(BOND_NVS_SPACE, NVS_READONLY, &h) == ESP_OK) {
+        if (nvs_get_blob(h, BOND_NVS_KEY, saved, &len) == ESP_OK) {
+            n_saved = len / ESP_BD_ADDR_LEN;
+        }
+        nvs_close(h);
+    }
+    int n_stack = esp_bt_gap_get_bond_device_num();
+    if (n_stack > BOND_MAX) {
+        n_stack = BOND_MAX; // more than we can order, the rest is left alone
+    }
+    if (n_stack < 0 || esp_bt_gap_get_bond_device_list(&n_stack, stack) != ESP_OK) {
+        n_stack = 0;
+    }
+    portENTER_CRITICAL(&b->lock);
+    b->max = max;
+    b->count = 0;
+    for (int i = 0; i < n_saved; i++) {
+        for (int j = 0; j < n_stack; j++) {
+            if (memcmp(saved[i], stack[j], ESP_BD_ADDR_LEN) == 0) {
+                memcpy(b->addr[b->count++], saved[i], ESP_BD_ADDR_LEN);
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < n_stack; j++) {
+        if (bond_index(b, stack[j]) < 0) {
+            memcpy(b->addr[b->count++], stack[j], ESP_BD_ADDR_LEN);
+        }
+    }
+    portEXIT_CRITICAL(&b->lock);
+    bond_trim(b);
+    bond_save(b);
+}
+
+/* ESP_BT_GAP_AUTH_CMPL_EVT, the peer goes in front */
+static void bond_touch(bond_obj_t *b, const uint8_t *addr)
+{
+    portENTER_CRITICAL(&b->lock);
+    int i = bond_index(b, addr);
+    if (i == 0) {
+        portEXIT_CRITICAL(&b->lock);
+        return; // already in front, nothing to save
+    }
+    if (i < 0) {
+        i = b->count++; // new, bond_trim makes room
+    }
+    memmove(b->addr[1], b->addr[0], i * ESP_BD_ADDR_LEN);
+    memcpy(b->addr[0], addr, ESP_BD_ADDR_LEN);
+    portEXIT_CRITICAL(&b->lock);
+    bond_trim(b);
+    bond_save(b);
+}
+
+/* unbond one peer, or all of them with addr NULL */
+static void bond_remove(bond_obj_t *b, const uint8_t *addr)
+{
+    esp_bd_addr_t gone[BOND_MAX + 1];
+    int n = 0;
+    portENTER_CRITICAL(&b->lock);
+    if (addr == NULL) {
+        n = b->count;
+        memcpy(gone, b->addr, n * ESP_BD_ADDR_LEN);
+        b->count = 0;
+    } else {
+        int i = bond_index(b, addr);
+        if (i >= 0) {
+            b->count--;
+            memmove(b->addr[i], b->addr[i + 1], (b->count - i) * ESP_BD_ADDR_LEN);
+        }
+        memcpy(gone[n++], addr, ESP_BD_ADDR_LEN); // the stack may have it all the same
+    }
+    portEXIT_CRITICAL(&b->lock);
+    for (int i = 0; i < n; i++) {
+        esp_bt_gap_remove_bond_device(gone[i]);
+    }
+    bond_save(b);
+}
+
+static bool get_name_from_eir(uint8_t *eir, char *bdname, uint8_t *bdname_len)
+{
+    uint8_t *rmt_bdname = NULL;
+    uint8_t rmt_bdname_len = 0;
+
+    if (!eir) {
+        return false;
+    }
+
+    rmt_bdname = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &rmt_bdname_len);
+    if (!rmt_bdname) {
+        rmt_bdname = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &rmt_bdname_len);
+    }
+
+    if (rmt_bdname) {
+        if (rmt_bdname_len > ESP_BT_GAP_MAX_BDNAME_LEN) {
+            rmt_bdname_len = ESP_BT_GAP_MAX_BDNAME_LEN;
+        }
+
+        if (bdname) {
+            memcpy(bdname, rmt_bdname, rmt_bdname_len);
+            bdname[rmt_bdname_len] = '\0';
+        }
+        if (bdname_len) {
+            *bdname_len = rmt_bdname_len;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * The connect of open() failed. A channel from the cache that RFCOMM
+ * turned down on a link that came up gets one more go with an SDP
+ * search, in case the slave moved its service. A slave that did not
+ * answer the page or the PIN keeps its entry.
+ */
+static void open_failed(void)
+{
+    bool refused = setup->acl_up && !setup->auth_failed;
+    if (opening >= 0 && setup->path == OPEN_CACHED && refused) {
+        scn_drop(master->slave_addr);
+        setup->path = OPEN_SDP;
+        if (setup_sdp(setup, master->slave_addr) != ESP_OK) {
+            open_end(MP_EIO);
+        }
+        return;
+    }
+    open_end(setup->auth_failed ? MP_EACCES : MP_ECONNABORTED);
+}
+
+static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    uint8_t *items;
+    int count;
+    uint32_t start; /* cycle count at ESP_SPP_DATA_IND_EVT */
+    conn_obj_t *c;
+    pipe_obj_t *p;
+    bool lost;
+    bool mine; /* the event is for the open() in progress */
+
+    TRACE_SPP_EVT(event, param);
+    switch (event) {
+    case ESP_SPP_INIT_EVT:
+        LOGI("ESP_SPP_INIT_EVT SE#%d", event);
+        LOGI("Status %d", param->init.status);
+        break;
+    case ESP_SPP_UNINIT_EVT:
+        LOG_EVT("ESP_SPP_UNINIT_EVT");
+        xSemaphoreGive(spp_down);
+        break;
+    case ESP_SPP_DISCOVERY_COMP_EVT:
+        LOGI("ESP_SPP_DISCOVERY_COMP_EVT SE#%d", event);
+        LOGI("Status=%d, Server Channel Number=%d", param->disc_comp.status, param->disc_comp.scn_num);
+        if (!setup_answer(&setup->sdp_owed, &setup->sdp_mine) || opening < 0) {
+            break; // close() or a timeout gave the open() up
+        }
+        setup->cur.sdp_us = mp_hal_ticks_us() - setup->sdp;
+        if (param->disc_comp.status == ESP_SPP_SUCCESS) {
+            LOGI("Master connecting to slave");
+            scn_store(master->slave_addr, param->disc_comp.scn[0],
+                master->slave_name, setup->path == OPEN_INQUIRY ? master->slave_name_len : 0);
+            if (setup_connect(setup, param->disc_comp.scn[0], master->slave_addr) != ESP_OK) {
+                open_end(MP_EIO);
+            }
+        } else {
+            open_end(MP_EHOSTUNREACH); // slave out of reach or no SPP service
+        }
+        break;
+    case ESP_SPP_OPEN_EVT:
+        LOG_EVT("ESP_SPP_OPEN_EVT");
+        mine = opening >= 0 && param->open.handle == setup->handle;
+        if (param->open.status != ESP_SPP_SUCCESS) {
+            if (mine) {
+                open_failed();
+            }
+            break;
+        }
+        if (!mine) {
+            esp_spp_disconnect(param->open.handle); // close() or a timeout came first
+            break;
+        }
+        c = &conn[opening];
+        open_done(c);
+        setup->cur.page_us = mp_hal_ticks_us() - setup->page;
+        setup->cur.rfcomm_us = mp_hal_ticks_us() - (setup->auth != 0 ? setup->auth : setup->page);
+        setup_end(setup, 0);
+        c->handle = param->open.handle;
+        c->ready = true;
+        opening = -1;
+        xEventGroupSetBits(setup->done, SETUP_DONE);
+        irq_fire(irq, IRQ_CONNECT);
+        c->stats.connects++;
+        rc_arm(); // another slot may be waiting for its turn
+        break;
+    case ESP_SPP_CLOSE_EVT:
+        LOG_EVT("ESP_SPP_CLOSE_EVT");
+        c = conn_find(param->close.handle);
+        if (c == NULL) {
+            if (opening >= 0 && param->close.handle == setup->handle) {
+                open_failed(); // the page or RFCOMM failed
+            }
+            break;
+        }
+        lost = c->ready; // close() clears it first
+        c->ready = false;
+        c->handle = 0; // before txq_reset, nothing more is queued on it
+        txq_reset(c);
+        txq_kick();
+        irq_fire(irq, IRQ_DISCONNECT);
+        c->stats.disconnects++;
+        if (lost) {
+            rc_dropped(c);
+        }
+        break;
+    case ESP_SPP_START_EVT:
+        LOG_EVT("ESP_SPP_START_EVT");
+        break;
+    case ESP_SPP_CL_INIT_EVT:
+        LOG_EVT("ESP_SPP_CL_INIT_EVT");
+        if (!setup_answer(&setup->cl_owed, &setup->cl_mine) || opening < 0) {
+            break;
+        }
+        if (param->cl_init.status == ESP_SPP_SUCCESS) {
+            setup->handle = param->cl_init.handle;
+        } else {
+            open_end(MP_ECONNABORTED); // no ESP_SPP_OPEN_EVT comes
+        }
+        break;
+    case ESP_SPP_DATA_IND_EVT:
+        start = mp_hal_ticks_cpu();
+        LOG_EVT("ESP_SPP_DATA_IND_EVT");
+        c = conn_find(param->data_ind.handle);
+        if (c == NULL) {
+            break;
+        }
+        p = &c->pipe;
+        items = param->data_ind.data;
+        count = param->data_ind.len;
+        if (p->framing != FRAME_NONE) {
+            count = frame_put(p, items, count); // whole messages only
+        } else if (p->flow) {
+            count = pipe_put_flow(p, items, count);
+        } else {
+            count = pipe_put(p, items, count); // what does not fit is dropped
+        }
+        LOGI("#bytes in: %d", count);
+        c->stats.rx_frames++;
+        c->stats.rx_bytes += (count > 0) ? count : 0;
+        c->stats.rx_dropped += param->data_ind.len - count;
+        occ_sample(&c->occ, p);
+        irq_rx(irq, p);
+        timing_rx(timing, param->data_ind.len, mp_hal_ticks_cpu() - start);
+        break;
+    case ESP_SPP_CONG_EVT:
+        LOG_EVT("ESP_SPP_CONG_EVT");
+        LOGI("Traffic congestion cong=%d", param->cong.cong);
+        c = conn_find(param->cong.handle);
+        if (param->cong.cong) {
+            conn_stats(c)->cong_on++;
+        } else {
+            conn_stats(c)->cong_off++;
+        }
+        if (c != NULL) {
+            txq_cong(c, param->cong.cong);
+        }
+        break;
+    case ESP_SPP_WRITE_EVT:
+        LOG_EVT("ESP_SPP_WRITE_EVT");
+        LOGI("ESP_SPP_WRITE_EVT len=%d cong=%d", param->write.len , param->write.cong);
+        c = conn_find(param->write.handle);
+        if (param->write.status == ESP_SPP_SUCCESS) {
+            timing_tx(timing, param->write.len);
+            conn_stats(c)->tx_frames++;
+            conn_stats(c)->tx_bytes += param->write.len;
+        } else {
+            conn_stats(c)->tx_failed++;
+        }
+        if (c != NULL) {
+            txq_done(c, param->write.status == ESP_SPP_SUCCESS, param->write.cong);
+        }
+        break;
+    case ESP_SPP_SRV_OPEN_EVT:
+        LOG_EVT("ESP_SPP_SRV_OPEN_EVT");
+        break;
+    default:
+        LOGI("Unhandled ESP_SPP event: %d", event);
+        break;
+    }
+}
+
+static void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
+{
+    TRACE_GAP_EVT(event, param);
+    switch(event){
+    case ESP_BT_GAP_DISC_RES_EVT:{
+        LOGI("ESP_BT_GAP_DISC_RES_EVT GE#%d", event);
+        LOG_HEX(param->disc_res.bda, ESP_BD_ADDR_LEN);
+        int rssi = SCAN_NO_RSSI;
+        uint32_t cod = 0;
+        slave_device_name[0] = '\0';
+        for (int i = 0; i < param->disc_res.num_prop; i++){
+            esp_bt_gap_dev_prop_t *prop = &param->disc_res.prop[i];
+            if (prop->type == ESP_BT_GAP_DEV_PROP_RSSI) {
+                rssi = *(int8_t *) prop->val;
+            } else if (prop->type == ESP_BT_GAP_DEV_PROP_COD) {
+                cod = *(uint32_t *) prop->val;
+            } else if (prop->type == ESP_BT_GAP_DEV_PROP_BDNAME && slave_device_name[0] == '\0') {
+                int len = (prop->len > ESP_BT_GAP_MAX_BDNAME_LEN) ? ESP_BT_GAP_MAX_BDNAME_LEN : prop->len;
+                memcpy(slave_device_name, prop->val, len);
+                slave_device_name[len] = '\0';
+            }
+        }
+        for (int i = 0; i < param->disc_res.num_prop; i++){
+            if (param->disc_res.prop[i].type == ESP_BT_GAP_DEV_PROP_EIR
+                && get_name_from_eir(param->disc_res.prop[i].val, slave_device_name, &slave_device_name_len)){
+                LOG_CHAR(slave_device_name, slave_device_name_len);
+                if (opening >= 0 && setup->path == OPEN_INQUIRY && master->slave_found == false) {
+                    setup->cur.seen++;
+                }
+                if (opening >= 0 && setup->path == OPEN_INQUIRY && master->slave_found == false
+                    && strlen(slave_device_name) == master->slave_name_len
+                    && strncmp(master->slave_name, slave_device_name, master->slave_name_len) == 0) {
+                    memcpy(master->slave_addr, param->disc_res.bda, ESP_BD_ADDR_LEN);
+                    master->slave_found = true;
+                    setup->cur.inquiry_us = mp_hal_ticks_us() - setup->start;
+                    LOGI("Slave found. Master start SPP discovery");
+                    if (setup_sdp(setup, master->slave_addr) != ESP_OK) {
+                        open_end(MP_EIO);
+                    }
+                    esp_bt_gap_cancel_discovery();
+                }
+            }
+        }
+        bool full = false;
+        if (scan->running && scan_put(scan, param->disc_res.bda, slave_device_name, rssi, cod, &full)) {
+            if (full) {
+                esp_bt_gap_cancel_discovery(); // enough found
+            }
+            irq_fire(irq, IRQ_SCAN);
+        }
+        break;
+    }
+    case ESP_BT_GAP_DISC_STATE_CHANGED_EVT:
+        LOGI("ESP_BT_GAP_DISC_STATE_CHANGED_EVT GE#%d", event);
+        LOGI("State: %d", param->disc_st_chg.state);
+        if (param->disc_st_chg.state != ESP_BT_GAP_DISCOVERY_STOPPED) {
+            break;
+        }
+        if (opening >= 0 && setup->path == OPEN_INQUIRY && master->slave_found == false) {
+            open_end(MP_ENOENT); // slave not found
+        }
+        if (scan->running) {
+            scan->running = false;
+            irq_fire(irq, IRQ_SCAN);
+            rc_arm(); // attempts wait for the scan
+        }
+        break;
+    case ESP_BT_GAP_RMT_SRVCS_EVT:
+        LOGI("ESP_BT_GAP_RMT_SRVCS_EVT GE#%d", event);
+        break;
+    case ESP_BT_GAP_RMT_SRVC_REC_EVT:
+        LOGI("ESP_BT_GAP_RMT_SRVC_REC_EVT GE#%d", event);
+        break;
+    case ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT:
+        LOG_EVT("ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT");
+        if (opening >= 0 && param->acl_conn_cmpl_stat.stat == ESP_BT_STATUS_SUCCESS
+            && memcmp(param->acl_conn_cmpl_stat.bda, master->slave_addr, ESP_BD_ADDR_LEN) == 0) {
+            setup->acl_up = true;
+        }
+        break;
+    case ESP_BT_GAP_AUTH_CMPL_EVT:{
+        LOGI("ESP_BT_GAP_AUTH_CMPL_EVT GE#%d", event);
+        if (opening >= 0) {
+            setup->auth = mp_hal_ticks_us();
+            setup->auth_failed = param->auth_cmpl.stat != ESP_BT_STATUS_SUCCESS;
+            setup->cur.auth_us = setup->auth - setup->page;
+        }
+        if (param->auth_cmpl.stat == ESP_BT_STATUS_SUCCESS) {
+            master_auth = true;
+            bond_touch(bond, param->auth_cmpl.bda);
+            LOGI("Authentication success: %s", param->auth_cmpl.device_name);
+            LOG_HEX(param->auth_cmpl.bda, ESP_BD_ADDR_LEN);
+        } else {
+            master_auth = false;
+            LOGE("Authentication failed, status:%d", param->auth_cmpl.stat);
+            conn_stats(opening >= 0 ? &conn[opening] : NULL)->auth_failed++;
+        }
+        break;
+    }
+    case ESP_BT_GAP_PIN_REQ_EVT:{
+        LOGI("ESP_BT_GAP_PIN_REQ_EVT GE#%d", event);
+        LOGI("ESP_BT_GAP_PIN_REQ_EVT min_16_digit:%d", param->pin_req.min_16_digit);
+        setup->cur.pin = true;
+        if (param->pin_req.min_16_digit) {
+            LOGI("Input pin code: 0000 0000 0000 0000");
+            esp_bt_gap_pin_reply(param->pin_req.bda, true, 16, master->slave_pin_code);
+        } else {
+            LOGI("Input pin code: 1234");
+            esp_bt_gap_pin_reply(param->pin_req.bda, true, 4, master->slave_pin_code);
+        }
+        break;
+    }
+
+    default:
+        LOGI("Unhandled ESP_BT_GAP event: GE#%d", event);
+        break;
+    }
+}
+
+/*
+ * How far the Bluetooth stack is up is asked of the controller and
+ * Bluedroid, so a stack that bts or the firmware left up is taken as it
+ * is. init() brings it up from there, deinit() takes it down and
+ * deinit(True) leaves it up, so the next init() only restarts SPP: a
+ * warm start.
+ */
+#define SPP_DOWN_MS 1000 /* wait for ESP_SPP_UNINIT_EVT at deinit() */
+
+/* init() stages, timed for init_time() */
+#define INIT_NVS        0
+#define INIT_CONTROLLER 1
+#define INIT_BLUEDROID  2
+#define INIT_SPP        3
+#define INIT_START      4 /* name, scan mode */
+#define INIT_STAGES     5
+
+typedef struct _init_time_t {
+    uint32_t us[INIT_STAGES];
+    bool warm; /* the stack was up already */
+} init_time_t;
+
+static init_time_t init_time_obj;
+static init_time_t *init_time = &init_time_obj;
+
+/* stage i took from t till now, returns now */
+static uint32_t init_stage(int i, uint32_t t)
+{
+    uint32_t now = mp_hal_ticks_us();
+    init_time->us[i] = now - t;
+    return now;
+}
+
+/* take the stack down from where it is */
+static void stack_down(void)
+{
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_ENABLED) {
+        esp_bluedroid_disable();
+    }
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        esp_bluedroid_deinit();
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_ENABLED) {
+        esp_bt_controller_disable();
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_INITED) {
+        esp_bt_controller_deinit();
+    }
+}
+
+/* nothing of the stack is up */
+static bool stack_is_down(void)
+{
+    return esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_IDLE;
+}
+
+/* let go of the buffers of all connections, no callback may use them */
+static void conns_free(void)
+{
+    for (int i = 0; i < MAX_CONNS; i++) {
+        pipe_free(&conn[i].pipe);
+        conn[i].txq.head = conn[i].txq.tail;
+        conn[i].ready = false;
+        conn[i].handle = 0;
+    }
+    txq_free();
+}
+
+/*
+ * Bring the stack up from where it is and start SPP. On an error, *what
+ * names the call that failed; the stack stays where it got to.
+ */
+static esp_err_t btm_start(const char **what)
+{
+    esp_err_t ret = ESP_OK;
+    uint32_t t = mp_hal_ticks_us();
+    memset(init_time, 0, sizeof(*init_time));
+    init_time->warm = (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_ENABLED);
+
+    if (stack_is_down()) {
+        *what = "nvs_flash_init";
+        ret = nvs_flash_init();
+        if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+            if ((ret = nvs_flash_erase()) == ESP_OK) {
+                ret = nvs_flash_init();
+            }
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    scn_load(); // NVS may have been brought up by bts
+    t = init_stage(INIT_NVS, t);
+
+    if (stack_is_down()) {
+        *what = "esp_bt_controller_mem_release";
+        ret = esp_bt_controller_mem_release(ESP_BT_MODE_BLE);
+        if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+            return ret; // ESP_ERR_INVALID_STATE: given back already, it is once per boot
+        }
+        esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+        *what = "esp_bt_controller_init";
+        if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
+            return ret;
+        }
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_INITED) {
+        *what = "esp_bt_controller_enable";
+        if ((ret = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT)) != ESP_OK) {
+            return ret;
+        }
+    }
+    t = init_stage(INIT_CONTROLLER, t);
+
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_UNINITIALIZED) {
+        *what = "esp_bluedroid_init";
+        if ((ret = esp_bluedroid_init()) != ESP_OK) {
+            return ret;
+        }
+    }
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        *what = "esp_bluedroid_enable";
+        if ((ret = esp_bluedroid_enable()) != ESP_OK) {
+            return ret;
+        }
+    }
+    // on a warm start too, bts may have registered its own since
+    *what = "esp_bt_gap_register_callback";
+    if ((ret = esp_bt_gap_register_callback(esp_bt_gap_cb)) != ESP_OK) {
+        return ret;
+    }
+    *what = "esp_spp_register_callback";
+    if ((ret = esp_spp_register_callback(esp_spp_cb)) != ESP_OK) {
+        return ret;
+    }
+    t = init_stage(INIT_BLUEDROID, t);
+
+    *what = "esp_spp_init";
+    if ((ret = esp_spp_init(esp_spp_mode)) != ESP_OK) {
+        return ret;
+    }
+    t = init_stage(INIT_SPP, t);
+
+    // set others
+    *what = "esp_bt_dev_set_device_name";
+    if ((ret = esp_bt_dev_set_device_name(master->name)) == ESP_OK) {
+        *what = "esp_bt_gap_set_scan_mode";
+        ret = esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_GENERAL_DISCOVERABLE);
+    }
+    if (ret != ESP_OK) {
+        esp_spp_deinit(); // the next init() starts it again
+        return ret;
+    }
+    bond_load(bond, master->max_bonds);
+    LOGI("My device name: %s", master->name);
+    init_stage(INIT_START, t);
+    return ESP_OK;
+}
+
+STATIC mp_obj_t btm_init(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_name, ARG_rxbuf, ARG_flow, ARG_framing, ARG_conns, ARG_max_bonds };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_name, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL} },
+        { MP_QSTR_rxbuf, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = DEFAULT_PIPE_SIZE} },
+        { MP_QSTR_flow, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+        { MP_QSTR_framing, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = FRAME_NONE} },
+        { MP_QSTR_conns, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
+        { MP_QSTR_max_bonds, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 8} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    if (master_up == true) {
+       return mp_const_false;
+    }
+    const char *mn = mp_obj_str_get_str(args[ARG_name].u_obj);
+    int rxbuf = args[ARG_rxbuf].u_int;
+    if (rxbuf <= 0 || rxbuf > MAX_PIPE_SIZE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad rxbuf"));
+    }
+    int framing = args[ARG_framing].u_int;
+    if (framing < FRAME_NONE || framing > FRAME_COBS) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad framing"));
+    }
+    int conns = args[ARG_conns].u_int;
+    if (conns < 1 || conns > MAX_CONNS) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad conns"));
+    }
+    int max_bonds = args[ARG_max_bonds].u_int;
+    if (max_bonds < 1 || max_bonds > BOND_MAX) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad max_bonds"));
+    }
+    if (master_storage == false) {
+       // create master object
+       master_obj_t *mo = m_new_obj(master_obj_t);
+       memcpy(mo->name, mn, strlen(mn));  // master name
+       master = mo;
+       master_storage = true;  // ready with storage
+    } else {
+       memcpy(master->name, mn, strlen(mn));  // master name
+    }
+    for (int i = 0; i < MAX_CONNS; i++) {
+       conn_obj_t *c = &conn[i];
+       c->handle = 0;
+       c->ready = false;
+       c->txq.head = c->txq.tail;
+       c->txq.cong = false;
+       c->txq.tries = 0;
+       if (i >= conns) {
+          pipe_free(&c->pipe); // left over from an init() with more conns
+          continue;
+       }
+       if (pipe_alloc(&c->pipe, rxbuf) == false) {
+          conns_free(); // not the ones allocated before this one either
+          mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for rxbuf"));
+       }
+       c->pipe.flow = args[ARG_flow].u_bool;
+       c->pipe.framing = framing;
+       c->pipe.held = 0;
+       c->pipe.resyncs = 0;
+       c->txq.refused = 0;
+       memset(&c->stats, 0, sizeof(c->stats));
+       occ_reset(&c->occ);
+    }
+    if (txq_alloc(conns) == false) {
+       conns_free();
+       mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for send queue"));
+    }
+    master->max_bonds = max_bonds;
+    n_conns = conns;
+    opening = -1;
+    rc->attempts = 0;
+    rc->count = 0;
+    if (setup->done == NULL) {
+       setup->done = xEventGroupCreate();
+       if (setup->done == NULL) {
+          conns_free();
+          mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for event group"));
+       }
+    }
+    memset(&setup->last, 0, sizeof(setup->last));
+    memset(&setup->tried, 0, sizeof(setup->tried));
+    atomic_store(&setup->sdp_owed, 0);
+    atomic_store(&setup->cl_owed, 0);
+    timing_reset(timing);
+    memset(&stats_none, 0, sizeof(stats_none));
+    if (spp_down == NULL && (spp_down = xSemaphoreCreateBinary()) == NULL) {
+       conns_free();
+       mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for semaphore"));
+    }
+    const char *what = "";
+    esp_err_t ret = btm_start(&what);
+    if (ret != ESP_OK) {
+       conns_free(); // SPP is not running, no callback has a connection
+       LOGE("%s failed: %s", what, esp_err_to_name(ret));
+       mp_raise_msg_varg(&mp_type_OSError, MP_ERROR_TEXT("%s failed: %s"), what, esp_err_to_name(ret));
+    }
+    master_up = true;  // master is up, can deinit
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(btm_init_obj, 1, btm_init);
+
+/*
+ * irq(handler=None, trigger=IRQ_RX, min_bytes=1, idle_ms=0)
+ *
+ * handler(events) is scheduled when at least min_bytes are in the pipe,
+ * or, with idle_ms, when no frame has come for idle_ms and the pipe is
+ * not empty. IRQ_CONNECT and IRQ_DISCONNECT follow ready(), IRQ_SCAN
+ * comes with each device the scan() filter keeps and when the scan
+ * ends. A handler of None switches the IRQ off.
+ */
+STATIC mp_obj_t btm_irq(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_handler, ARG_trigger, ARG_min_bytes, ARG_idle_ms };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_handler, MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_trigger, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = IRQ_RX} },
+        { MP_QSTR_min_bytes, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
+        { MP_QSTR_idle_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_obj_t handler = args[ARG_handler].u_obj;
+    if (handler != mp_const_none && !mp_obj_is_callable(handler)) {
+       mp_raise_ValueError(MP_ERROR_TEXT("handler not callable"));
+    }
+    if (args[ARG_min_bytes].u_int < 1 || args[ARG_idle_ms].u_int < 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad irq args"));
+    }
+    irq_off(irq); // quiet while the settings change
+    MP_STATE_PORT(btm_irq_handler) = handler;
+    if (handler == mp_const_none) {
+       return mp_const_none;
+    }
+    irq->min_bytes = args[ARG_min_bytes].u_int;
+    irq->idle_ms = args[ARG_idle_ms].u_int;
+    if (irq->idle_ms > 0) {
+       TickType_t period = pdMS_TO_TICKS(irq->idle_ms);
+       if (period == 0) {
+          period = 1;
+       }
+       if (irq->idle == NULL) {
+          irq->idle = xTimerCreate("btm_idle", period, pdFALSE, NULL, irq_idle_cb);
+          if (irq->idle == NULL) {
+             mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for idle timer"));
+          }
+       } else {
+          xTimerChangePeriod(irq->idle, period, portMAX_DELAY);
+          xTimerStop(irq->idle, portMAX_DELAY); // ChangePeriod starts it
+       }
+    }
+    irq->trigger = args[ARG_trigger].u_int & (IRQ_RX | IRQ_CONNECT | IRQ_DISCONNECT | IRQ_SCAN);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(btm_irq_obj, 0, btm_irq);
+
+/*
+ * timing([reset]) -> dict
+ *
+ * rx_us/tx_us is the time from the first to the last frame, so
+ * bytes * 1000000 / us is the sustained rate. cb_cycles / rx_frames is
+ * the mean cost of ESP_SPP_DATA_IND_EVT, divide by machine.freq() / 1000000
+ * for microseconds.
+ */
+STATIC mp_obj_t btm_timing(size_t n_args, const mp_obj_t *args) {
+    timing_data_t d;
+    portENTER_CRITICAL(&timing->lock);
+    d = timing->d;
+    portEXIT_CRITICAL(&timing->lock);
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       timing_reset(timing);
+    }
+    mp_obj_t dict = mp_obj_new_dict(8);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_frames), mp_obj_new_int_from_uint(d.rx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_bytes), mp_obj_new_int_from_uint(d.rx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_us), mp_obj_new_int_from_uint(d.rx_last - d.rx_first));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cb_cycles), mp_obj_new_int_from_ull(d.cb_cycles));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cb_max), mp_obj_new_int_from_uint(d.cb_max));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_frames), mp_obj_new_int_from_uint(d.tx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_bytes), mp_obj_new_int_from_uint(d.tx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_us), mp_obj_new_int_from_uint(d.tx_last - d.tx_first));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_timing_obj, 0, 1, btm_timing);
+
+/*
+ * Connection given as the optional argument at pos, connection 0 when it
+ * is left out, which is the only one unless init() got conns > 1.
+ */
+static conn_obj_t *conn_arg(size_t n_args, const mp_obj_t *args, size_t pos) {
+    int id = (n_args > pos) ? mp_obj_get_int(args[pos]) : 0;
+    if (id < 0 || id >= n_conns) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad connection id"));
+    }
+    return &conn[id];
+}
+
+/*
+ * stats([reset[, id]]) -> dict of link counters, see stats_obj_t, for
+ * connection id, or the total over all of them when id is left out.
+ */
+STATIC mp_obj_t btm_stats(size_t n_args, const mp_obj_t *args) {
+    bool reset = n_args > 0 && mp_obj_is_true(args[0]);
+    int first = 0;
+    int last = n_conns - 1;
+    stats_obj_t s = { 0 };
+    if (n_args > 1) {
+       first = last = conn_arg(n_args, args, 1) - conn;
+    } else {
+       stats_add(&s, &stats_none);
+       if (reset) {
+          memset(&stats_none, 0, sizeof(stats_none));
+       }
+    }
+    uint32_t held = 0;
+    uint32_t resyncs = 0;
+    for (int i = first; i <= last; i++) {
+       conn_obj_t *c = &conn[i];
+       stats_add(&s, &c->stats);
+       s.tx_failed += c->txq.refused;
+       held += c->pipe.held;
+       resyncs += c->pipe.resyncs;
+       if (reset) {
+          memset(&c->stats, 0, sizeof(c->stats));
+          c->txq.refused = 0;
+          c->pipe.held = 0;
+          c->pipe.resyncs = 0;
+       }
+    }
+    mp_obj_t dict = mp_obj_new_dict(13);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_frames), mp_obj_new_int_from_uint(s.rx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_bytes), mp_obj_new_int_from_uint(s.rx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_dropped), mp_obj_new_int_from_uint(s.rx_dropped));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_held), mp_obj_new_int_from_uint(held));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_resync), mp_obj_new_int_from_uint(resyncs));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_frames), mp_obj_new_int_from_uint(s.tx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_bytes), mp_obj_new_int_from_uint(s.tx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_failed), mp_obj_new_int_from_uint(s.tx_failed));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cong_on), mp_obj_new_int_from_uint(s.cong_on));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cong_off), mp_obj_new_int_from_uint(s.cong_off));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_connects), mp_obj_new_int_from_uint(s.connects));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_disconnects), mp_obj_new_int_from_uint(s.disconnects));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_auth_failed), mp_obj_new_int_from_uint(s.auth_failed));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_stats_obj, 0, 2, btm_stats);
+
+/*
+ * occupancy([reset[, id]]) -> dict of connection id with size, peak,
+ * threshold (the flow high watermark), above_us and hist, a list of
+ * OCC_BINS sample counts.
+ */
+STATIC mp_obj_t btm_occupancy(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 1);
+    occ_data_t d;
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&c->occ.lock);
+    d = c->occ.d;
+    portEXIT_CRITICAL(&c->occ.lock);
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       occ_reset(&c->occ);
+    }
+    if (d.above) {
+       d.above_us += now - d.above_since; // still above
+    }
+    mp_obj_t hist[OCC_BINS];
+    for (int i = 0; i < OCC_BINS; i++) {
+       hist[i] = mp_obj_new_int_from_uint(d.hist[i]);
+    }
+    mp_obj_t dict = mp_obj_new_dict(5);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_size), mp_obj_new_int_from_uint(c->pipe.size));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_peak), mp_obj_new_int_from_uint(d.peak));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_threshold), mp_obj_new_int_from_uint(c->pipe.high));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_above_us), mp_obj_new_int_from_ull(d.above_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_hist), mp_obj_new_list(OCC_BINS, hist));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_occupancy_obj, 0, 2, btm_occupancy);
+
+#if BT_SPP_TRACE >= 1
+/*
+ * trace([reset]) -> bytes, the trace records kept, oldest first. Decode
+ * them with tools/bt_spp_trace.py.
+ */
+STATIC mp_obj_t btm_trace(size_t n_args, const mp_obj_t *args) {
+    vstr_t vstr;
+    vstr_init_len(&vstr, sizeof(trace->rec));
+    trace_rec_t *out = (trace_rec_t *) vstr.buf;
+    portENTER_CRITICAL(&trace->lock);
+    uint32_t count = trace->count;
+    uint32_t first = (count > TRACE_LEN) ? count - TRACE_LEN : 0;
+    for (uint32_t i = first; i != count; i++) {
+       out[i - first] = trace->rec[i % TRACE_LEN];
+    }
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       trace->count = 0;
+    }
+    portEXIT_CRITICAL(&trace->lock);
+    vstr.len = (count - first) * sizeof(trace_rec_t);
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_trace_obj, 0, 1, btm_trace);
+#endif
+
+STATIC mp_obj_t btm_data(size_t n_args, const mp_obj_t *args) {
+    return mp_obj_new_int(pipe_count(&conn_arg(n_args, args, 0)->pipe));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_data_obj, 0, 1, btm_data);
+
+static mp_obj_t btm_get(size_t n_args, const mp_obj_t *args, const mp_obj_type_t *type) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    int count = mp_obj_get_int(args[0]);
+    int avail = pipe_count(p);
+    if (count > avail) {
+       count = avail;
+    }
+    if (count > 0) {
+       // read straight into the new object, no copy on the stack
+       vstr_t vstr;
+       vstr_init_len(&vstr, count);
+       vstr.len = pipe_get(p, (uint8_t *) vstr.buf, count);
+       return mp_obj_new_str_from_vstr(type, &vstr);
+    }
+    return mp_const_none; // count<=0 or empty pipe
+}
+
+STATIC mp_obj_t btm_get_str(size_t n_args, const mp_obj_t *args) {
+    return btm_get(n_args, args, &mp_type_str);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_get_str_obj, 1, 2, btm_get_str);
+
+STATIC mp_obj_t btm_get_bin(size_t n_args, const mp_obj_t *args) {
+    return btm_get(n_args, args, &mp_type_bytes);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_get_bin_obj, 1, 2, btm_get_bin);
+
+STATIC mp_obj_t btm_readinto(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 2)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_WRITE);
+    int count = bufinfo.len;
+    if (n_args > 1) {
+       int n = mp_obj_get_int(args[1]);
+       if (n < count) {
+          count = n;
+       }
+    }
+    if (count <= 0) {
+       return MP_OBJ_NEW_SMALL_INT(0);
+    }
+    // no allocation, the caller's buffer is filled from the pipe
+    return mp_obj_new_int(pipe_get(p, bufinfo.buf, count));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_readinto_obj, 1, 3, btm_readinto);
+
+/* one complete message as bytes, None if no message is complete yet */
+STATIC mp_obj_t btm_get_msg(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 0)->pipe;
+    if (p->framing == FRAME_NONE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("no framing"));
+    }
+    while (atomic_load_explicit(&p->msgs, memory_order_acquire) != atomic_load(&p->msgs_read)) {
+       vstr_t vstr;
+       atomic_fetch_add(&p->msgs_read, 1);
+       if (p->framing == FRAME_LEN) {
+          uint8_t hdr[2];
+          pipe_get(p, hdr, 2);
+          vstr_init_len(&vstr, (hdr[0] << 8) | hdr[1]);
+          pipe_get(p, (uint8_t *) vstr.buf, vstr.len);
+       } else {
+          static const uint8_t delim = 0;
+          int len = pipe_find(p, &delim, 1) + 1; // with the delimiter
+          vstr_init_len(&vstr, len);
+          pipe_get(p, (uint8_t *) vstr.buf, len);
+          len = cobs_decode((uint8_t *) vstr.buf, len - 1);
+          if (len < 0) {
+             vstr_clear(&vstr); // corrupted on the way in, skip it
+             continue;
+          }
+          vstr.len = len;
+       }
+       if (pipe_drains(p) == false) {
+          pipe_wake(p); // a frame held back for room waits for nothing now
+       }
+       return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+    }
+    if (p->size > 0 && pipe_count(p) == p->size) {
+       // full and no whole message: it can never fit, esp_spp_cb drops it
+       atomic_store(&p->resync, true);
+       pipe_wake(p);
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_get_msg_obj, 0, 1, btm_get_msg);
+
+/*
+ * Everything up to and including delim as an object of the given type,
+ * None while delim has not arrived. A full pipe without delim is handed
+ * over as it is, otherwise nothing more could ever come in.
+ */
+static mp_obj_t btm_take_until(pipe_obj_t *p, const uint8_t *delim, int dlen, const mp_obj_type_t *type) {
+    if (dlen <= 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("empty delimiter"));
+    }
+    int len = pipe_find(p, delim, dlen);
+    if (len >= 0) {
+       len += dlen;
+    } else if (p->size > 0 && pipe_count(p) == p->size) {
+       len = p->size;
+    } else {
+       return mp_const_none;
+    }
+    vstr_t vstr;
+    vstr_init_len(&vstr, len);
+    pipe_get(p, (uint8_t *) vstr.buf, len);
+    return mp_obj_new_str_from_vstr(type, &vstr);
+}
+
+/* one line as str, ending with a newline, None until a whole line is in */
+STATIC mp_obj_t btm_readline(size_t n_args, const mp_obj_t *args) {
+    return btm_take_until(&conn_arg(n_args, args, 0)->pipe, (const uint8_t *) "\n", 1, &mp_type_str);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_readline_obj, 0, 1, btm_readline);
+
+/* read_until(delim[, id]) -> str if delim is a str, else bytes */
+STATIC mp_obj_t btm_read_until(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    return btm_take_until(p, bufinfo.buf, bufinfo.len, mp_obj_is_str(args[0]) ? &mp_type_str : &mp_type_bytes);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_read_until_obj, 1, 2, btm_read_until);
+
+/* find(delim[, id]) -> offset of delim in the buffer or -1, nothing is read */
+STATIC mp_obj_t btm_find(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    if (bufinfo.len == 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("empty delimiter"));
+    }
+    return mp_obj_new_int(pipe_find(p, bufinfo.buf, bufinfo.len));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_find_obj, 1, 2, btm_find);
+
+
+/*
+ * Queue len bytes as MTU sized frames on the n connections in cs, copying
+ * each frame once however many connections it goes to. Each wait for a
+ * free slot is bounded by timeout_ms. Returns the number of bytes queued.
+ */
+static size_t btm_write_to(conn_obj_t **cs, int n, const uint8_t *data, size_t len, int timeout_ms)
+{
+    size_t queued = 0;
+    while (queued < len) {
+       int m = 0;
+       for (int i = 0; i < n; i++) {
+          if (cs[i]->ready == true) {
+             cs[m++] = cs[i]; // drop the ones that closed on the way
+          }
+       }
+       n = m;
+       if (n == 0) {
+          break;
+       }
+       int count = len - queued;
+       if (count > SPP_DATA_LEN) {
+          count = SPP_DATA_LEN;
+       }
+       if (txq_wait(cs, n, timeout_ms) == false || txq_put(cs, n, data + queued, count) == false) {
+          break;
+       }
+       txq_kick(); // start sending while the rest is cut up
+       queued += count;
+    }
+    return queued;
+}
+
+static size_t btm_write(conn_obj_t *c, const uint8_t *data, size_t len, int timeout_ms)
+{
+    return btm_write_to(&c, 1, data, len, timeout_ms);
+}
+
+/*
+ * send_str/send_bin(data[, timeout_ms[, id]]) -> number of bytes queued
+ *
+ * When a wait for a free slot runs out the bytes queued so far are
+ * returned, OSError is raised only if nothing could be queued.
+ */
+STATIC mp_obj_t btm_send(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 2);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    int timeout_ms = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    if (c->ready == false) {
+       return mp_const_none;
+    }
+    size_t queued = btm_write(c, bufinfo.buf, bufinfo.len, timeout_ms);
+    if (queued == 0 && bufinfo.len > 0) {
+       mp_raise_OSError(timeout_ms > 0 ? MP_ETIMEDOUT : MP_ENOBUFS);
+    }
+    return mp_obj_new_int(queued);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_send_str_obj, 1, 3, btm_send);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_send_bin_obj, 1, 3, btm_send);
+
+/*
+ * send_msg(data[, timeout_ms[, id]]) frames data as set at init() and
+ * queues it. A message is queued whole or not at all when there is no
+ * timeout; if a timeout runs out half way OSError ETIMEDOUT is raised, and
+ * the receiver only gets back in step at the next COBS delimiter.
+ */
+STATIC mp_obj_t btm_send_msg(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 2);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    int timeout_ms = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    if (c->pipe.framing == FRAME_NONE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("no framing"));
+    }
+    if (c->ready == false) {
+       return mp_const_none;
+    }
+    vstr_t vstr;
+    if (c->pipe.framing == FRAME_LEN) {
+       if (bufinfo.len > FRAME_MAX_LEN) {
+          mp_raise_ValueError(MP_ERROR_TEXT("message too long"));
+       }
+       vstr_init_len(&vstr, bufinfo.len + 2);
+       vstr.buf[0] = bufinfo.len >> 8;
+       vstr.buf[1] = bufinfo.len & 0xFF;
+       memcpy(vstr.buf + 2, bufinfo.buf, bufinfo.len);
+    } else {
+       vstr_init_len(&vstr, bufinfo.len + bufinfo.len / 254 + 2);
+       vstr.len = cobs_encode(bufinfo.buf, bufinfo.len, (uint8_t *) vstr.buf);
+    }
+    if (vstr.len > c->pipe.size) {
+       // the peer drops a message bigger than its rxbuf, both ends use the same
+       vstr_clear(&vstr);
+       mp_raise_ValueError(MP_ERROR_TEXT("message too long for rxbuf"));
+    }
+    if (timeout_ms <= 0 && txq_room(&c->txq) < (vstr.len + SPP_DATA_LEN - 1) / SPP_DATA_LEN) {
+       vstr_clear(&vstr);
+       mp_raise_OSError(MP_ENOBUFS);
+    }
+    size_t queued = btm_write(c, (uint8_t *) vstr.buf, vstr.len, timeout_ms);
+    size_t framed = vstr.len;
+    vstr_clear(&vstr);
+    if (queued < framed) {
+       mp_raise_OSError(MP_ETIMEDOUT);
+    }
+    return mp_obj_new_int(bufinfo.len);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_send_msg_obj, 1, 3, btm_send_msg);
+
+/*
+ * broadcast(data[, timeout_ms]) -> number of bytes queued to every open
+ * connection, None if there is none. Each frame is copied once and shared
+ * by all queues, so a slow slave holds up the others once its queue is
+ * full; give a timeout to wait for it as for send_bin().
+ */
+STATIC mp_obj_t btm_broadcast(size_t n_args, const mp_obj_t *args) {
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    int timeout_ms = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    conn_obj_t *cs[MAX_CONNS];
+    int n = 0;
+    for (int i = 0; i < n_conns; i++) {
+       if (conn[i].ready == true) {
+          cs[n++] = &conn[i];
+       }
+    }
+    if (n == 0) {
+       return mp_const_none;
+    }
+    size_t queued = btm_write_to(cs, n, bufinfo.buf, bufinfo.len, timeout_ms);
+    if (queued == 0 && bufinfo.len > 0) {
+       mp_raise_OSError(timeout_ms > 0 ? MP_ETIMEDOUT : MP_ENOBUFS);
+    }
+    return mp_obj_new_int(queued);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_broadcast_obj, 1, 2, btm_broadcast);
+
+/*
+ * open(name, pin[, timeout_ms]) -> connection id. Connects in the
+ * background, ready(id) turns True once it is connected. One open() runs
+ * at a time.
+ *
+ * With timeout_ms, waits with the GIL released until it has connected, or
+ * raises OSError with why not: ENOENT the inquiry did not find the name,
+ * EHOSTUNREACH the SDP search failed, EACCES authentication failed,
+ * ECONNABORTED the RFCOMM connect failed, ETIMEDOUT it took longer and
+ * was given up, EIO the stack turned the inquiry, SDP search or connect
+ * down. EIO is raised with or without timeout_ms.
+ *
+ * name is the slave's name, or its address as "aa:bb:cc:dd:ee:ff" or 6
+ * bytes. An address skips the inquiry, as does a name in the results of
+ * a recent scan(). A slave in the SCN cache, by name or address, is
+ * connected to straight away without the SDP search.
+ */
+STATIC mp_obj_t btm_open(size_t n_args, const mp_obj_t *args) {
+    mp_obj_t name = args[0];
+    const char *sp = mp_obj_str_get_str(args[1]);
+    int timeout_ms = (n_args > 2) ? mp_obj_get_int(args[2]) : 0;
+    if (opening >= 0 || scan->running) {
+       mp_raise_OSError(MP_EALREADY);
+    }
+    int id = 0;
+    while (id < n_conns && (conn[id].handle != 0 || conn[id].rc_state != RC_OFF)) {
+       id++;
+    }
+    if (id == n_conns) {
+       mp_raise_OSError(MP_EBUSY); // all connections in use
+    }
+    xEventGroupClearBits(setup->done, SETUP_DONE);
+    if (open_claim(id) == false) {
+       mp_raise_OSError(MP_EALREADY); // a reconnect got in first
+    }
+    uint8_t scn = 0;
+    bool by_addr = addr_parse(name, master->slave_addr);
+    if (by_addr) {
+       master->slave_name_len = 0;
+       scn_lookup(NULL, 0, master->slave_addr, &scn);
+    } else {
+       const char *sn = mp_obj_str_get_str(name);
+       memcpy(master->slave_name, sn, strlen(sn));     // slave name
+       master->slave_name_len = strlen(sn);            // slave name length
+       if (scn_lookup(sn, strlen(sn), master->slave_addr, &scn) || scan_lookup(scan, sn, master->slave_addr)) {
+          by_addr = true;
+       }
+    }
+    memcpy(master->slave_pin_code, sp, strlen(sp)); // binding PIN
+    master->slave_found = by_addr;
+    if (open_start(scn, by_addr) != ESP_OK) {
+       open_end(MP_EIO); // opening is free for the next open()
+       mp_raise_OSError(MP_EIO);
+    }
+    if (timeout_ms <= 0) {
+       return MP_OBJ_NEW_SMALL_INT(id);
+    }
+    MP_THREAD_GIL_EXIT();
+    EventBits_t bits = xEventGroupWaitBits(setup->done, SETUP_DONE, pdTRUE, pdFALSE, pdMS_TO_TICKS(timeout_ms));
+    MP_THREAD_GIL_ENTER();
+    if ((bits & SETUP_DONE) == 0 && opening == id) {
+       esp_bt_gap_cancel_discovery(); // an ESP_SPP_OPEN_EVT after this is disconnected
+       open_end(MP_ETIMEDOUT);
+    }
+    if (conn[id].ready == false) {
+       mp_raise_OSError(setup->tried.err != 0 ? setup->tried.err : MP_ECONNABORTED);
+    }
+    return MP_OBJ_NEW_SMALL_INT(id);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_open_obj, 2, 3, btm_open);
+
+/*
+ * connect_time([any]) -> dict of the last open() that connected, or with
+ * any=True of the last one whether it did or not. us is open() to the
+ * end, 0 if there was none, path how it went: 'inquiry', 'sdp' or
+ * 'cache', error the errno it failed with, 0 if it connected. The phases,
+ * 0 for those it did not go through: inquiry_us till the name matched
+ * after checking seen names, sdp_us the SDP search, auth_us paging the
+ * slave to authenticated, rfcomm_us from there to ESP_SPP_OPEN_EVT,
+ * page_us the two together. pin is True if the slave was not bonded and
+ * the PIN was asked for.
+ */
+STATIC mp_obj_t btm_connect_time(size_t n_args, const mp_obj_t *args) {
+    static const qstr paths[] = { MP_QSTR_inquiry, MP_QSTR_sdp, MP_QSTR_cache };
+    setup_rec_t r = (n_args > 0 && mp_obj_is_true(args[0])) ? setup->tried : setup->last;
+    mp_obj_t dict = mp_obj_new_dict(10);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_us), mp_obj_new_int_from_uint(r.us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_path), MP_OBJ_NEW_QSTR(paths[r.path]));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_error), MP_OBJ_NEW_SMALL_INT(r.err));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_inquiry_us), mp_obj_new_int_from_uint(r.inquiry_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_seen), MP_OBJ_NEW_SMALL_INT(r.seen));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_sdp_us), mp_obj_new_int_from_uint(r.sdp_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_auth_us), mp_obj_new_int_from_uint(r.auth_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rfcomm_us), mp_obj_new_int_from_uint(r.rfcomm_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_page_us), mp_obj_new_int_from_uint(r.page_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_pin), mp_obj_new_bool(r.pin));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_connect_time_obj, 0, 1, btm_connect_time);
+
+/*
+ * cache([clear]) -> list of (name, address, scn) of the slaves in the SCN
+ * cache, newest first. cache(True) empties it, also in NVS.
+ */
+STATIC mp_obj_t btm_cache(size_t n_args, const mp_obj_t *args) {
+    scn_entry_t copy[SCN_CACHE_LEN];
+    portENTER_CRITICAL(&scn_lock);
+    memcpy(copy, scn_cache, sizeof(copy));
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       memset(scn_cache, 0, sizeof(scn_cache));
+    }
+    portEXIT_CRITICAL(&scn_lock);
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       scn_save();
+    }
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < SCN_CACHE_LEN && copy[i].scn != 0; i++) {
+       mp_obj_t t[3] = {
+          mp_obj_new_str(copy[i].name, strlen(copy[i].name)),
+          addr_str(copy[i].addr),
+          MP_OBJ_NEW_SMALL_INT(copy[i].scn),
+       };
+       mp_obj_list_append(list, mp_obj_new_tuple(3, t));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_cache_obj, 0, 1, btm_cache);
+
+/*
+ * scan(duration_ms, name_prefix=None, min_rssi=None, max_results=None, ttl_ms=60000)
+ *
+ * Start an inquiry and return at once. Devices that pass the filter go
+ * into the results as they are found, and the inquiry stops early once
+ * max_results have been found. Returns False, with no inquiry, when the
+ * results younger than ttl_ms already hold max_results that pass the
+ * filter. Not while an open() is looking for its slave.
+ */
+STATIC mp_obj_t btm_scan(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_duration_ms, ARG_name_prefix, ARG_min_rssi, ARG_max_results, ARG_ttl_ms };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_duration_ms, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+        { MP_QSTR_name_prefix, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_min_rssi, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_max_results, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_ttl_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 60000} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    if (master_up == false) {
+       mp_raise_OSError(MP_ENODEV);
+    }
+    // the inquiry runs in units of 1.28 s, from 1 to 48
+    int len = (args[ARG_duration_ms].u_int + 1279) / 1280;
+    if (len < 1 || len > 0x30) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad duration"));
+    }
+    const char *prefix = "";
+    if (args[ARG_name_prefix].u_obj != mp_const_none) {
+       prefix = mp_obj_str_get_str(args[ARG_name_prefix].u_obj);
+       if (strlen(prefix) > SCN_NAME_LEN) {
+          mp_raise_ValueError(MP_ERROR_TEXT("name_prefix too long"));
+       }
+    }
+    int min_rssi = SCAN_NO_RSSI;
+    if (args[ARG_min_rssi].u_obj != mp_const_none) {
+       min_rssi = mp_obj_get_int(args[ARG_min_rssi].u_obj);
+    }
+    int max_results = 0;
+    if (args[ARG_max_results].u_obj != mp_const_none) {
+       max_results = mp_obj_get_int(args[ARG_max_results].u_obj);
+       if (max_results < 1) {
+          mp_raise_ValueError(MP_ERROR_TEXT("bad max_results"));
+       }
+    }
+    // under rc->lock, as open_claim() and rc_tick() look at scan->running
+    portENTER_CRITICAL(&rc->lock);
+    bool busy = scan->running || (opening >= 0 && setup->path != OPEN_CACHED);
+    bool cached = false;
+    if (busy == false) {
+       portENTER_CRITICAL(&scan->lock);
+       strcpy(scan->prefix, prefix);
+       scan->min_rssi = min_rssi;
+       scan->max_results = max_results;
+       scan->ttl_ms = args[ARG_ttl_ms].u_int;
+       scan->found = 0;
+       cached = max_results > 0 && scan_fresh(scan) >= max_results;
+       scan->running = !cached;
+       portEXIT_CRITICAL(&scan->lock);
+    }
+    portEXIT_CRITICAL(&rc->lock);
+    if (busy) {
+       mp_raise_OSError(MP_EALREADY);
+    }
+    if (cached) {
+       return mp_const_false;
+    }
+    if (esp_bt_gap_start_discovery(inq_mode, len, inq_num_rsps) != ESP_OK) {
+       scan->running = false;
+       rc_arm(); // attempts wait for the scan
+       mp_raise_OSError(MP_EIO);
+    }
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(btm_scan_obj, 1, btm_scan);
+
+/*
+ * scan_results() -> list of (address, name, rssi, cod) of the devices in
+ * the results that pass the filter of the last scan() and are younger
+ * than its ttl_ms, the strongest first. rssi is None if unknown.
+ */
+STATIC mp_obj_t btm_scan_results() {
+    scan_entry_t e[SCAN_LEN];
+    int n = 0;
+    portENTER_CRITICAL(&scan->lock);
+    scan_fresh(scan);
+    for (int i = 0; i < SCAN_LEN; i++) {
+       if (scan->e[i].used && scan_match(scan, scan->e[i].name, scan->e[i].rssi)) {
+          e[n++] = scan->e[i];
+       }
+    }
+    portEXIT_CRITICAL(&scan->lock);
+    for (int i = 1; i < n; i++) { // a few entries, insertion sort on rssi
+       scan_entry_t t = e[i];
+       int j = i;
+       while (j > 0 && e[j - 1].rssi < t.rssi) {
+          e[j] = e[j - 1];
+          j--;
+       }
+       e[j] = t;
+    }
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < n; i++) {
+       mp_obj_t t[4] = {
+          addr_str(e[i].addr),
+          mp_obj_new_str(e[i].name, strlen(e[i].name)),
+          e[i].rssi == SCAN_NO_RSSI ? mp_const_none : MP_OBJ_NEW_SMALL_INT(e[i].rssi),
+          mp_obj_new_int_from_uint(e[i].cod),
+       };
+       mp_obj_list_append(list, mp_obj_new_tuple(4, t));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_scan_results_obj, btm_scan_results);
+
+STATIC mp_obj_t btm_scanning() {
+    return mp_obj_new_bool(scan->running);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_scanning_obj, btm_scanning);
+
+/*
+ * reconnect(on=True, base_ms=250, max_ms=16000, tries=3)
+ *
+ * With on, a slave whose link drops without close() is reconnected to in
+ * the same slot: paged at once, then again after a backoff that doubles
+ * from base_ms up to max_ms, with jitter. After tries failed pages it is
+ * looked for by name with an inquiry, if it was opened by name. ready(id)
+ * is False meanwhile and close(id) gives up. deinit() turns it off.
+ */
+STATIC mp_obj_t btm_reconnect(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_on, ARG_base_ms, ARG_max_ms, ARG_tries };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_on, MP_ARG_BOOL, {.u_bool = true} },
+        { MP_QSTR_base_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 250} },
+        { MP_QSTR_max_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 16000} },
+        { MP_QSTR_tries, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 3} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    if (master_up == false) {
+       mp_raise_OSError(MP_ENODEV);
+    }
+    if (args[ARG_on].u_bool == false) {
+       rc_stop();
+       return mp_const_none;
+    }
+    int base_ms = args[ARG_base_ms].u_int;
+    int max_ms = args[ARG_max_ms].u_int;
+    if (base_ms < 1 || max_ms < base_ms) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad backoff"));
+    }
+    if (args[ARG_tries].u_int < 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad tries"));
+    }
+    if (rc->timer == NULL) {
+       rc->timer = xTimerCreate("btm_rc", 1, pdFALSE, NULL, rc_tick);
+       if (rc->timer == NULL) {
+          mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for timer"));
+       }
+    }
+    rc->base_ms = base_ms;
+    rc->max_ms = max_ms;
+    rc->tries = args[ARG_tries].u_int;
+    rc->on = true;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(btm_reconnect_obj, 0, btm_reconnect);
+
+/*
+ * link_state([id]) -> 'connected', 'opening' (open() in progress),
+ * 'reconnecting' (an attempt in progress), 'backoff' (waiting for the
+ * next attempt) or 'closed'.
+ */
+STATIC mp_obj_t btm_link_state(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 0);
+    qstr state = MP_QSTR_closed;
+    if (c->ready == true) {
+       state = MP_QSTR_connected;
+    } else if (c->rc_state == RC_TRY) {
+       state = MP_QSTR_reconnecting;
+    } else if (c->rc_state == RC_WAIT) {
+       state = MP_QSTR_backoff;
+    } else if (opening == c - conn) {
+       state = MP_QSTR_opening;
+    }
+    return MP_OBJ_NEW_QSTR(state);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_link_state_obj, 0, 1, btm_link_state);
+
+/*
+ * reconnects() -> dict with count, links brought back since init(),
+ * attempts, pages and inquiries made for them, and us, a list of how long
+ * the last few took from the drop to connected again, oldest first.
+ */
+STATIC mp_obj_t btm_reconnects() {
+    uint32_t count = rc->count;
+    uint32_t n = (count < RC_HIST) ? count : RC_HIST;
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (uint32_t i = count - n; i < count; i++) {
+       mp_obj_list_append(list, mp_obj_new_int_from_uint(rc->hist[i % RC_HIST]));
+    }
+    mp_obj_t dict = mp_obj_new_dict(3);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_count), mp_obj_new_int_from_uint(count));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_attempts), mp_obj_new_int_from_uint(rc->attempts));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_us), list);
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_reconnects_obj, btm_reconnects);
+
+/*
+ * The handle is let go of at ESP_SPP_CLOSE_EVT, the slot stays taken till
+ * then. An open() or a reconnect still in progress on the slot is given up.
+ */
+static void btm_close_conn(conn_obj_t *c) {
+    portENTER_CRITICAL(&rc->lock);
+    c->rc_state = RC_OFF;
+    portEXIT_CRITICAL(&rc->lock);
+    if (c->ready == true) {
+       esp_spp_disconnect(c->handle);
+       c->ready = false;
+    } else if (opening == c - conn) {
+       esp_bt_gap_cancel_discovery();
+       open_end(MP_ECANCELED);
+    }
+}
+
+STATIC mp_obj_t btm_close(size_t n_args, const mp_obj_t *args) {
+    btm_close_conn(conn_arg(n_args, args, 0));
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_close_obj, 0, 1, btm_close);
+
+STATIC mp_obj_t btm_ready(size_t n_args, const mp_obj_t *args) {
+     return mp_obj_new_bool(conn_arg(n_args, args, 0)->ready);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_ready_obj, 0, 1, btm_ready);
+
+/* conns() -> list of the ids of the connections that are open */
+STATIC mp_obj_t btm_conns() {
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < n_conns; i++) {
+       if (conn[i].ready == true) {
+          mp_obj_list_append(list, MP_OBJ_NEW_SMALL_INT(i));
+       }
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_conns_obj, btm_conns);
+
+STATIC mp_obj_t btm_up(){
+     return mp_obj_new_bool(master_up);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_up_obj, btm_up);
+
+/*
+ * deinit([warm]) takes SPP and Bluetooth down. With warm=True the
+ * controller and Bluedroid stay up and only SPP stops, the device is no
+ * longer connectable or discoverable, and the next init() only restarts
+ * SPP. deinit() after that takes the rest down.
+ */
+STATIC mp_obj_t btm_deinit(size_t n_args, const mp_obj_t *args){
+    bool warm = n_args > 0 && mp_obj_is_true(args[0]);
+    if (master_up == false) {
+       if (warm || stack_is_down()) {
+          return mp_const_false;
+       }
+       stack_down(); // left up by deinit(True)
+       return mp_const_true;
+    }
+    for (int i = 0; i < n_conns; i++) {
+       conn[i].pipe.flow = false; // a callback held back in flow mode must not stall the teardown
+       pipe_wake(&conn[i].pipe);
+    }
+    irq_off(irq);
+    rc_stop(); // before esp_spp_deinit, its ESP_SPP_CLOSE_EVTs must not reconnect
+    MP_STATE_PORT(btm_irq_handler) = mp_const_none;
+    xSemaphoreTake(spp_down, 0); // not a give left from before
+    if (esp_spp_deinit() == ESP_OK) {
+       MP_THREAD_GIL_EXIT();
+       xSemaphoreTake(spp_down, pdMS_TO_TICKS(SPP_DOWN_MS));
+       MP_THREAD_GIL_ENTER();
+    }
+    if (warm) {
+       esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+    } else {
+       stack_down();
+    }
+    conns_free(); // no more callbacks, safe to let go of the buffers
+    opening = -1;
+    scan->running = false;
+    master_up = false;  // can do init
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_deinit_obj, 0, 1, btm_deinit);
+
+/*
+ * init_time() -> dict of how long each stage of the last init() took, in
+ * us: nvs_us, controller_us, bluedroid_us, spp_us and start_us (name, scan
+ * mode). warm is True if Bluedroid was up already, from deinit(True) or
+ * from bts, then only spp_us and start_us count.
+ */
+STATIC mp_obj_t btm_init_time() {
+    static const qstr keys[INIT_STAGES] = {
+        MP_QSTR_nvs_us, MP_QSTR_controller_us, MP_QSTR_bluedroid_us, MP_QSTR_spp_us, MP_QSTR_start_us,
+    };
+    mp_obj_t dict = mp_obj_new_dict(INIT_STAGES + 1);
+    for (int i = 0; i < INIT_STAGES; i++) {
+       mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(keys[i]), mp_obj_new_int_from_uint(init_time->us[i]));
+    }
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_warm), mp_obj_new_bool(init_time->warm));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_init_time_obj, btm_init_time);
+
+/*
+ * btm.stream([id]) hands out a connection as a stream object, so it can be
+ * given to uselect.poll, os.dupterm and the stream methods. It is a view
+ * on the connection's pipe and transmit queue, there is one per
+ * connection. Nothing blocks: an empty pipe reads as EAGAIN (None from
+ * read()), or as EOF once the connection is gone, and a full transmit
+ * queue writes as EAGAIN.
+ */
+typedef struct _btm_stream_obj_t {
+    mp_obj_base_t base;
+    int id;
+} btm_stream_obj_t;
+
+STATIC const mp_obj_type_t btm_stream_type;
+STATIC const btm_stream_obj_t btm_stream_obj[MAX_CONNS] = {
+    { { &btm_stream_type }, 0 },
+    { { &btm_stream_type }, 1 },
+    { { &btm_stream_type }, 2 },
+    { { &btm_stream_type }, 3 },
+};
+
+STATIC mp_uint_t btm_stream_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode) {
+    btm_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (master_up == false || self->id >= n_conns) {
+       *errcode = MP_ENODEV;
+       return MP_STREAM_ERROR;
+    }
+    conn_obj_t *c = &conn[self->id];
+    int count = pipe_get(&c->pipe, buf, size);
+    if (count == 0 && size > 0 && c->ready == true) {
+       *errcode = MP_EAGAIN;
+       return MP_STREAM_ERROR;
+    }
+    return count; // 0 with no connection is EOF
+}
+
+STATIC mp_uint_t btm_stream_write(mp_obj_t self_in, const void *buf, mp_uint_t size, int *errcode) {
+    btm_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (master_up == false || self->id >= n_conns || conn[self->id].ready == false) {
+       *errcode = MP_ENOTCONN;
+       return MP_STREAM_ERROR;
+    }
+    size_t queued = btm_write(&conn[self->id], buf, size, 0);
+    if (queued == 0 && size > 0) {
+       *errcode = MP_EAGAIN;
+       return MP_STREAM_ERROR;
+    }
+    return queued;
+}
+
+STATIC mp_uint_t btm_stream_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    btm_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (request == MP_STREAM_POLL) {
+       if (master_up == false || self->id >= n_conns) {
+          return MP_STREAM_POLL_NVAL;
+       }
+       conn_obj_t *c = &conn[self->id];
+       mp_uint_t ret = 0;
+       if ((arg & MP_STREAM_POLL_RD) && pipe_count(&c->pipe) > 0) {
+          ret |= MP_STREAM_POLL_RD;
+       }
+       if ((arg & MP_STREAM_POLL_WR) && c->ready == true && txq_room(&c->txq) > 0) {
+          ret |= MP_STREAM_POLL_WR;
+       }
+       return ret;
+    } else if (request == MP_STREAM_CLOSE) {
+       if (master_up == true && self->id < n_conns) {
+          btm_close_conn(&conn[self->id]);
+       }
+       return 0;
+    } else if (request == MP_STREAM_FLUSH) {
+       return 0; // queued frames go out from esp_spp_cb on their own
+    }
+    *errcode = MP_EINVAL;
+    return MP_STREAM_ERROR;
+}
+
+STATIC const mp_stream_p_t btm_stream_p = {
+    .read = btm_stream_read,
+    .write = btm_stream_write,
+    .ioctl = btm_stream_ioctl,
+    .is_text = false,
+};
+
+STATIC const mp_rom_map_elem_t btm_stream_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&mp_stream_unbuffered_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mp_stream_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
+    { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&mp_stream___exit___obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(btm_stream_locals_dict, btm_stream_locals_dict_table);
+
+STATIC MP_DEFINE_CONST_OBJ_TYPE(
+    btm_stream_type,
+    MP_QSTR_btm_stream,
+    MP_TYPE_FLAG_ITER_IS_STREAM,
+    protocol, &btm_stream_p,
+    locals_dict, &btm_stream_locals_dict
+    );
+
+STATIC mp_obj_t btm_stream(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 0);
+    return MP_OBJ_FROM_PTR(&btm_stream_obj[c - conn]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_stream_fun_obj, 0, 1, btm_stream);
+
+/* bonds() -> list of the addresses of the bonded peers, most recently used first */
+STATIC mp_obj_t btm_bonds() {
+    esp_bd_addr_t addr[BOND_MAX + 1];
+    portENTER_CRITICAL(&bond->lock);
+    int count = bond->count;
+    memcpy(addr, bond->addr, sizeof(addr));
+    portEXIT_CRITICAL(&bond->lock);
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < count; i++) {
+       mp_obj_list_append(list, addr_str(addr[i]));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(btm_bonds_obj, btm_bonds);
+
+/* unbond([addr]) forgets the link key of one peer, or of all of them */
+STATIC mp_obj_t btm_unbond(size_t n_args, const mp_obj_t *args) {
+    if (master_up == false) {
+       mp_raise_OSError(MP_ENODEV);
+    }
+    if (n_args == 0 || args[0] == mp_const_none) {
+       bond_remove(bond, NULL);
+       return mp_const_none;
+    }
+    esp_bd_addr_t addr;
+    if (addr_parse(args[0], addr) == false) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad address"));
+    }
+    bond_remove(bond, addr);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(btm_unbond_obj, 0, 1, btm_unbond);
+
+STATIC const mp_rom_map_elem_t btm_module_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_btm) },
+    { MP_ROM_QSTR(MP_QSTR_init), MP_ROM_PTR(&btm_init_obj) },
+    { MP_ROM_QSTR(MP_QSTR_up), MP_ROM_PTR(&btm_up_obj) },
+    { MP_ROM_QSTR(MP_QSTR_data), MP_ROM_PTR(&btm_data_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_str), MP_ROM_PTR(&btm_get_str_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_bin), MP_ROM_PTR(&btm_get_bin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&btm_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_msg), MP_ROM_PTR(&btm_get_msg_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&btm_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read_until), MP_ROM_PTR(&btm_read_until_obj) },
+    { MP_ROM_QSTR(MP_QSTR_find), MP_ROM_PTR(&btm_find_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_str), MP_ROM_PTR(&btm_send_str_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_bin), MP_ROM_PTR(&btm_send_bin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_msg), MP_ROM_PTR(&btm_send_msg_obj) },
+    { MP_ROM_QSTR(MP_QSTR_broadcast), MP_ROM_PTR(&btm_broadcast_obj) },
+    { MP_ROM_QSTR(MP_QSTR_open), MP_ROM_PTR(&btm_open_obj) },
+    { MP_ROM_QSTR(MP_QSTR_connect_time), MP_ROM_PTR(&btm_connect_time_obj) },
+    { MP_ROM_QSTR(MP_QSTR_cache), MP_ROM_PTR(&btm_cache_obj) },
+    { MP_ROM_QSTR(MP_QSTR_scan), MP_ROM_PTR(&btm_scan_obj) },
+    { MP_ROM_QSTR(MP_QSTR_scan_results), MP_ROM_PTR(&btm_scan_results_obj) },
+    { MP_ROM_QSTR(MP_QSTR_scanning), MP_ROM_PTR(&btm_scanning_obj) },
+    { MP_ROM_QSTR(MP_QSTR_reconnect), MP_ROM_PTR(&btm_reconnect_obj) },
+    { MP_ROM_QSTR(MP_QSTR_link_state), MP_ROM_PTR(&btm_link_state_obj) },
+    { MP_ROM_QSTR(MP_QSTR_reconnects), MP_ROM_PTR(&btm_reconnects_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ready), MP_ROM_PTR(&btm_ready_obj) },
+    { MP_ROM_QSTR(MP_QSTR_conns), MP_ROM_PTR(&btm_conns_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&btm_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR_deinit), MP_ROM_PTR(&btm_deinit_obj) },
+    { MP_ROM_QSTR(MP_QSTR_init_time), MP_ROM_PTR(&btm_init_time_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stream), MP_ROM_PTR(&btm_stream_fun_obj) },
+    { MP_ROM_QSTR(MP_QSTR_irq), MP_ROM_PTR(&btm_irq_obj) },
+    { MP_ROM_QSTR(MP_QSTR_timing), MP_ROM_PTR(&btm_timing_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&btm_stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_bonds), MP_ROM_PTR(&btm_bonds_obj) },
+    { MP_ROM_QSTR(MP_QSTR_unbond), MP_ROM_PTR(&btm_unbond_obj) },
+    { MP_ROM_QSTR(MP_QSTR_occupancy), MP_ROM_PTR(&btm_occupancy_obj) },
+#if BT_SPP_TRACE >= 1
+    { MP_ROM_QSTR(MP_QSTR_trace), MP_ROM_PTR(&btm_trace_obj) },
+#endif
+    { MP_ROM_QSTR(MP_QSTR_FRAME_NONE), MP_ROM_INT(FRAME_NONE) },
+    { MP_ROM_QSTR(MP_QSTR_FRAME_LEN), MP_ROM_INT(FRAME_LEN) },
+    { MP_ROM_QSTR(MP_QSTR_FRAME_COBS), MP_ROM_INT(FRAME_COBS) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_RX), MP_ROM_INT(IRQ_RX) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_CONNECT), MP_ROM_INT(IRQ_CONNECT) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_DISCONNECT), MP_ROM_INT(IRQ_DISCONNECT) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_SCAN), MP_ROM_INT(IRQ_SCAN) },
+    { MP_ROM_QSTR(MP_QSTR_TRACE), MP_ROM_INT(BT_SPP_TRACE) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(btm_module_globals, btm_module_globals_table);
+
+const mp_obj_module_t mp_module_btm = {
+    .base = { &mp_type_module },
+    .globals = (mp_obj_dict_t*)&btm_module_globals,
+};
+
+MP_REGISTER_MODULE(MP_QSTR_btm, mp_module_btm);
+MP_REGISTER_ROOT_POINTER(mp_obj_t btm_irq_handler);
+
@@ -0,0 +1,2479 @@
+/*
+   MIT License
+
+   Copyright (c) 2023 Sharil Tumin
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+
+   This the server, slave, or peripheral of Bluetooth Classic serving SPP
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_bt_api.h"
+#include "esp_bt_device.h"
+#include "esp_spp_api.h"
+
+#include "py/obj.h"
+#include "py/runtime.h"
+#include "py/mperrno.h"
+#include "py/stream.h"
+#include "py/mphal.h"
+
+/*
+ * BT_SPP_TRACE picks what the driver reports, at build time:
+ *   0  nothing (default, the prod firmware)
+ *   1  every SPP and GAP event as an 8 byte record in a RAM ring, read
+ *      with trace() and turned into a timeline by tools/bt_spp_trace.py
+ *   2  as 1, and every event logged with ESP_LOG (the debug firmware)
+ * Logging over the UART is slow enough to change timing; the trace ring
+ * is not.
+ */
+#ifndef BT_SPP_TRACE
+#define BT_SPP_TRACE 0
+#endif
+
+#if BT_SPP_TRACE >= 2
+#include "esp_log.h"
+#define TAG "SPP_SERVER"
+static int evn_cnt = 0;
+#define LOG_EVT(name) do { evn_cnt++; ESP_LOGI(TAG, "%d - " name, evn_cnt); } while (0)
+#define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+#define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+#define LOG_HEX(buf, len) esp_log_buffer_hex(TAG, buf, len)
+#define LOG_CHAR(buf, len) esp_log_buffer_char(TAG, buf, len)
+#else
+#define LOG_EVT(name)
+#define LOGI(...)
+#define LOGE(...)
+#define LOG_HEX(buf, len)
+#define LOG_CHAR(buf, len)
+#endif
+
+#define DEFAULT_PIPE_SIZE 1024
+#define MAX_PIPE_SIZE (64 * 1024)
+#define FLOW_WAIT_MS 1000 /* longest a frame is held back in flow mode */
+
+#define FRAME_NONE 0 /* raw byte stream */
+#define FRAME_LEN  1 /* 2 byte big-endian length, then the message */
+#define FRAME_COBS 2 /* COBS encoded message, then a 0 byte */
+#define FRAME_MAX_LEN 0xFFFF
+
+/*
+ * Single-producer/single-consumer ring. The SPP callback is the only
+ * writer of tail, the MicroPython task the only writer of head, so no
+ * lock is needed: each side publishes its index with a release store
+ * and reads the other side's index with an acquire load.
+ *
+ * The size is a power of two and head/tail run freely, so the fill level
+ * is simply tail - head and a position in the buffer is index & mask.
+ *
+ * In flow mode the producer waits on drained once the pipe is above the
+ * high watermark, and the consumer gives it when it gets below the low one.
+ */
+typedef struct _pipe_obj_t {
+    char *buffer;
+    atomic_uint head; /* bytes read so far, owned by the consumer */
+    atomic_uint tail; /* bytes written so far, owned by the producer */
+    uint32_t size;
+    uint32_t mask;
+    bool flow;        /* hold back the sender instead of dropping */
+    uint32_t high;
+    uint32_t low;
+    atomic_bool stalled; /* producer is waiting for drained */
+    SemaphoreHandle_t drained;
+    uint8_t framing;
+    uint8_t hdr_got;     /* FRAME_LEN header bytes seen, producer only */
+    uint32_t need;       /* FRAME_LEN header, then bytes still to come */
+    bool mid;            /* the stream is inside a message, producer only */
+    bool skip;           /* dropping the rest of a message, producer only */
+    uint32_t mark;       /* tail after the last whole message, producer only */
+    atomic_uint msgs;    /* complete messages written, owned by the producer */
+    atomic_uint msgs_read; /* messages taken by get_msg(), owned by the consumer */
+    atomic_bool resync;  /* get_msg() found the pipe full without a whole message */
+    uint32_t held;       /* frames held back in flow mode, producer only */
+    uint32_t resyncs;    /* messages dropped to stay in step, producer only */
+} pipe_obj_t;
+
+/* (re)allocate the buffer, size is rounded up to a power of two */
+static bool pipe_alloc(pipe_obj_t *p, uint32_t size)
+{
+    uint32_t pow2 = 1;
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+    if (p->buffer == NULL || p->size != pow2) {
+        free(p->buffer);
+        p->buffer = malloc(sizeof(char) * pow2);
+        if (p->buffer == NULL) {
+            pow2 = 0;
+        }
+        p->size = pow2;
+        p->mask = pow2 ? pow2 - 1 : 0;
+    }
+    if (p->drained == NULL) {
+        p->drained = xSemaphoreCreateBinary();
+    }
+    p->high = p->size - p->size / 4;
+    p->low = p->size / 4;
+    p->hdr_got = 0;
+    p->need = 0;
+    p->mid = false;
+    p->skip = false;
+    p->mark = 0;
+    atomic_store(&p->msgs, 0);
+    atomic_store(&p->msgs_read, 0);
+    atomic_store(&p->resync, false);
+    atomic_store(&p->head, 0);
+    atomic_store(&p->tail, 0);
+    return p->buffer != NULL;
+}
+
+/* let a producer waiting in flow mode go, consumer side */
+static void pipe_wake(pipe_obj_t *p)
+{
+    if (atomic_exchange(&p->stalled, false)) {
+        xSemaphoreGive(p->drained);
+    }
+}
+
+static void pipe_free(pipe_obj_t *p)
+{
+    free(p->buffer);
+    p->buffer = NULL;
+    p->size = 0;
+    p->mask = 0;
+    atomic_store(&p->head, 0);
+    atomic_store(&p->tail, 0);
+}
+
+static uint32_t pipe_count(pipe_obj_t *p)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    return tail - head;
+}
+
+/*
+ * Copy in at most two spans: from tail to the end of the buffer, then
+ * from the start of the buffer. Called from esp_spp_cb only, never blocks.
+ */
+static int pipe_put(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    int room = p->size - (tail - head);
+    if (count > room) {
+        count = room; // pipe full, the rest is dropped
+    }
+    if (count <= 0) {
+        return 0;
+    }
+    int pos = tail & p->mask;
+    int first = p->size - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(p->buffer + pos, items, first);
+    memcpy(p->buffer, items + first, count - first);
+    atomic_store_explicit(&p->tail, tail + count, memory_order_release);
+    return count;
+}
+
+/* the same two spans the other way round, MicroPython task only */
+static int pipe_get(pipe_obj_t *p, uint8_t *items, int count)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int used = tail - head;
+    if (count > used) {
+        count = used;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+    int pos = head & p->mask;
+    int first = p->size - pos;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(items, p->buffer + pos, first);
+    memcpy(items + first, p->buffer, count - first);
+    atomic_store_explicit(&p->head, head + count, memory_order_release);
+    if (p->flow && (tail - head - count) <= p->low) {
+        pipe_wake(p);
+    }
+    return count;
+}
+
+/*
+ * Holding a frame back only helps if the reader can make room. With
+ * framing it only takes whole messages out, so a pipe with none in it
+ * would not drain however long we wait.
+ */
+static bool pipe_drains(pipe_obj_t *p)
+{
+    if (p->framing == FRAME_NONE) {
+        return true;
+    }
+    return atomic_load(&p->msgs) != atomic_load(&p->msgs_read) && atomic_load(&p->resync) == false;
+}
+
+/*
+ * Flow controlled put, called from esp_spp_cb only. The stack returns the
+ * RFCOMM credit for a frame to the peer when esp_spp_cb returns, so holding
+ * on to the frame while the pipe is above the high watermark throttles the
+ * sender instead of dropping bytes. If the reader does not drain the pipe
+ * within FLOW_WAIT_MS the rest is dropped, so the stack is never stuck.
+ * The wait blocks the BTC task, which runs every SPP and GAP callback, so
+ * all connections and events stall with it, not only this pipe.
+ */
+static int pipe_put_flow(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    int added = pipe_put(p, items, count);
+    if (added < count || pipe_count(p) > p->high) {
+        p->held++;
+    }
+    while (p->flow && (added < count || pipe_count(p) > p->high) && pipe_drains(p)) {
+        atomic_store(&p->stalled, true);
+        if (pipe_count(p) > p->low) { // the reader may have drained it meanwhile
+            if (xSemaphoreTake(p->drained, pdMS_TO_TICKS(FLOW_WAIT_MS)) != pdTRUE) {
+                atomic_store(&p->stalled, false);
+                break;
+            }
+        }
+        added += pipe_put(p, items + added, count - added);
+    }
+    return added;
+}
+/*
+ * Optional message framing, chosen at init(). FRAME_LEN puts a 2 byte
+ * big-endian length in front of each message, FRAME_COBS COBS encodes
+ * each message and ends it with a 0 byte.
+ *
+ * Only whole messages stay in the pipe, so get_msg() cannot get out of
+ * step. frame_next follows the message boundaries in everything that
+ * comes in, kept or not. When a message does not fit, frame_put takes
+ * back what made it in, back to mark, and skips the rest of it. msgs
+ * counts the messages kept, so get_msg() knows one is there without
+ * searching.
+ */
+
+/* bytes up to and including the end of the message, *end if it ends there */
+static int frame_next(pipe_obj_t *p, const uint8_t *items, int count, bool *end)
+{
+    *end = false;
+    if (p->framing == FRAME_COBS) {
+        const uint8_t *zero = memchr(items, 0, count);
+        if (zero == NULL) {
+            return count;
+        }
+        *end = true;
+        return zero - items + 1;
+    }
+    int n = 0; // FRAME_LEN
+    while (n < count && p->hdr_got < 2) {
+        p->need = (p->need << 8) | items[n++];
+        p->hdr_got++;
+    }
+    if (p->hdr_got == 2) {
+        uint32_t take = count - n;
+        if (take > p->need) {
+            take = p->need;
+        }
+        p->need -= take;
+        n += take;
+        if (p->need == 0) {
+            p->hdr_got = 0; // header and payload complete
+            *end = true;
+        }
+    }
+    return n;
+}
+
+/* drop the message that is not whole, and with rest what is still to come of it */
+static void frame_undo(pipe_obj_t *p, bool rest)
+{
+    atomic_store_explicit(&p->tail, p->mark, memory_order_release);
+    p->skip = rest;
+    p->resyncs++;
+}
+
+/*
+ * Framed put, called from esp_spp_cb only. Returns the bytes kept less
+ * those taken back, so below 0 if a message begun in an earlier frame
+ * was dropped.
+ */
+static int frame_put(pipe_obj_t *p, const uint8_t *items, int count)
+{
+    uint32_t start = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    if (atomic_exchange(&p->resync, false) && (start != p->mark || p->mid)) {
+        frame_undo(p, p->mid);
+    }
+    while (count > 0) {
+        bool end;
+        int n = frame_next(p, items, count, &end);
+        if (p->skip) {
+            p->skip = !end;
+        } else {
+            int added = p->flow ? pipe_put_flow(p, items, n) : pipe_put(p, items, n);
+            if (added < n) {
+                frame_undo(p, !end);
+            } else if (end) {
+                p->mark = atomic_load_explicit(&p->tail, memory_order_relaxed);
+                atomic_fetch_add_explicit(&p->msgs, 1, memory_order_release);
+            }
+        }
+        p->mid = !end;
+        items += n;
+        count -= n;
+    }
+    return (int32_t) (atomic_load_explicit(&p->tail, memory_order_relaxed) - start);
+}
+
+/*
+ * Offset of the first delim after head, -1 if it is not in the pipe.
+ * memchr looks for the first byte of delim in each of the two spans and
+ * the rest of delim is compared through the mask, so a match may straddle
+ * the end of the buffer. MicroPython task only.
+ */
+static int pipe_find(pipe_obj_t *p, const uint8_t *delim, int dlen)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int used = tail - head;
+    int pos = head & p->mask;
+    int first = p->size - pos;
+    if (first > used) {
+        first = used;
+    }
+    const char *span = p->buffer + pos;
+    int span_len = first;
+    int offset = 0; // of span from head
+    for (int n = 0; n < 2; n++) {
+        const char *from = span;
+        const char *hit;
+        while ((hit = memchr(from, delim[0], span + span_len - from)) != NULL) {
+            int at = offset + (hit - span);
+            if (at + dlen > used) {
+                return -1; // not all of delim is here yet
+            }
+            int i = 1;
+            while (i < dlen && (uint8_t) p->buffer[(head + at + i) & p->mask] == delim[i]) {
+                i++;
+            }
+            if (i == dlen) {
+                return at;
+            }
+            from = hit + 1;
+        }
+        span = p->buffer;
+        span_len = used - first;
+        offset = first;
+    }
+    return -1;
+}
+
+/* COBS encode len bytes into out with the 0 delimiter, returns the length */
+static size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t code_at = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] != 0) {
+            out[o++] = in[i];
+            code++;
+        }
+        if (in[i] == 0 || code == 0xFF) {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+        }
+    }
+    out[code_at] = code;
+    out[o++] = 0;
+    return o;
+}
+
+/* COBS decode in place, len without the delimiter, -1 if malformed */
+static int cobs_decode(uint8_t *buf, int len)
+{
+    int i = 0;
+    int o = 0;
+    while (i < len) {
+        int code = buf[i++];
+        if (code == 0 || i + code - 1 > len) {
+            return -1;
+        }
+        for (int j = 1; j < code; j++) {
+            buf[o++] = buf[i++];
+        }
+        if (code < 0xFF && i < len) {
+            buf[o++] = 0;
+        }
+    }
+    return o;
+}
+
+
+#define SPP_DATA_LEN ESP_SPP_MAX_MTU
+#define TX_SLOTS 4 /* frames queued for sending */
+#define TX_TRIES 3 /* writes of a frame that fail before it is given up */
+
+typedef struct _tx_slot_t {
+    uint16_t len;
+    uint8_t data[SPP_DATA_LEN]; /* ESP_SPP_MAX_MTU = 990 bytes */
+} tx_slot_t;
+
+/*
+ * Transmit queue, one per connection. send_str/send_bin fill the slot at
+ * tail and return at once; esp_spp_cb frees the slot at head on
+ * ESP_SPP_WRITE_EVT and starts the next write. None is started while the
+ * link is congested, ESP_SPP_CONG_EVT restarts the queue.
+ */
+typedef struct _txq_obj_t {
+    tx_slot_t *slot; /* TX_SLOTS frames, allocated at init() */
+    uint32_t head;   /* frames written so far, advanced by esp_spp_cb */
+    uint32_t tail;   /* frames queued so far, advanced by send */
+    bool cong;       /* waiting for ESP_SPP_CONG_EVT */
+    uint8_t tries;   /* failed writes of the frame at head */
+    uint32_t refused; /* frames esp_spp_write turned down, counted in tx_failed */
+    SemaphoreHandle_t room; /* given when a slot is freed */
+} txq_obj_t;
+
+/*
+ * Link statistics of one connection since init() or stats(True). Only
+ * the Bluetooth task counts, so plain words will do; a reset may lose an
+ * event that comes in at the same moment.
+ */
+typedef struct _stats_obj_t {
+    uint32_t rx_frames;
+    uint32_t rx_bytes;    /* into the pipe */
+    uint32_t rx_dropped;  /* bytes that did not fit, with framing all of their message */
+    uint32_t tx_frames;   /* confirmed by ESP_SPP_WRITE_EVT */
+    uint32_t tx_bytes;
+    uint32_t tx_failed;   /* ESP_SPP_WRITE_EVT with an error status, stats() adds txq.refused */
+    uint32_t cong_on;
+    uint32_t cong_off;
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t auth_failed;
+} stats_obj_t;
+
+#define OCC_BINS 18 /* log2 buckets, enough for MAX_PIPE_SIZE */
+
+/*
+ * Fill level of one connection's pipe, sampled after each frame went
+ * in. Bucket 0 counts an empty pipe, bucket n a fill level from 2^(n-1)
+ * to 2^n - 1 bytes. Time above the flow high watermark runs from the
+ * first sample above it to the first one below it again.
+ */
+typedef struct _occ_data_t {
+    uint32_t peak;
+    uint32_t hist[OCC_BINS];
+    bool above;
+    uint32_t above_since; /* mp_hal_ticks_us() of the first sample above */
+    uint64_t above_us;    /* finished spells above the watermark */
+} occ_data_t;
+
+typedef struct _occ_obj_t {
+    occ_data_t d;
+    portMUX_TYPE lock;
+} occ_obj_t;
+
+#define MAX_CONNS 4 /* masters the slave can serve at once */
+
+/* connection states, see state() */
+#define ST_IDLE           0 /* the slave is not up */
+#define ST_DISCOVERABLE   1 /* free, the slave takes connections */
+#define ST_AUTHENTICATING 2 /* a master is pairing, the slot will be its */
+#define ST_CONNECTED      3
+#define ST_CLOSING        4 /* close() called, waiting for ESP_SPP_CLOSE_EVT */
+
+/*
+ * One connected master. The slot is taken at ESP_SPP_SRV_OPEN_EVT and
+ * given back at ESP_SPP_CLOSE_EVT. It is ready from ESP_SPP_SRV_OPEN_EVT,
+ * so the slave can send first.
+ */
+typedef struct _conn_obj_t {
+    uint32_t handle; /* 0 while the slot is free */
+    bool ready;
+    uint8_t state;   /* ST_* */
+    esp_bd_addr_t addr; /* of the master, from the ACL or ESP_SPP_SRV_OPEN_EVT */
+    pipe_obj_t pipe;
+    txq_obj_t txq;
+    stats_obj_t stats;
+    occ_obj_t occ;
+} conn_obj_t;
+
+/* not on the GC heap, esp_spp_cb runs outside the MicroPython task */
+static conn_obj_t conn[MAX_CONNS] = {
+    [0 ... MAX_CONNS - 1] = { .occ = { .lock = portMUX_INITIALIZER_UNLOCKED } }
+};
+static int n_conns = 1; /* slots in use, set at init() */
+
+/*
+ * The connections take turns at sending: one esp_spp_write is outstanding
+ * over all of them, and the next frame comes from the first connection
+ * after the one that wrote last, so one busy peer cannot starve the rest.
+ * tx_lock guards all queues and the turn.
+ */
+static portMUX_TYPE tx_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool tx_busy = false; /* esp_spp_write issued, waiting for ESP_SPP_WRITE_EVT */
+static int tx_turn = 0;      /* connection of the last write */
+
+static conn_obj_t *conn_find(uint32_t handle)
+{
+    for (int i = 0; i < n_conns; i++) {
+        if (conn[i].handle == handle) {
+            return &conn[i];
+        }
+    }
+    return NULL;
+}
+
+/* the frame at head is done with, written or given up */
+static void txq_next(conn_obj_t *c)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    if (q->head != q->tail) {
+        q->head++;
+    }
+    q->tries = 0;
+    portEXIT_CRITICAL(&tx_lock);
+    xSemaphoreGive(q->room);
+}
+
+/* start the next write unless one is outstanding */
+static void txq_kick(void)
+{
+    bool refused;
+    do {
+        conn_obj_t *c = NULL;
+        tx_slot_t *slot = NULL;
+        portENTER_CRITICAL(&tx_lock);
+        for (int i = 1; !tx_busy && i <= n_conns; i++) {
+            int id = (tx_turn + i) % n_conns;
+            txq_obj_t *q = &conn[id].txq;
+            if (conn[id].handle != 0 && !q->cong && q->head != q->tail) {
+                tx_busy = true;
+                tx_turn = id;
+                c = &conn[id];
+                slot = &q->slot[q->head % TX_SLOTS];
+            }
+        }
+        portEXIT_CRITICAL(&tx_lock);
+        refused = slot != NULL && esp_spp_write(c->handle, slot->len, slot->data) != ESP_OK;
+        if (refused) {
+            portENTER_CRITICAL(&tx_lock);
+            tx_busy = false;
+            c->txq.refused++;
+            portEXIT_CRITICAL(&tx_lock);
+            txq_next(c); // no ESP_SPP_WRITE_EVT comes for it, on to the next frame
+        }
+    } while (refused);
+}
+
+/*
+ * ESP_SPP_WRITE_EVT. A frame that failed is written again, once the link
+ * is not congested, until it has failed TX_TRIES times.
+ */
+static void txq_done(conn_obj_t *c, bool ok, bool cong)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    tx_busy = false;
+    q->cong = cong;
+    bool next = ok || ++q->tries >= TX_TRIES;
+    portEXIT_CRITICAL(&tx_lock);
+    if (next) {
+        txq_next(c);
+    }
+    txq_kick(); // the next frame, or this one again
+}
+
+/* ESP_SPP_CONG_EVT */
+static void txq_cong(conn_obj_t *c, bool cong)
+{
+    portENTER_CRITICAL(&tx_lock);
+    c->txq.cong = cong;
+    portEXIT_CRITICAL(&tx_lock);
+    txq_kick();
+}
+
+/* drop whatever is queued, the connection is gone */
+static void txq_reset(conn_obj_t *c)
+{
+    txq_obj_t *q = &c->txq;
+    portENTER_CRITICAL(&tx_lock);
+    if (q->head != q->tail && tx_busy && &conn[tx_turn] == c) {
+        tx_busy = false; // its ESP_SPP_WRITE_EVT will not come
+    }
+    q->head = q->tail;
+    q->cong = false;
+    q->tries = 0;
+    portEXIT_CRITICAL(&tx_lock);
+    xSemaphoreGive(q->room);
+}
+
+/* slots and semaphore for a queue, MicroPython task */
+static bool txq_alloc(txq_obj_t *q)
+{
+    if (q->slot == NULL) {
+        q->slot = malloc(sizeof(tx_slot_t) * TX_SLOTS);
+    }
+    if (q->room == NULL) {
+        q->room = xSemaphoreCreateBinary();
+    }
+    q->head = q->tail;
+    q->cong = false;
+    q->tries = 0;
+    return q->slot != NULL && q->room != NULL;
+}
+
+static void txq_free(txq_obj_t *q)
+{
+    free(q->slot);
+    q->slot = NULL;
+    q->head = q->tail;
+}
+
+/* free slots, MicroPython task */
+static uint32_t txq_room(txq_obj_t *q)
+{
+    portENTER_CRITICAL(&tx_lock);
+    uint32_t room = TX_SLOTS - (q->tail - q->head);
+    portEXIT_CRITICAL(&tx_lock);
+    return room;
+}
+
+/*
+ * Copy one frame into the queue, MicroPython task only. Waits at most
+ * timeout_ms for a free slot, with the GIL released.
+ */
+static bool txq_put(txq_obj_t *q, const uint8_t *data, int len, int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    for (;;) {
+        portENTER_CRITICAL(&tx_lock);
+        bool full = (q->tail - q->head) >= TX_SLOTS;
+        portEXIT_CRITICAL(&tx_lock);
+        if (!full) {
+            break;
+        }
+        TickType_t spent = xTaskGetTickCount() - start;
+        if (spent >= wait) {
+            return false;
+        }
+        MP_THREAD_GIL_EXIT();
+        xSemaphoreTake(q->room, wait - spent);
+        MP_THREAD_GIL_ENTER();
+    }
+    tx_slot_t *slot = &q->slot[q->tail % TX_SLOTS];
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    portENTER_CRITICAL(&tx_lock);
+    q->tail++;
+    portEXIT_CRITICAL(&tx_lock);
+    return true;
+}
+
+#define IRQ_RX         0x01 /* min_bytes in the pipe, or the line went idle */
+#define IRQ_CONNECT    0x02
+#define IRQ_DISCONNECT 0x04
+#define IRQ_STATE      0x08 /* a lifecycle event was queued, see events() */
+
+/*
+ * Receive and connection IRQ. esp_spp_cb only ORs the event into pending
+ * and schedules irq_dispatch if it is not scheduled already. Events that
+ * come in before the handler has run are merged, so a burst of frames
+ * costs one call. The handler gets the merged events as its argument.
+ */
+typedef struct _irq_obj_t {
+    uint8_t trigger;       /* events wanted, 0 with no handler */
+    uint32_t min_bytes;
+    uint32_t idle_ms;
+    atomic_uint pending;   /* events not yet handed to the handler */
+    atomic_bool scheduled; /* irq_dispatch is waiting in the scheduler */
+    TimerHandle_t idle;    /* runs out idle_ms after the last frame */
+} irq_obj_t;
+
+static irq_obj_t irq_obj;
+static irq_obj_t *irq = &irq_obj;
+
+/* runs from the MicroPython scheduler, with the GIL */
+STATIC mp_obj_t irq_dispatch(mp_obj_t arg) {
+    atomic_store(&irq->scheduled, false);
+    uint32_t events = atomic_exchange(&irq->pending, 0);
+    mp_obj_t handler = MP_STATE_PORT(bts_irq_handler);
+    if (events != 0 && handler != MP_OBJ_NULL && handler != mp_const_none) {
+       mp_call_function_1(handler, MP_OBJ_NEW_SMALL_INT(events));
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(irq_dispatch_obj, irq_dispatch);
+
+/* esp_spp_cb or the idle timer, never blocks */
+static void irq_fire(irq_obj_t *q, uint32_t events)
+{
+    events &= q->trigger;
+    if (events == 0) {
+        return;
+    }
+    atomic_fetch_or(&q->pending, events);
+    if (!atomic_exchange(&q->scheduled, true)) {
+        if (!mp_sched_schedule(MP_OBJ_FROM_PTR(&irq_dispatch_obj), mp_const_none)) {
+            atomic_store(&q->scheduled, false); // scheduler full, next event tries again
+        }
+    }
+}
+
+/* after a frame went into the pipe */
+static void irq_rx(irq_obj_t *q, pipe_obj_t *p)
+{
+    if ((q->trigger & IRQ_RX) == 0) {
+        return;
+    }
+    uint32_t count = pipe_count(p);
+    if (count >= q->min_bytes || count == p->size) {
+        irq_fire(q, IRQ_RX);
+    }
+    if (q->idle != NULL && q->idle_ms > 0) {
+        xTimerReset(q->idle, 0); // restart the idle time
+    }
+}
+
+/* timer task, idle_ms without a new frame */
+static void irq_idle_cb(TimerHandle_t t)
+{
+    for (int i = 0; i < n_conns; i++) {
+        if (pipe_count(&conn[i].pipe) > 0) {
+            irq_fire(irq, IRQ_RX);
+            break;
+        }
+    }
+}
+
+/* no more events, MicroPython task */
+static void irq_off(irq_obj_t *q)
+{
+    q->trigger = 0;
+    if (q->idle != NULL) {
+        xTimerStop(q->idle, portMAX_DELAY);
+    }
+    atomic_store(&q->pending, 0);
+}
+
+/*
+ * Lifecycle events for events(), one for each change of a connection's
+ * state. When the queue is full the oldest is dropped.
+ */
+#define EVQ_LEN 16
+
+typedef struct _ev_t {
+    uint8_t id;
+    uint8_t state;     /* ST_*, the new one */
+    esp_bd_addr_t addr;
+    uint32_t ms;       /* mp_hal_ticks_ms() */
+} ev_t;
+
+typedef struct _evq_obj_t {
+    ev_t e[EVQ_LEN];
+    uint32_t head; /* events taken by events() */
+    uint32_t tail; /* events queued */
+    portMUX_TYPE lock;
+} evq_obj_t;
+
+static evq_obj_t evq_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static evq_obj_t *evq = &evq_obj;
+
+/* move c to state and queue the event, never blocks */
+static void conn_state(conn_obj_t *c, uint8_t state)
+{
+    c->state = state;
+    portENTER_CRITICAL(&evq->lock);
+    if (evq->tail - evq->head == EVQ_LEN) {
+        evq->head++;
+    }
+    ev_t *e = &evq->e[evq->tail++ % EVQ_LEN];
+    e->id = c - conn;
+    e->state = state;
+    memcpy(e->addr, c->addr, ESP_BD_ADDR_LEN);
+    e->ms = mp_hal_ticks_ms();
+    portEXIT_CRITICAL(&evq->lock);
+    irq_fire(irq, IRQ_STATE);
+}
+
+/* the slot in state with the master at addr */
+static conn_obj_t *conn_peer(uint8_t state, const uint8_t *addr)
+{
+    for (int i = 0; i < n_conns; i++) {
+        if (conn[i].state == state && memcmp(conn[i].addr, addr, ESP_BD_ADDR_LEN) == 0) {
+            return &conn[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A free slot for the master at addr, the one it is pairing in if any.
+ * Never one that another master is pairing in, NULL if none is left.
+ */
+static conn_obj_t *conn_take(const uint8_t *addr)
+{
+    conn_obj_t *c = conn_peer(ST_AUTHENTICATING, addr);
+    for (int i = 0; c == NULL && i < n_conns; i++) {
+        if (conn[i].handle == 0 && (conn[i].state == ST_DISCOVERABLE || conn[i].state == ST_IDLE)) {
+            c = &conn[i];
+        }
+    }
+    return c;
+}
+
+/* events that match no connection, counted in the total only */
+static stats_obj_t stats_none;
+
+static stats_obj_t *conn_stats(conn_obj_t *c)
+{
+    return (c != NULL) ? &c->stats : &stats_none;
+}
+
+/* every field of stats_obj_t is a uint32_t counter */
+static void stats_add(stats_obj_t *sum, const stats_obj_t *s)
+{
+    uint32_t *d = (uint32_t *) sum;
+    const uint32_t *a = (const uint32_t *) s;
+    for (size_t i = 0; i < sizeof(*s) / sizeof(uint32_t); i++) {
+        d[i] += a[i];
+    }
+}
+
+/*
+ * Data path timing for benchmarks, since init() or timing(True). The
+ * ESP_SPP_DATA_IND_EVT cost is in CPU cycles, the rest in microseconds.
+ */
+typedef struct _timing_data_t {
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+    uint32_t rx_first;   /* mp_hal_ticks_us() of the first frame in */
+    uint32_t rx_last;
+    uint64_t cb_cycles;  /* summed over rx_frames */
+    uint32_t cb_max;
+    uint32_t tx_frames;  /* writes confirmed by ESP_SPP_WRITE_EVT */
+    uint32_t tx_bytes;
+    uint32_t tx_first;
+    uint32_t tx_last;
+} timing_data_t;
+
+typedef struct _timing_obj_t {
+    timing_data_t d;
+    portMUX_TYPE lock;
+} timing_obj_t;
+
+static timing_obj_t timing_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static timing_obj_t *timing = &timing_obj;
+
+/* esp_spp_cb, a frame of len bytes took cycles to handle */
+static void timing_rx(timing_obj_t *t, uint32_t len, uint32_t cycles)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    if (t->d.rx_frames == 0) {
+        t->d.rx_first = now;
+    }
+    t->d.rx_last = now;
+    t->d.rx_frames++;
+    t->d.rx_bytes += len;
+    t->d.cb_cycles += cycles;
+    if (cycles > t->d.cb_max) {
+        t->d.cb_max = cycles;
+    }
+    portEXIT_CRITICAL(&t->lock);
+}
+
+/* esp_spp_cb, a write of len bytes is done */
+static void timing_tx(timing_obj_t *t, uint32_t len)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    if (t->d.tx_frames == 0) {
+        t->d.tx_first = now;
+    }
+    t->d.tx_last = now;
+    t->d.tx_frames++;
+    t->d.tx_bytes += len;
+    portEXIT_CRITICAL(&t->lock);
+}
+
+static void timing_reset(timing_obj_t *t)
+{
+    portENTER_CRITICAL(&t->lock);
+    memset(&t->d, 0, sizeof(t->d));
+    portEXIT_CRITICAL(&t->lock);
+}
+
+/* esp_spp_cb, after a frame went into the pipe */
+static void occ_sample(occ_obj_t *o, pipe_obj_t *p)
+{
+    uint32_t count = pipe_count(p);
+    int bin = (count == 0) ? 0 : 32 - __builtin_clz(count);
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&o->lock);
+    if (count > o->d.peak) {
+        o->d.peak = count;
+    }
+    o->d.hist[bin < OCC_BINS ? bin : OCC_BINS - 1]++;
+    if (count > p->high && !o->d.above) {
+        o->d.above = true;
+        o->d.above_since = now;
+    } else if (count <= p->high && o->d.above) {
+        o->d.above = false;
+        o->d.above_us += now - o->d.above_since;
+    }
+    portEXIT_CRITICAL(&o->lock);
+}
+
+static void occ_reset(occ_obj_t *o)
+{
+    portENTER_CRITICAL(&o->lock);
+    memset(&o->d, 0, sizeof(o->d));
+    portEXIT_CRITICAL(&o->lock);
+}
+
+#if BT_SPP_TRACE >= 1
+#define TRACE_LEN 256 /* records kept, then the oldest is overwritten */
+#define TRACE_SPP 0
+#define TRACE_GAP 1
+
+/* one event, 8 bytes little-endian as tools/bt_spp_trace.py reads them */
+typedef struct _trace_rec_t {
+    uint32_t us;    /* mp_hal_ticks_us() */
+    uint8_t src;    /* TRACE_SPP or TRACE_GAP */
+    uint8_t event;  /* esp_spp_cb_event_t or esp_bt_gap_cb_event_t */
+    uint16_t arg;   /* length, congestion flag or status, by event */
+} trace_rec_t;
+
+typedef struct _trace_obj_t {
+    trace_rec_t rec[TRACE_LEN];
+    uint32_t count; /* records written so far */
+    portMUX_TYPE lock;
+} trace_obj_t;
+
+static trace_obj_t trace_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static trace_obj_t *trace = &trace_obj;
+
+/* Bluetooth task, from both callbacks */
+static void trace_put(trace_obj_t *t, uint8_t src, uint8_t event, uint16_t arg)
+{
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&t->lock);
+    trace_rec_t *r = &t->rec[t->count % TRACE_LEN];
+    r->us = now;
+    r->src = src;
+    r->event = event;
+    r->arg = arg;
+    t->count++;
+    portEXIT_CRITICAL(&t->lock);
+}
+
+static uint16_t trace_spp_arg(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_SPP_DATA_IND_EVT:
+        return param->data_ind.len;
+    case ESP_SPP_WRITE_EVT:
+        return param->write.len;
+    case ESP_SPP_CONG_EVT:
+        return param->cong.cong;
+    case ESP_SPP_DISCOVERY_COMP_EVT:
+        return param->disc_comp.status;
+    case ESP_SPP_OPEN_EVT:
+        return param->open.status;
+    case ESP_SPP_SRV_OPEN_EVT:
+        return param->srv_open.status;
+    case ESP_SPP_CLOSE_EVT:
+        return param->close.status;
+    default:
+        return 0;
+    }
+}
+
+static uint16_t trace_gap_arg(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_BT_GAP_AUTH_CMPL_EVT:
+        return param->auth_cmpl.stat;
+    case ESP_BT_GAP_DISC_STATE_CHANGED_EVT:
+        return param->disc_st_chg.state;
+    default:
+        return 0;
+    }
+}
+
+#define TRACE_SPP_EVT(event, param) trace_put(trace, TRACE_SPP, event, trace_spp_arg(event, param))
+#define TRACE_GAP_EVT(event, param) trace_put(trace, TRACE_GAP, event, trace_gap_arg(event, param))
+#else
+#define TRACE_SPP_EVT(event, param)
+#define TRACE_GAP_EVT(event, param)
+#endif
+
+static const esp_spp_mode_t esp_spp_mode = ESP_SPP_MODE_CB;
+static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHENTICATE;
+// static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHORIZE;
+static const esp_spp_role_t role_slave = ESP_SPP_ROLE_SLAVE;
+
+/* "aa:bb:cc:dd:ee:ff" or 6 bytes into addr, false for anything else */
+static bool addr_parse(mp_obj_t obj, uint8_t *addr)
+{
+    size_t len;
+    const char *s = mp_obj_str_get_data(obj, &len);
+    if (mp_obj_is_str(obj) == false) {
+        if (len != ESP_BD_ADDR_LEN) {
+            return false;
+        }
+        memcpy(addr, s, ESP_BD_ADDR_LEN);
+        return true;
+    }
+    unsigned int b[ESP_BD_ADDR_LEN];
+    int end = 0;
+    if (len != 17 || sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x%n", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6 || end != 17) {
+        return false;
+    }
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        addr[i] = b[i];
+    }
+    return true;
+}
+
+static mp_obj_t addr_str(const uint8_t *addr)
+{
+    char s[18];
+    snprintf(s, sizeof(s), "%02x:%02x:%02x:%02x:%02x:%02x", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+    return mp_obj_new_str(s, 17);
+}
+
+#define BOND_NVS_SPACE "bts"
+
+/*
+ * Bonded peers. Bluedroid keeps the link keys in NVS itself, so a bonded
+ * peer authenticates without the PIN. This keeps them in last-used order,
+ * in NVS as well, and unbonds the least recently used when there are more
+ * than max_bonds. A peer is added by pairing with it.
+ */
+#define BOND_MAX 16
+#define BOND_NVS_KEY "bond_lru"
+
+typedef struct _bond_obj_t {
+    esp_bd_addr_t addr[BOND_MAX + 1]; /* most recently used first, one spare for bond_touch */
+    int count;
+    int max;     /* max_bonds from init() */
+    portMUX_TYPE lock;
+} bond_obj_t;
+
+static bond_obj_t bond_obj = { .lock = portMUX_INITIALIZER_UNLOCKED };
+static bond_obj_t *bond = &bond_obj;
+
+static void bond_save(bond_obj_t *b)
+{
+    esp_bd_addr_t copy[BOND_MAX + 1];
+    nvs_handle_t h;
+    portENTER_CRITICAL(&b->lock);
+    int count = b->count;
+    memcpy(copy, b->addr, sizeof(copy));
+    portEXIT_CRITICAL(&b->lock);
+    if (nvs_open(BOND_NVS_SPACE, NVS_READWRITE, &h) != ESP_OK) {
+        LOGE("bond order not saved");
+        return;
+    }
+    if (nvs_set_blob(h, BOND_NVS_KEY, copy, count * ESP_BD_ADDR_LEN) == ESP_OK) {
+        nvs_commit(h);
+    }
+    nvs_close(h);
+}
+
+static int bond_index(bond_obj_t *b, const uint8_t *addr)
+{
+    for (int i = 0; i < b->count; i++) {
+        if (memcmp(b->addr[i], addr, ESP_BD_ADDR_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* the least recently used beyond max go, outside the lock */
+static void bond_trim(bond_obj_t *b)
+{
+    esp_bd_addr_t gone[BOND_MAX + 1];
+    int n = 0;
+    portENTER_CRITICAL(&b->lock);
+    while (b->count > b->max) {
+        b->count--;
+        memcpy(gone[n++], b->addr[b->count], ESP_BD_ADDR_LEN);
+    }
+    portEXIT_CRITICAL(&b->lock);
+    for (int i = 0; i < n; i++) {
+        esp_bt_gap_remove_bond_device(gone[i]);
+    }
+}
+
+/*
+ * After the stack is up: the order saved in NVS, matched against the
+ * bonds the stack really has. Bonds it has that are not in the order yet
+ * go last.
+ */
+static void bond_load(bond_obj_t *b, int max)
+{
+    esp_bd_addr_t saved[BOND_MAX];
+    esp_bd_addr_t stack[BOND_MAX];
+    size_t len = sizeof(saved);
+    int n_saved = 0;
+    nvs_handle_t h;
+    if (nvs_open(BOND_NVS_SPACE, NVS_READONLY, &h) == ESP_OK) {
+        if (nvs_get_blob(h, BOND_NVS_KEY, saved, &len) == ESP_OK) {
+            n_saved = len / ESP_BD_ADDR_LEN;
+        }
+        nvs_close(h);
+    }
+    int n_stack = esp_bt_gap_get_bond_device_num();
+    if (n_stack > BOND_MAX) {
+        n_stack = BOND_MAX; // more than we can order, the rest is left alone
+    }
+    if (n_stack < 0 || esp_bt_gap_get_bond_device_list(&n_stack, stack) != ESP_OK) {
+        n_stack = 0;
+    }
+    portENTER_CRITICAL(&b->lock);
+    b->max = max;
+    b->count = 0;
+    for (int i = 0; i < n_saved; i++) {
+        for (int j = 0; j < n_stack; j++) {
+            if (memcmp(saved[i], stack[j], ESP_BD_ADDR_LEN) == 0) {
+                memcpy(b->addr[b->count++], saved[i], ESP_BD_ADDR_LEN);
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < n_stack; j++) {
+        if (bond_index(b, stack[j]) < 0) {
+            memcpy(b->addr[b->count++], stack[j], ESP_BD_ADDR_LEN);
+        }
+    }
+    portEXIT_CRITICAL(&b->lock);
+    bond_trim(b);
+    bond_save(b);
+}
+
+/* ESP_BT_GAP_AUTH_CMPL_EVT, the peer goes in front */
+static void bond_touch(bond_obj_t *b, const uint8_t *addr)
+{
+    portENTER_CRITICAL(&b->lock);
+    int i = bond_index(b, addr);
+    if (i == 0) {
+        portEXIT_CRITICAL(&b->lock);
+        return; // already in front, nothing to save
+    }
+    if (i < 0) {
+        i = b->count++; // new, bond_trim makes room
+    }
+    memmove(b->addr[1], b->addr[0], i * ESP_BD_ADDR_LEN);
+    memcpy(b->addr[0], addr, ESP_BD_ADDR_LEN);
+    portEXIT_CRITICAL(&b->lock);
+    bond_trim(b);
+    bond_save(b);
+}
+
+/* unbond one peer, or all of them with addr NULL */
+static void bond_remove(bond_obj_t *b, const uint8_t *addr)
+{
+    esp_bd_addr_t gone[BOND_MAX + 1];
+    int n = 0;
+    portENTER_CRITICAL(&b->lock);
+    if (addr == NULL) {
+        n = b->count;
+        memcpy(gone, b->addr, n * ESP_BD_ADDR_LEN);
+        b->count = 0;
+    } else {
+        int i = bond_index(b, addr);
+        if (i >= 0) {
+            b->count--;
+            memmove(b->addr[i], b->addr[i + 1], (b->count - i) * ESP_BD_ADDR_LEN);
+        }
+        memcpy(gone[n++], addr, ESP_BD_ADDR_LEN); // the stack may have it all the same
+    }
+    portEXIT_CRITICAL(&b->lock);
+    for (int i = 0; i < n; i++) {
+        esp_bt_gap_remove_bond_device(gone[i]);
+    }
+    bond_save(b);
+}
+
+typedef struct _slave_obj_t {
+   char name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+   uint8_t pin_code[17];
+   /* esp_bd_addr_t master_addr; */
+   int max_bonds;
+} slave_obj_t;
+
+slave_obj_t *slave; /* will get value at bts.init() */
+
+static bool slave_storage = false; /* slave storage allocation flag */
+
+static bool slave_up = false; /* slave not up, can do init */
+
+static SemaphoreHandle_t spp_down = NULL; /* given at ESP_SPP_UNINIT_EVT */
+
+static bool slave_auth = false; /* slave not autenticated */
+
+static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    uint8_t *items;
+    int count;
+    uint32_t start; /* cycle count at ESP_SPP_DATA_IND_EVT */
+    conn_obj_t *c;
+    pipe_obj_t *p;
+
+    TRACE_SPP_EVT(event, param);
+    switch (event) {
+    case ESP_SPP_INIT_EVT:
+        LOG_EVT("ESP_SPP_INIT_EVT");
+        break;
+    case ESP_SPP_UNINIT_EVT:
+        LOG_EVT("ESP_SPP_UNINIT_EVT");
+        xSemaphoreGive(spp_down);
+        break;
+    case ESP_SPP_DISCOVERY_COMP_EVT:
+        LOG_EVT("ESP_SPP_DISCOVERY_COMP_EVT");
+        break;
+    case ESP_SPP_OPEN_EVT:
+        LOG_EVT("ESP_SPP_OPEN_EVT");
+        break;
+    case ESP_SPP_CLOSE_EVT:
+        LOG_EVT("ESP_SPP_CLOSE_EVT");
+        c = conn_find(param->close.handle);
+        if (c == NULL) {
+            break;
+        }
+        c->ready = false;
+        txq_reset(c);
+        c->handle = 0; // the slot is free again
+        txq_kick();
+        conn_state(c, ST_DISCOVERABLE);
+        irq_fire(irq, IRQ_DISCONNECT);
+        c->stats.disconnects++;
+        // now waiting for new connection 
+        esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_GENERAL_DISCOVERABLE);
+        break;
+    case ESP_SPP_START_EVT:
+        LOG_EVT("ESP_SPP_START_EVT");
+        break;
+    case ESP_SPP_CL_INIT_EVT:
+        LOG_EVT("ESP_SPP_CL_INIT_EVT");
+        break;
+    case ESP_SPP_DATA_IND_EVT:
+        start = mp_hal_ticks_cpu();
+        LOG_EVT("ESP_SPP_DATA_IND_EVT");
+        c = conn_find(param->data_ind.handle);
+        if (c == NULL) {
+            break;
+        }
+        p = &c->pipe;
+        items = param->data_ind.data;
+        count = param->data_ind.len;
+        if (p->framing != FRAME_NONE) {
+            count = frame_put(p, items, count); // whole messages only
+        } else if (p->flow) {
+            count = pipe_put_flow(p, items, count);
+        } else {
+            count = pipe_put(p, items, count); // what does not fit is dropped
+        }
+        LOGI("#bytes in: %d", count);
+        c->stats.rx_frames++;
+        c->stats.rx_bytes += (count > 0) ? count : 0;
+        c->stats.rx_dropped += param->data_ind.len - count;
+        occ_sample(&c->occ, p);
+        irq_rx(irq, p);
+        timing_rx(timing, param->data_ind.len, mp_hal_ticks_cpu() - start);
+        break;
+    case ESP_SPP_CONG_EVT:
+        LOG_EVT("ESP_SPP_CONG_EVT");
+        c = conn_find(param->cong.handle);
+        if (param->cong.cong) {
+            conn_stats(c)->cong_on++;
+        } else {
+            conn_stats(c)->cong_off++;
+        }
+        if (c != NULL) {
+            txq_cong(c, param->cong.cong);
+        }
+        break;
+    case ESP_SPP_WRITE_EVT:
+        LOG_EVT("ESP_SPP_WRITE_EVT");
+        c = conn_find(param->write.handle);
+        if (param->write.status == ESP_SPP_SUCCESS) {
+            timing_tx(timing, param->write.len);
+            conn_stats(c)->tx_frames++;
+            conn_stats(c)->tx_bytes += param->write.len;
+        } else {
+            conn_stats(c)->tx_failed++;
+        }
+        if (c != NULL) {
+            txq_done(c, param->write.status == ESP_SPP_SUCCESS, param->write.cong);
+        }
+        break;
+    case ESP_SPP_SRV_OPEN_EVT:
+        LOG_EVT("ESP_SPP_SRV_OPEN_EVT");
+        c = conn_take(param->srv_open.rem_bda);
+        if (c == NULL) {
+            esp_spp_disconnect(param->srv_open.handle); // no free slot
+            break;
+        }
+        c->handle = param->srv_open.handle;
+        memcpy(c->addr, param->srv_open.rem_bda, ESP_BD_ADDR_LEN);
+        c->ready = true; // the slave may send first
+        conn_state(c, ST_CONNECTED);
+        irq_fire(irq, IRQ_CONNECT);
+        c->stats.connects++;
+        if (conn_find(0) == NULL) {
+            // all slots taken, make the slave stop responding to discorery request
+            esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+        }
+        break;
+    default:
+        LOGI("Unhandled ESP_SPP event: %d", event);
+
+        break;
+    }
+}
+
+static void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *param)
+{
+    TRACE_GAP_EVT(event, param);
+    switch (event) {
+    case ESP_BT_GAP_AUTH_CMPL_EVT:{
+        LOG_EVT("ESP_BT_GAP_AUTH_CMPL_EVT");
+        if (param->auth_cmpl.stat == ESP_BT_STATUS_SUCCESS) {
+            slave_auth = true;
+            bond_touch(bond, param->auth_cmpl.bda);
+            LOGI("authentication success: %s",  param->auth_cmpl.device_name);
+            LOG_HEX(param->auth_cmpl.bda, ESP_BD_ADDR_LEN);
+        } else {
+            slave_auth = false;
+            LOGE("authentication failed, status:%d", param->auth_cmpl.stat);
+            conn_obj_t *c = conn_peer(ST_AUTHENTICATING, param->auth_cmpl.bda);
+            conn_stats(c)->auth_failed++;
+            if (c != NULL) {
+                conn_state(c, ST_DISCOVERABLE);
+            }
+        }
+        break;
+    }
+    case ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT:{
+        LOG_EVT("ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT");
+        if (param->acl_conn_cmpl_stat.stat != ESP_BT_STATUS_SUCCESS) {
+            break;
+        }
+        conn_obj_t *c = conn_take(param->acl_conn_cmpl_stat.bda);
+        if (c != NULL && c->state == ST_DISCOVERABLE) {
+            memcpy(c->addr, param->acl_conn_cmpl_stat.bda, ESP_BD_ADDR_LEN);
+            conn_state(c, ST_AUTHENTICATING);
+        }
+        break;
+    }
+    case ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT:{
+        LOG_EVT("ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT");
+        conn_obj_t *c = conn_peer(ST_AUTHENTICATING, param->acl_disconn_cmpl_stat.bda);
+        if (c != NULL) {
+            conn_state(c, ST_DISCOVERABLE); // left before ESP_SPP_SRV_OPEN_EVT
+        }
+        break;
+    }
+    case ESP_BT_GAP_PIN_REQ_EVT:{
+        LOG_EVT("ESP_BT_GAP_PIN_REQ_EVT");
+        LOGI("THIS WILL NEVER HAPPEN ON SLAVE");
+        break;
+    }
+
+    // These are for CONFIG_BT_SSP_ENABLED
+    case ESP_BT_GAP_CFM_REQ_EVT:
+        LOG_EVT("ESP_BT_GAP_CFM_REQ_EVT (SPP ENABLE)");
+        LOGI("THIS WILL NEVER HAPPEN. SSP WAS DISABLE");
+        break;
+    case ESP_BT_GAP_KEY_NOTIF_EVT:
+        LOG_EVT("ESP_BT_GAP_KEY_NOTIF_EVT (SPP ENABLE)");
+        LOGI("THIS WILL NEVER HAPPEN. SSP WAS DISABLE");
+        break;
+    case ESP_BT_GAP_KEY_REQ_EVT:
+        LOG_EVT("ESP_BT_GAP_KEY_REQ_EVT (SPP ENABLE)");
+        LOGI("THIS WILL NEVER HAPPEN. SSP WAS DISABLE");
+        break;
+    // These are for CONFIG_BT_SSP_ENABLED
+
+    default: {
+        LOGI("Unhandled ESP_BT_GAP event: %d", event);
+        break;
+    }
+    }
+    return;
+}
+
+/*
+ * How far the Bluetooth stack is up is asked of the controller and
+ * Bluedroid, so a stack that btm or the firmware left up is taken as it
+ * is. init() brings it up from there, deinit() takes it down and
+ * deinit(True) leaves it up, so the next init() only restarts SPP: a
+ * warm start.
+ */
+#define SPP_DOWN_MS 1000 /* wait for ESP_SPP_UNINIT_EVT at deinit() */
+
+/* init() stages, timed for init_time() */
+#define INIT_NVS        0
+#define INIT_CONTROLLER 1
+#define INIT_BLUEDROID  2
+#define INIT_SPP        3
+#define INIT_START      4 /* PIN, name, scan mode, the server started */
+#define INIT_STAGES     5
+
+typedef struct _init_time_t {
+    uint32_t us[INIT_STAGES];
+    bool warm; /* the stack was up already */
+} init_time_t;
+
+static init_time_t init_time_obj;
+static init_time_t *init_time = &init_time_obj;
+
+/* stage i took from t till now, returns now */
+static uint32_t init_stage(int i, uint32_t t)
+{
+    uint32_t now = mp_hal_ticks_us();
+    init_time->us[i] = now - t;
+    return now;
+}
+
+/* take the stack down from where it is */
+static void stack_down(void)
+{
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_ENABLED) {
+        esp_bluedroid_disable();
+    }
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        esp_bluedroid_deinit();
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_ENABLED) {
+        esp_bt_controller_disable();
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_INITED) {
+        esp_bt_controller_deinit();
+    }
+}
+
+/* nothing of the stack is up */
+static bool stack_is_down(void)
+{
+    return esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_IDLE;
+}
+
+/* let go of the buffers of all connections, no callback may use them */
+static void conns_free(void)
+{
+    for (int i = 0; i < MAX_CONNS; i++) {
+        pipe_free(&conn[i].pipe);
+        txq_free(&conn[i].txq);
+        conn[i].ready = false;
+        conn[i].handle = 0;
+        conn[i].state = ST_IDLE;
+    }
+}
+
+/*
+ * Bring the stack up from where it is and start SPP. On an error, *what
+ * names the call that failed; the stack stays where it got to.
+ */
+static esp_err_t bts_start(const char **what)
+{
+    esp_err_t ret = ESP_OK;
+    uint32_t t = mp_hal_ticks_us();
+    memset(init_time, 0, sizeof(*init_time));
+    init_time->warm = (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_ENABLED);
+
+    if (stack_is_down()) {
+        *what = "nvs_flash_init";
+        ret = nvs_flash_init();
+        if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+            if ((ret = nvs_flash_erase()) == ESP_OK) {
+                ret = nvs_flash_init();
+            }
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    t = init_stage(INIT_NVS, t);
+
+    if (stack_is_down()) {
+        *what = "esp_bt_controller_mem_release";
+        ret = esp_bt_controller_mem_release(ESP_BT_MODE_BLE);
+        if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+            return ret; // ESP_ERR_INVALID_STATE: given back already, it is once per boot
+        }
+        esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+        *what = "esp_bt_controller_init";
+        if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
+            return ret;
+        }
+    }
+    if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_INITED) {
+        *what = "esp_bt_controller_enable";
+        if ((ret = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT)) != ESP_OK) {
+            return ret;
+        }
+    }
+    t = init_stage(INIT_CONTROLLER, t);
+
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_UNINITIALIZED) {
+        *what = "esp_bluedroid_init";
+        if ((ret = esp_bluedroid_init()) != ESP_OK) {
+            return ret;
+        }
+    }
+    if (esp_bluedroid_get_status() == ESP_BLUEDROID_STATUS_INITIALIZED) {
+        *what = "esp_bluedroid_enable";
+        if ((ret = esp_bluedroid_enable()) != ESP_OK) {
+            return ret;
+        }
+    }
+    // on a warm start too, btm may have registered its own since
+    *what = "esp_bt_gap_register_callback";
+    if ((ret = esp_bt_gap_register_callback(esp_bt_gap_cb)) != ESP_OK) {
+        return ret;
+    }
+    *what = "esp_spp_register_callback";
+    if ((ret = esp_spp_register_callback(esp_spp_cb)) != ESP_OK) {
+        return ret;
+    }
+    t = init_stage(INIT_BLUEDROID, t);
+
+    *what = "esp_spp_init";
+    if ((ret = esp_spp_init(esp_spp_mode)) != ESP_OK) {
+        return ret;
+    }
+    t = init_stage(INIT_SPP, t);
+
+    /*
+     * Set default parameters for Legacy Pairing
+     * Use variable pin, input pin code when pairing
+     */
+    esp_bt_pin_type_t pin_type = ESP_BT_PIN_TYPE_FIXED;
+    *what = "esp_bt_gap_set_pin";
+    if ((ret = esp_bt_gap_set_pin(pin_type, 4, slave->pin_code)) == ESP_OK) {
+        *what = "esp_bt_dev_set_device_name";
+        ret = esp_bt_dev_set_device_name(slave->name);
+    }
+    if (ret == ESP_OK) {
+        *what = "esp_bt_gap_set_scan_mode";
+        ret = esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_GENERAL_DISCOVERABLE);
+    }
+    if (ret == ESP_OK) {
+        LOGI("Start server");
+        *what = "esp_spp_start_srv";
+        ret = esp_spp_start_srv(sec_mask, role_slave, 0, slave->name);
+    }
+    if (ret != ESP_OK) {
+        esp_spp_deinit(); // the next init() starts it again
+        return ret;
+    }
+    bond_load(bond, slave->max_bonds);
+    init_stage(INIT_START, t);
+    return ESP_OK;
+}
+
+STATIC mp_obj_t bts_init(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_name, ARG_pin, ARG_rxbuf, ARG_flow, ARG_framing, ARG_conns, ARG_max_bonds };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_name, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL} },
+        { MP_QSTR_pin, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL} },
+        { MP_QSTR_rxbuf, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = DEFAULT_PIPE_SIZE} },
+        { MP_QSTR_flow, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+        { MP_QSTR_framing, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = FRAME_NONE} },
+        { MP_QSTR_conns, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
+        { MP_QSTR_max_bonds, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 8} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    if (slave_up == true) {
+       return mp_const_false;
+    }
+    const char *sn = mp_obj_str_get_str(args[ARG_name].u_obj);
+    const char *sp = mp_obj_str_get_str(args[ARG_pin].u_obj);
+    int rxbuf = args[ARG_rxbuf].u_int;
+    if (rxbuf <= 0 || rxbuf > MAX_PIPE_SIZE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad rxbuf"));
+    }
+    int framing = args[ARG_framing].u_int;
+    if (framing < FRAME_NONE || framing > FRAME_COBS) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad framing"));
+    }
+    int conns = args[ARG_conns].u_int;
+    if (conns < 1 || conns > MAX_CONNS) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad conns"));
+    }
+    int max_bonds = args[ARG_max_bonds].u_int;
+    if (max_bonds < 1 || max_bonds > BOND_MAX) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad max_bonds"));
+    }
+    if (slave_storage == false) {
+       // create slave object
+       slave_obj_t *so = m_new_obj(slave_obj_t);
+       memcpy(so->name, sn, strlen(sn));     // slave name
+       memcpy(so->pin_code, sp, strlen(sp)); // PIN
+       slave = so;
+       slave_storage = true;  // ready with storage
+    } else {
+       memcpy(slave->name, sn, strlen(sn));     // slave name
+       memcpy(slave->pin_code, sp, strlen(sp)); // PIN
+    }
+    for (int i = 0; i < MAX_CONNS; i++) {
+       conn_obj_t *c = &conn[i];
+       c->handle = 0;
+       c->ready = false;
+       c->state = (i < conns) ? ST_DISCOVERABLE : ST_IDLE;
+       if (i >= conns) {
+          pipe_free(&c->pipe); // left over from an init() with more conns
+          txq_free(&c->txq);
+          continue;
+       }
+       if (pipe_alloc(&c->pipe, rxbuf) == false || txq_alloc(&c->txq) == false) {
+          conns_free(); // not the ones allocated before this one either
+          mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for rxbuf"));
+       }
+       c->pipe.flow = args[ARG_flow].u_bool;
+       c->pipe.framing = framing;
+       c->pipe.held = 0;
+       c->pipe.resyncs = 0;
+       c->txq.refused = 0;
+       memset(&c->stats, 0, sizeof(c->stats));
+       occ_reset(&c->occ);
+    }
+    slave->max_bonds = max_bonds;
+    n_conns = conns;
+    tx_busy = false;
+    tx_turn = 0;
+    evq->head = evq->tail;
+    timing_reset(timing);
+    memset(&stats_none, 0, sizeof(stats_none));
+    if (spp_down == NULL && (spp_down = xSemaphoreCreateBinary()) == NULL) {
+       conns_free();
+       mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for semaphore"));
+    }
+    const char *what = "";
+    esp_err_t ret = bts_start(&what);
+    if (ret != ESP_OK) {
+       conns_free(); // SPP is not running, no callback has a connection
+       LOGE("%s failed: %s", what, esp_err_to_name(ret));
+       mp_raise_msg_varg(&mp_type_OSError, MP_ERROR_TEXT("%s failed: %s"), what, esp_err_to_name(ret));
+    }
+    slave_up = true;  // slave is up, can deinit
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(bts_init_obj, 2, bts_init);
+
+/*
+ * irq(handler=None, trigger=IRQ_RX, min_bytes=1, idle_ms=0)
+ *
+ * handler(events) is scheduled when at least min_bytes are in the pipe,
+ * or, with idle_ms, when no frame has come for idle_ms and the pipe is
+ * not empty. IRQ_CONNECT and IRQ_DISCONNECT follow ready(). A handler of
+ * None switches the IRQ off.
+ */
+STATIC mp_obj_t bts_irq(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args){
+    enum { ARG_handler, ARG_trigger, ARG_min_bytes, ARG_idle_ms };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_handler, MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_trigger, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = IRQ_RX} },
+        { MP_QSTR_min_bytes, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 1} },
+        { MP_QSTR_idle_ms, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_obj_t handler = args[ARG_handler].u_obj;
+    if (handler != mp_const_none && !mp_obj_is_callable(handler)) {
+       mp_raise_ValueError(MP_ERROR_TEXT("handler not callable"));
+    }
+    if (args[ARG_min_bytes].u_int < 1 || args[ARG_idle_ms].u_int < 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad irq args"));
+    }
+    irq_off(irq); // quiet while the settings change
+    MP_STATE_PORT(bts_irq_handler) = handler;
+    if (handler == mp_const_none) {
+       return mp_const_none;
+    }
+    irq->min_bytes = args[ARG_min_bytes].u_int;
+    irq->idle_ms = args[ARG_idle_ms].u_int;
+    if (irq->idle_ms > 0) {
+       TickType_t period = pdMS_TO_TICKS(irq->idle_ms);
+       if (period == 0) {
+          period = 1;
+       }
+       if (irq->idle == NULL) {
+          irq->idle = xTimerCreate("bts_idle", period, pdFALSE, NULL, irq_idle_cb);
+          if (irq->idle == NULL) {
+             mp_raise_msg(&mp_type_MemoryError, MP_ERROR_TEXT("no memory for idle timer"));
+          }
+       } else {
+          xTimerChangePeriod(irq->idle, period, portMAX_DELAY);
+          xTimerStop(irq->idle, portMAX_DELAY); // ChangePeriod starts it
+       }
+    }
+    irq->trigger = args[ARG_trigger].u_int & (IRQ_RX | IRQ_CONNECT | IRQ_DISCONNECT | IRQ_STATE);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(bts_irq_obj, 0, bts_irq);
+
+/*
+ * timing([reset]) -> dict
+ *
+ * rx_us/tx_us is the time from the first to the last frame, so
+ * bytes * 1000000 / us is the sustained rate. cb_cycles / rx_frames is
+ * the mean cost of ESP_SPP_DATA_IND_EVT, divide by machine.freq() / 1000000
+ * for microseconds.
+ */
+STATIC mp_obj_t bts_timing(size_t n_args, const mp_obj_t *args) {
+    timing_data_t d;
+    portENTER_CRITICAL(&timing->lock);
+    d = timing->d;
+    portEXIT_CRITICAL(&timing->lock);
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       timing_reset(timing);
+    }
+    mp_obj_t dict = mp_obj_new_dict(8);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_frames), mp_obj_new_int_from_uint(d.rx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_bytes), mp_obj_new_int_from_uint(d.rx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_us), mp_obj_new_int_from_uint(d.rx_last - d.rx_first));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cb_cycles), mp_obj_new_int_from_ull(d.cb_cycles));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cb_max), mp_obj_new_int_from_uint(d.cb_max));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_frames), mp_obj_new_int_from_uint(d.tx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_bytes), mp_obj_new_int_from_uint(d.tx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_us), mp_obj_new_int_from_uint(d.tx_last - d.tx_first));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_timing_obj, 0, 1, bts_timing);
+
+/*
+ * Connection given as the optional argument at pos, connection 0 when it
+ * is left out, which is the only one unless init() got conns > 1.
+ */
+static conn_obj_t *conn_arg(size_t n_args, const mp_obj_t *args, size_t pos) {
+    int id = (n_args > pos) ? mp_obj_get_int(args[pos]) : 0;
+    if (id < 0 || id >= n_conns) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad connection id"));
+    }
+    return &conn[id];
+}
+
+/*
+ * stats([reset[, id]]) -> dict of link counters, see stats_obj_t, for
+ * connection id, or the total over all of them when id is left out.
+ */
+STATIC mp_obj_t bts_stats(size_t n_args, const mp_obj_t *args) {
+    bool reset = n_args > 0 && mp_obj_is_true(args[0]);
+    int first = 0;
+    int last = n_conns - 1;
+    stats_obj_t s = { 0 };
+    if (n_args > 1) {
+       first = last = conn_arg(n_args, args, 1) - conn;
+    } else {
+       stats_add(&s, &stats_none);
+       if (reset) {
+          memset(&stats_none, 0, sizeof(stats_none));
+       }
+    }
+    uint32_t held = 0;
+    uint32_t resyncs = 0;
+    for (int i = first; i <= last; i++) {
+       conn_obj_t *c = &conn[i];
+       stats_add(&s, &c->stats);
+       s.tx_failed += c->txq.refused;
+       held += c->pipe.held;
+       resyncs += c->pipe.resyncs;
+       if (reset) {
+          memset(&c->stats, 0, sizeof(c->stats));
+          c->txq.refused = 0;
+          c->pipe.held = 0;
+          c->pipe.resyncs = 0;
+       }
+    }
+    mp_obj_t dict = mp_obj_new_dict(13);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_frames), mp_obj_new_int_from_uint(s.rx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_bytes), mp_obj_new_int_from_uint(s.rx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_dropped), mp_obj_new_int_from_uint(s.rx_dropped));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_held), mp_obj_new_int_from_uint(held));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_rx_resync), mp_obj_new_int_from_uint(resyncs));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_frames), mp_obj_new_int_from_uint(s.tx_frames));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_bytes), mp_obj_new_int_from_uint(s.tx_bytes));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_tx_failed), mp_obj_new_int_from_uint(s.tx_failed));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cong_on), mp_obj_new_int_from_uint(s.cong_on));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cong_off), mp_obj_new_int_from_uint(s.cong_off));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_connects), mp_obj_new_int_from_uint(s.connects));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_disconnects), mp_obj_new_int_from_uint(s.disconnects));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_auth_failed), mp_obj_new_int_from_uint(s.auth_failed));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_stats_obj, 0, 2, bts_stats);
+
+/*
+ * occupancy([reset[, id]]) -> dict of connection id with size, peak,
+ * threshold (the flow high watermark), above_us and hist, a list of
+ * OCC_BINS sample counts.
+ */
+STATIC mp_obj_t bts_occupancy(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 1);
+    occ_data_t d;
+    uint32_t now = mp_hal_ticks_us();
+    portENTER_CRITICAL(&c->occ.lock);
+    d = c->occ.d;
+    portEXIT_CRITICAL(&c->occ.lock);
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       occ_reset(&c->occ);
+    }
+    if (d.above) {
+       d.above_us += now - d.above_since; // still above
+    }
+    mp_obj_t hist[OCC_BINS];
+    for (int i = 0; i < OCC_BINS; i++) {
+       hist[i] = mp_obj_new_int_from_uint(d.hist[i]);
+    }
+    mp_obj_t dict = mp_obj_new_dict(5);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_size), mp_obj_new_int_from_uint(c->pipe.size));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_peak), mp_obj_new_int_from_uint(d.peak));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_threshold), mp_obj_new_int_from_uint(c->pipe.high));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_above_us), mp_obj_new_int_from_ull(d.above_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_hist), mp_obj_new_list(OCC_BINS, hist));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_occupancy_obj, 0, 2, bts_occupancy);
+
+#if BT_SPP_TRACE >= 1
+/*
+ * trace([reset]) -> bytes, the trace records kept, oldest first. Decode
+ * them with tools/bt_spp_trace.py.
+ */
+STATIC mp_obj_t bts_trace(size_t n_args, const mp_obj_t *args) {
+    vstr_t vstr;
+    vstr_init_len(&vstr, sizeof(trace->rec));
+    trace_rec_t *out = (trace_rec_t *) vstr.buf;
+    portENTER_CRITICAL(&trace->lock);
+    uint32_t count = trace->count;
+    uint32_t first = (count > TRACE_LEN) ? count - TRACE_LEN : 0;
+    for (uint32_t i = first; i != count; i++) {
+       out[i - first] = trace->rec[i % TRACE_LEN];
+    }
+    if (n_args > 0 && mp_obj_is_true(args[0])) {
+       trace->count = 0;
+    }
+    portEXIT_CRITICAL(&trace->lock);
+    vstr.len = (count - first) * sizeof(trace_rec_t);
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_trace_obj, 0, 1, bts_trace);
+#endif
+
+STATIC mp_obj_t bts_data(size_t n_args, const mp_obj_t *args) {
+    return mp_obj_new_int(pipe_count(&conn_arg(n_args, args, 0)->pipe));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_data_obj, 0, 1, bts_data);
+
+static mp_obj_t bts_get(size_t n_args, const mp_obj_t *args, const mp_obj_type_t *type) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    int count = mp_obj_get_int(args[0]);
+    int avail = pipe_count(p);
+    if (count > avail) {
+       count = avail;
+    }
+    if (count > 0) {
+       // read straight into the new object, no copy on the stack
+       vstr_t vstr;
+       vstr_init_len(&vstr, count);
+       vstr.len = pipe_get(p, (uint8_t *) vstr.buf, count);
+       return mp_obj_new_str_from_vstr(type, &vstr);
+    }
+    return mp_const_none; // count<=0 or empty pipe
+}
+
+STATIC mp_obj_t bts_get_str(size_t n_args, const mp_obj_t *args) {
+    return bts_get(n_args, args, &mp_type_str);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_get_str_obj, 1, 2, bts_get_str);
+
+STATIC mp_obj_t bts_get_bin(size_t n_args, const mp_obj_t *args) {
+    return bts_get(n_args, args, &mp_type_bytes);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_get_bin_obj, 1, 2, bts_get_bin);
+
+STATIC mp_obj_t bts_readinto(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 2)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_WRITE);
+    int count = bufinfo.len;
+    if (n_args > 1) {
+       int n = mp_obj_get_int(args[1]);
+       if (n < count) {
+          count = n;
+       }
+    }
+    if (count <= 0) {
+       return MP_OBJ_NEW_SMALL_INT(0);
+    }
+    // no allocation, the caller's buffer is filled from the pipe
+    return mp_obj_new_int(pipe_get(p, bufinfo.buf, count));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_readinto_obj, 1, 3, bts_readinto);
+
+/* one complete message as bytes, None if no message is complete yet */
+STATIC mp_obj_t bts_get_msg(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 0)->pipe;
+    if (p->framing == FRAME_NONE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("no framing"));
+    }
+    while (atomic_load_explicit(&p->msgs, memory_order_acquire) != atomic_load(&p->msgs_read)) {
+       vstr_t vstr;
+       atomic_fetch_add(&p->msgs_read, 1);
+       if (p->framing == FRAME_LEN) {
+          uint8_t hdr[2];
+          pipe_get(p, hdr, 2);
+          vstr_init_len(&vstr, (hdr[0] << 8) | hdr[1]);
+          pipe_get(p, (uint8_t *) vstr.buf, vstr.len);
+       } else {
+          static const uint8_t delim = 0;
+          int len = pipe_find(p, &delim, 1) + 1; // with the delimiter
+          vstr_init_len(&vstr, len);
+          pipe_get(p, (uint8_t *) vstr.buf, len);
+          len = cobs_decode((uint8_t *) vstr.buf, len - 1);
+          if (len < 0) {
+             vstr_clear(&vstr); // corrupted on the way in, skip it
+             continue;
+          }
+          vstr.len = len;
+       }
+       if (pipe_drains(p) == false) {
+          pipe_wake(p); // a frame held back for room waits for nothing now
+       }
+       return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+    }
+    if (p->size > 0 && pipe_count(p) == p->size) {
+       // full and no whole message: it can never fit, esp_spp_cb drops it
+       atomic_store(&p->resync, true);
+       pipe_wake(p);
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_get_msg_obj, 0, 1, bts_get_msg);
+
+/*
+ * Everything up to and including delim as an object of the given type,
+ * None while delim has not arrived. A full pipe without delim is handed
+ * over as it is, otherwise nothing more could ever come in.
+ */
+static mp_obj_t bts_take_until(pipe_obj_t *p, const uint8_t *delim, int dlen, const mp_obj_type_t *type) {
+    if (dlen <= 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("empty delimiter"));
+    }
+    int len = pipe_find(p, delim, dlen);
+    if (len >= 0) {
+       len += dlen;
+    } else if (p->size > 0 && pipe_count(p) == p->size) {
+       len = p->size;
+    } else {
+       return mp_const_none;
+    }
+    vstr_t vstr;
+    vstr_init_len(&vstr, len);
+    pipe_get(p, (uint8_t *) vstr.buf, len);
+    return mp_obj_new_str_from_vstr(type, &vstr);
+}
+
+/* one line as str, ending with a newline, None until a whole line is in */
+STATIC mp_obj_t bts_readline(size_t n_args, const mp_obj_t *args) {
+    return bts_take_until(&conn_arg(n_args, args, 0)->pipe, (const uint8_t *) "\n", 1, &mp_type_str);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_readline_obj, 0, 1, bts_readline);
+
+/* read_until(delim[, id]) -> str if delim is a str, else bytes */
+STATIC mp_obj_t bts_read_until(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    return bts_take_until(p, bufinfo.buf, bufinfo.len, mp_obj_is_str(args[0]) ? &mp_type_str : &mp_type_bytes);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_read_until_obj, 1, 2, bts_read_until);
+
+/* find(delim[, id]) -> offset of delim in the buffer or -1, nothing is read */
+STATIC mp_obj_t bts_find(size_t n_args, const mp_obj_t *args) {
+    pipe_obj_t *p = &conn_arg(n_args, args, 1)->pipe;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    if (bufinfo.len == 0) {
+       mp_raise_ValueError(MP_ERROR_TEXT("empty delimiter"));
+    }
+    return mp_obj_new_int(pipe_find(p, bufinfo.buf, bufinfo.len));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_find_obj, 1, 2, bts_find);
+
+
+/*
+ * Queue len bytes as MTU sized frames on connection c, copying one frame
+ * at a time as slots free up. Each wait for a free slot is bounded by
+ * timeout_ms. Returns the number of bytes queued.
+ */
+static size_t bts_write(conn_obj_t *c, const uint8_t *data, size_t len, int timeout_ms)
+{
+    size_t queued = 0;
+    while (queued < len && c->ready == true) {
+       int n = len - queued;
+       if (n > SPP_DATA_LEN) {
+          n = SPP_DATA_LEN;
+       }
+       if (txq_put(&c->txq, data + queued, n, timeout_ms) == false) {
+          break;
+       }
+       txq_kick(); // start sending while the rest is cut up
+       queued += n;
+    }
+    return queued;
+}
+
+/*
+ * send_str/send_bin(data[, timeout_ms[, id]]) -> number of bytes queued
+ *
+ * When a wait for a free slot runs out the bytes queued so far are
+ * returned, OSError is raised only if nothing could be queued.
+ */
+STATIC mp_obj_t bts_send(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 2);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    int timeout_ms = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    if (c->ready == false) {
+       return mp_const_none;
+    }
+    size_t queued = bts_write(c, bufinfo.buf, bufinfo.len, timeout_ms);
+    if (queued == 0 && bufinfo.len > 0) {
+       mp_raise_OSError(timeout_ms > 0 ? MP_ETIMEDOUT : MP_ENOBUFS);
+    }
+    return mp_obj_new_int(queued);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_send_str_obj, 1, 3, bts_send);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_send_bin_obj, 1, 3, bts_send);
+
+/*
+ * send_msg(data[, timeout_ms[, id]]) frames data as set at init() and
+ * queues it. A message is queued whole or not at all when there is no
+ * timeout; if a timeout runs out half way OSError ETIMEDOUT is raised, and
+ * the receiver only gets back in step at the next COBS delimiter.
+ */
+STATIC mp_obj_t bts_send_msg(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 2);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    int timeout_ms = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    if (c->pipe.framing == FRAME_NONE) {
+       mp_raise_ValueError(MP_ERROR_TEXT("no framing"));
+    }
+    if (c->ready == false) {
+       return mp_const_none;
+    }
+    vstr_t vstr;
+    if (c->pipe.framing == FRAME_LEN) {
+       if (bufinfo.len > FRAME_MAX_LEN) {
+          mp_raise_ValueError(MP_ERROR_TEXT("message too long"));
+       }
+       vstr_init_len(&vstr, bufinfo.len + 2);
+       vstr.buf[0] = bufinfo.len >> 8;
+       vstr.buf[1] = bufinfo.len & 0xFF;
+       memcpy(vstr.buf + 2, bufinfo.buf, bufinfo.len);
+    } else {
+       vstr_init_len(&vstr, bufinfo.len + bufinfo.len / 254 + 2);
+       vstr.len = cobs_encode(bufinfo.buf, bufinfo.len, (uint8_t *) vstr.buf);
+    }
+    if (vstr.len > c->pipe.size) {
+       // the peer drops a message bigger than its rxbuf, both ends use the same
+       vstr_clear(&vstr);
+       mp_raise_ValueError(MP_ERROR_TEXT("message too long for rxbuf"));
+    }
+    if (timeout_ms <= 0 && txq_room(&c->txq) < (vstr.len + SPP_DATA_LEN - 1) / SPP_DATA_LEN) {
+       vstr_clear(&vstr);
+       mp_raise_OSError(MP_ENOBUFS);
+    }
+    size_t queued = bts_write(c, (uint8_t *) vstr.buf, vstr.len, timeout_ms);
+    size_t framed = vstr.len;
+    vstr_clear(&vstr);
+    if (queued < framed) {
+       mp_raise_OSError(MP_ETIMEDOUT);
+    }
+    return mp_obj_new_int(bufinfo.len);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_send_msg_obj, 1, 3, bts_send_msg);
+
+/* the handle is let go of at ESP_SPP_CLOSE_EVT, the slot stays taken till then */
+static void bts_close_conn(conn_obj_t *c) {
+    if (c->ready == true) {
+       esp_spp_disconnect(c->handle);
+       c->ready = false;
+       conn_state(c, ST_CLOSING);
+    }
+}
+
+STATIC mp_obj_t bts_close(size_t n_args, const mp_obj_t *args) {
+    bts_close_conn(conn_arg(n_args, args, 0));
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_close_obj, 0, 1, bts_close);
+
+STATIC mp_obj_t bts_ready(size_t n_args, const mp_obj_t *args) {
+     return mp_obj_new_bool(conn_arg(n_args, args, 0)->ready);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_ready_obj, 0, 1, bts_ready);
+
+/* conns() -> list of the ids of the connections that are open */
+STATIC mp_obj_t bts_conns() {
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < n_conns; i++) {
+       if (conn[i].ready == true) {
+          mp_obj_list_append(list, MP_OBJ_NEW_SMALL_INT(i));
+       }
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(bts_conns_obj, bts_conns);
+
+static const qstr st_names[] = {
+    MP_QSTR_idle, MP_QSTR_discoverable, MP_QSTR_authenticating, MP_QSTR_connected, MP_QSTR_closing,
+};
+
+/*
+ * state([id]) -> 'idle' (not up), 'discoverable' (free, a master can
+ * connect), 'authenticating' (a master is pairing), 'connected' or
+ * 'closing' (close() called).
+ */
+STATIC mp_obj_t bts_state(size_t n_args, const mp_obj_t *args) {
+    return MP_OBJ_NEW_QSTR(st_names[conn_arg(n_args, args, 0)->state]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_state_obj, 0, 1, bts_state);
+
+/*
+ * events() -> list of (id, state, address, ticks_ms) for the state changes
+ * since the last call, oldest first. At most 16 are kept. IRQ_STATE fires
+ * when one is queued.
+ */
+STATIC mp_obj_t bts_events() {
+    ev_t e[EVQ_LEN];
+    int n = 0;
+    portENTER_CRITICAL(&evq->lock);
+    while (evq->head != evq->tail) {
+       e[n++] = evq->e[evq->head++ % EVQ_LEN];
+    }
+    portEXIT_CRITICAL(&evq->lock);
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < n; i++) {
+       mp_obj_t t[4] = {
+          MP_OBJ_NEW_SMALL_INT(e[i].id),
+          MP_OBJ_NEW_QSTR(st_names[e[i].state]),
+          addr_str(e[i].addr),
+          mp_obj_new_int_from_uint(e[i].ms),
+       };
+       mp_obj_list_append(list, mp_obj_new_tuple(4, t));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(bts_events_obj, bts_events);
+
+STATIC mp_obj_t bts_up(){
+     return mp_obj_new_bool(slave_up);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(bts_up_obj, bts_up);
+
+/*
+ * deinit([warm]) takes SPP and Bluetooth down. With warm=True the
+ * controller and Bluedroid stay up and only SPP stops, the device is no
+ * longer connectable or discoverable, and the next init() only restarts
+ * SPP. deinit() after that takes the rest down.
+ */
+STATIC mp_obj_t bts_deinit(size_t n_args, const mp_obj_t *args){
+    bool warm = n_args > 0 && mp_obj_is_true(args[0]);
+    if (slave_up == false) {
+       if (warm || stack_is_down()) {
+          return mp_const_false;
+       }
+       stack_down(); // left up by deinit(True)
+       return mp_const_true;
+    }
+    for (int i = 0; i < n_conns; i++) {
+       conn[i].pipe.flow = false; // a callback held back in flow mode must not stall the teardown
+       pipe_wake(&conn[i].pipe);
+    }
+    irq_off(irq);
+    MP_STATE_PORT(bts_irq_handler) = mp_const_none;
+    xSemaphoreTake(spp_down, 0); // not a give left from before
+    if (esp_spp_deinit() == ESP_OK) {
+       MP_THREAD_GIL_EXIT();
+       xSemaphoreTake(spp_down, pdMS_TO_TICKS(SPP_DOWN_MS));
+       MP_THREAD_GIL_ENTER();
+    }
+    if (warm) {
+       esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+    } else {
+       stack_down();
+    }
+    conns_free(); // no more callbacks, safe to let go of the buffers
+    tx_busy = false;
+    slave_up = false;  // can do init
+    return mp_const_true;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_deinit_obj, 0, 1, bts_deinit);
+
+/*
+ * init_time() -> dict of how long each stage of the last init() took, in
+ * us: nvs_us, controller_us, bluedroid_us, spp_us and start_us (name, scan
+ * mode, PIN, the server). warm is True if Bluedroid was up already, from
+ * deinit(True) or from btm, then only spp_us and start_us count.
+ */
+STATIC mp_obj_t bts_init_time() {
+    static const qstr keys[INIT_STAGES] = {
+        MP_QSTR_nvs_us, MP_QSTR_controller_us, MP_QSTR_bluedroid_us, MP_QSTR_spp_us, MP_QSTR_start_us,
+    };
+    mp_obj_t dict = mp_obj_new_dict(INIT_STAGES + 1);
+    for (int i = 0; i < INIT_STAGES; i++) {
+       mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(keys[i]), mp_obj_new_int_from_uint(init_time->us[i]));
+    }
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_warm), mp_obj_new_bool(init_time->warm));
+    return dict;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(bts_init_time_obj, bts_init_time);
+
+/*
+ * bts.stream([id]) hands out a connection as a stream object, so it can be
+ * given to uselect.poll, os.dupterm and the stream methods. It is a view
+ * on the connection's pipe and transmit queue, there is one per
+ * connection. Nothing blocks: an empty pipe reads as EAGAIN (None from
+ * read()), or as EOF once the connection is gone, and a full transmit
+ * queue writes as EAGAIN.
+ */
+typedef struct _bts_stream_obj_t {
+    mp_obj_base_t base;
+    int id;
+} bts_stream_obj_t;
+
+STATIC const mp_obj_type_t bts_stream_type;
+STATIC const bts_stream_obj_t bts_stream_obj[MAX_CONNS] = {
+    { { &bts_stream_type }, 0 },
+    { { &bts_stream_type }, 1 },
+    { { &bts_stream_type }, 2 },
+    { { &bts_stream_type }, 3 },
+};
+
+STATIC mp_uint_t bts_stream_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode) {
+    bts_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (slave_up == false || self->id >= n_conns) {
+       *errcode = MP_ENODEV;
+       return MP_STREAM_ERROR;
+    }
+    conn_obj_t *c = &conn[self->id];
+    int count = pipe_get(&c->pipe, buf, size);
+    if (count == 0 && size > 0 && c->ready == true) {
+       *errcode = MP_EAGAIN;
+       return MP_STREAM_ERROR;
+    }
+    return count; // 0 with no connection is EOF
+}
+
+STATIC mp_uint_t bts_stream_write(mp_obj_t self_in, const void *buf, mp_uint_t size, int *errcode) {
+    bts_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (slave_up == false || self->id >= n_conns || conn[self->id].ready == false) {
+       *errcode = MP_ENOTCONN;
+       return MP_STREAM_ERROR;
+    }
+    size_t queued = bts_write(&conn[self->id], buf, size, 0);
+    if (queued == 0 && size > 0) {
+       *errcode = MP_EAGAIN;
+       return MP_STREAM_ERROR;
+    }
+    return queued;
+}
+
+STATIC mp_uint_t bts_stream_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    bts_stream_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if (request == MP_STREAM_POLL) {
+       if (slave_up == false || self->id >= n_conns) {
+          return MP_STREAM_POLL_NVAL;
+       }
+       conn_obj_t *c = &conn[self->id];
+       mp_uint_t ret = 0;
+       if ((arg & MP_STREAM_POLL_RD) && pipe_count(&c->pipe) > 0) {
+          ret |= MP_STREAM_POLL_RD;
+       }
+       if ((arg & MP_STREAM_POLL_WR) && c->ready == true && txq_room(&c->txq) > 0) {
+          ret |= MP_STREAM_POLL_WR;
+       }
+       return ret;
+    } else if (request == MP_STREAM_CLOSE) {
+       if (slave_up == true && self->id < n_conns) {
+          bts_close_conn(&conn[self->id]);
+       }
+       return 0;
+    } else if (request == MP_STREAM_FLUSH) {
+       return 0; // queued frames go out from esp_spp_cb on their own
+    }
+    *errcode = MP_EINVAL;
+    return MP_STREAM_ERROR;
+}
+
+STATIC const mp_stream_p_t bts_stream_p = {
+    .read = bts_stream_read,
+    .write = bts_stream_write,
+    .ioctl = bts_stream_ioctl,
+    .is_text = false,
+};
+
+STATIC const mp_rom_map_elem_t bts_stream_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&mp_stream_unbuffered_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mp_stream_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
+    { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&mp_stream___exit___obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(bts_stream_locals_dict, bts_stream_locals_dict_table);
+
+STATIC MP_DEFINE_CONST_OBJ_TYPE(
+    bts_stream_type,
+    MP_QSTR_bts_stream,
+    MP_TYPE_FLAG_ITER_IS_STREAM,
+    protocol, &bts_stream_p,
+    locals_dict, &bts_stream_locals_dict
+    );
+
+STATIC mp_obj_t bts_stream(size_t n_args, const mp_obj_t *args) {
+    conn_obj_t *c = conn_arg(n_args, args, 0);
+    return MP_OBJ_FROM_PTR(&bts_stream_obj[c - conn]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_stream_fun_obj, 0, 1, bts_stream);
+
+/* bonds() -> list of the addresses of the bonded peers, most recently used first */
+STATIC mp_obj_t bts_bonds() {
+    esp_bd_addr_t addr[BOND_MAX + 1];
+    portENTER_CRITICAL(&bond->lock);
+    int count = bond->count;
+    memcpy(addr, bond->addr, sizeof(addr));
+    portEXIT_CRITICAL(&bond->lock);
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (int i = 0; i < count; i++) {
+       mp_obj_list_append(list, addr_str(addr[i]));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(bts_bonds_obj, bts_bonds);
+
+/* unbond([addr]) forgets the link key of one peer, or of all of them */
+STATIC mp_obj_t bts_unbond(size_t n_args, const mp_obj_t *args) {
+    if (slave_up == false) {
+       mp_raise_OSError(MP_ENODEV);
+    }
+    if (n_args == 0 || args[0] == mp_const_none) {
+       bond_remove(bond, NULL);
+       return mp_const_none;
+    }
+    esp_bd_addr_t addr;
+    if (addr_parse(args[0], addr) == false) {
+       mp_raise_ValueError(MP_ERROR_TEXT("bad address"));
+    }
+    bond_remove(bond, addr);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(bts_unbond_obj, 0, 1, bts_unbond);
+
+STATIC const mp_rom_map_elem_t bts_module_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_bts) },
+    { MP_ROM_QSTR(MP_QSTR_init), MP_ROM_PTR(&bts_init_obj) },
+    { MP_ROM_QSTR(MP_QSTR_up), MP_ROM_PTR(&bts_up_obj) },
+    { MP_ROM_QSTR(MP_QSTR_data), MP_ROM_PTR(&bts_data_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_str), MP_ROM_PTR(&bts_get_str_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_bin), MP_ROM_PTR(&bts_get_bin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&bts_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_get_msg), MP_ROM_PTR(&bts_get_msg_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&bts_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read_until), MP_ROM_PTR(&bts_read_until_obj) },
+    { MP_ROM_QSTR(MP_QSTR_find), MP_ROM_PTR(&bts_find_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_str), MP_ROM_PTR(&bts_send_str_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_bin), MP_ROM_PTR(&bts_send_bin_obj) },
+    { MP_ROM_QSTR(MP_QSTR_send_msg), MP_ROM_PTR(&bts_send_msg_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&bts_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR_ready), MP_ROM_PTR(&bts_ready_obj) },
+    { MP_ROM_QSTR(MP_QSTR_conns), MP_ROM_PTR(&bts_conns_obj) },
+    { MP_ROM_QSTR(MP_QSTR_state), MP_ROM_PTR(&bts_state_obj) },
+    { MP_ROM_QSTR(MP_QSTR_events), MP_ROM_PTR(&bts_events_obj) },
+    { MP_ROM_QSTR(MP_QSTR_deinit), MP_ROM_PTR(&bts_deinit_obj) },
+    { MP_ROM_QSTR(MP_QSTR_init_time), MP_ROM_PTR(&bts_init_time_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stream), MP_ROM_PTR(&bts_stream_fun_obj) },
+    { MP_ROM_QSTR(MP_QSTR_irq), MP_ROM_PTR(&bts_irq_obj) },
+    { MP_ROM_QSTR(MP_QSTR_timing), MP_ROM_PTR(&bts_timing_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&bts_stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_bonds), MP_ROM_PTR(&bts_bonds_obj) },
+    { MP_ROM_QSTR(MP_QSTR_unbond), MP_ROM_PTR(&bts_unbond_obj) },
+    { MP_ROM_QSTR(MP_QSTR_occupancy), MP_ROM_PTR(&bts_occupancy_obj) },
+#if BT_SPP_TRACE >= 1
+    { MP_ROM_QSTR(MP_QSTR_trace), MP_ROM_PTR(&bts_trace_obj) },
+#endif
+    { MP_ROM_QSTR(MP_QSTR_FRAME_NONE), MP_ROM_INT(FRAME_NONE) },
+    { MP_ROM_QSTR(MP_QSTR_FRAME_LEN), MP_ROM_INT(FRAME_LEN) },
+    { MP_ROM_QSTR(MP_QSTR_FRAME_COBS), MP_ROM_INT(FRAME_COBS) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_RX), MP_ROM_INT(IRQ_RX) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_CONNECT), MP_ROM_INT(IRQ_CONNECT) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_DISCONNECT), MP_ROM_INT(IRQ_DISCONNECT) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_STATE), MP_ROM_INT(IRQ_STATE) },
+    { MP_ROM_QSTR(MP_QSTR_TRACE), MP_ROM_INT(BT_SPP_TRACE) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(bts_module_globals, bts_module_globals_table);
+
+const mp_obj_module_t mp_module_bts = {
+    .base = { &mp_type_module },
+    .globals = (mp_obj_dict_t*)&bts_module_globals,
+};
+
+MP_REGISTER_MODULE(MP_QSTR_bts, mp_module_bts);
+MP_REGISTER_ROOT_POINTER(mp_obj_t bts_irq_handler);
+
+
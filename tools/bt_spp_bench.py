@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""
+Benchmark a bts/btm pair and write the results as JSON.
+
+Two boards are needed, each on its own serial port, with mpremote on the
+host. The slave echoes everything back; the master opens it, then
+
+- sends --count messages of --size bytes one at a time and times each
+  round trip with ticks_us, which gives the latency percentiles,
+- times send_bin() and readinto() with ticks_cpu around each call,
+  which gives the cost of a call in CPU cycles,
+- streams --bulk bytes in frames of one MTU while reading the echo,
+  which gives the throughput.
+
+    python3 bt_spp_bench.py --slave /dev/ttyUSB0 --master /dev/ttyUSB1 \\
+        -o bench.json
+
+The JSON also has timing() and stats() from both ends and connect_time()
+from the master, so two firmware builds can be compared file by file.
+Both ends run with flow=True, so an echo never drops data.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+import time
+
+# runs on the slave, until the master closes the connection
+SLAVE = '''
+import bts, time, json
+bts.init(%(name)r, %(pin)r, rxbuf=%(rxbuf)d, flow=True)
+while not bts.ready():
+    time.sleep_ms(10)
+bts.timing(True)
+bts.stats(True)
+buf = bytearray(990)
+mv = memoryview(buf)
+while bts.ready():
+    n = bts.readinto(buf)
+    if n:
+        bts.send_bin(mv[:n], 1000)
+with open('bench_slave.json', 'w') as f:
+    json.dump({'timing': bts.timing(), 'stats': bts.stats()}, f)
+bts.deinit()
+'''
+
+# runs on the master, prints one line of JSON at the end
+MASTER = '''
+import btm, time, json, machine
+btm.init('BENCH-M', rxbuf=%(rxbuf)d, flow=True)
+t = time.ticks_ms()
+btm.open(%(name)r, %(pin)r, 40000)
+r = {'freq': machine.freq(), 'open_ms': time.ticks_diff(time.ticks_ms(), t),
+     'connect': btm.connect_time()}
+msg = bytes(i & 255 for i in range(%(size)d))
+rx = bytearray(990)
+btm.timing(True)
+btm.stats(True)
+
+def drain(want, got, ms):
+    # read the echo until want bytes are back or nothing came for ms
+    last = time.ticks_ms()
+    while got < want and time.ticks_diff(time.ticks_ms(), last) < ms:
+        n = btm.readinto(rx)
+        if n:
+            got += n
+            last = time.ticks_ms()
+    return got
+
+lat = []
+send_cyc = []
+get_cyc = []
+for i in range(%(count)d):
+    t = time.ticks_us()
+    c = time.ticks_cpu()
+    btm.send_bin(msg, 1000)
+    send_cyc.append(time.ticks_diff(time.ticks_cpu(), c))
+    got = 0
+    last = time.ticks_ms()
+    while got < %(size)d and time.ticks_diff(time.ticks_ms(), last) < 2000:
+        c = time.ticks_cpu()
+        n = btm.readinto(rx, %(size)d - got)
+        c = time.ticks_diff(time.ticks_cpu(), c)
+        if n:
+            get_cyc.append(c)
+            got += n
+    if got < %(size)d:
+        r['lost'] = i
+        break
+    lat.append(time.ticks_diff(time.ticks_us(), t))
+r['latency_us'] = lat
+r['send_cycles'] = send_cyc
+r['readinto_cycles'] = get_cyc
+
+frame = bytes(i & 255 for i in range(990))
+sent = got = 0
+t = time.ticks_us()
+while sent < %(bulk)d:
+    n = min(990, %(bulk)d - sent)
+    sent += btm.send_bin(frame[:n], 1000)
+    n = btm.readinto(rx)
+    while n:
+        got += n
+        n = btm.readinto(rx)
+got = drain(sent, got, 2000)
+r['bulk'] = {'bytes': sent, 'echoed': got, 'us': time.ticks_diff(time.ticks_us(), t)}
+r['timing'] = btm.timing()
+r['stats'] = btm.stats()
+btm.close(0)
+btm.deinit()
+print('BENCH ' + json.dumps(r))
+'''
+
+
+def mpremote(args, port, *cmd, capture=False):
+    run = [args.mpremote, 'connect', port] + list(cmd)
+    p = subprocess.run(run, stdout=subprocess.PIPE if capture else None,
+                       universal_newlines=True)
+    if p.returncode:
+        sys.exit('%s failed with %d' % (' '.join(run[:4]), p.returncode))
+    return p.stdout
+
+
+def percentiles(values):
+    if not values:
+        return {}
+    s = sorted(values)
+    pick = lambda q: s[min(len(s) - 1, int(q * len(s)))]
+    return {'n': len(s), 'min': s[0], 'p50': pick(0.50), 'p90': pick(0.90),
+            'p99': pick(0.99), 'max': s[-1], 'mean': sum(s) / len(s)}
+
+
+def report(m, slave, args):
+    mhz = m['freq'] / 1e6
+    bulk = m['bulk']
+    out = {
+        'config': {'name': args.name, 'size': args.size, 'count': args.count,
+                   'bulk': args.bulk, 'rxbuf': args.rxbuf, 'cpu_mhz': mhz},
+        'open_ms': m['open_ms'],
+        'connect': m['connect'],
+        'latency_us': percentiles(m['latency_us']),
+        'throughput': {
+            'bytes': bulk['bytes'],
+            'echoed': bulk['echoed'],
+            'us': bulk['us'],
+            # each byte goes there and back, so this is the rate each way
+            'bytes_per_s': bulk['echoed'] * 1e6 / bulk['us'] if bulk['us'] else 0,
+        },
+        'call_cycles': {
+            'send_bin': percentiles(m['send_cycles']),
+            'readinto': percentiles(m['readinto_cycles']),
+        },
+        'master': {'timing': m['timing'], 'stats': m['stats']},
+        'slave': slave,
+    }
+    for name, c in out['call_cycles'].items():
+        if c:
+            c['mean_us'] = c['mean'] / mhz
+    if 'lost' in m:
+        out['lost_at'] = m['lost']
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split('\n\n')[0].strip())
+    ap.add_argument('--slave', required=True, help='serial port of the bts board')
+    ap.add_argument('--master', required=True, help='serial port of the btm board')
+    ap.add_argument('--name', default='BENCH-S', help='slave name (default BENCH-S)')
+    ap.add_argument('--pin', default='1234', help='pairing PIN (default 1234)')
+    ap.add_argument('--size', type=int, default=64, help='latency message size (default 64)')
+    ap.add_argument('--count', type=int, default=200, help='latency round trips (default 200)')
+    ap.add_argument('--bulk', type=int, default=256 * 1024, help='bytes streamed (default 256 KiB)')
+    ap.add_argument('--rxbuf', type=int, default=4096, help='rxbuf on both ends (default 4096)')
+    ap.add_argument('--mpremote', default='mpremote', help='mpremote command')
+    ap.add_argument('-o', '--out', help='write the JSON here instead of stdout')
+    args = ap.parse_args()
+    if not 0 < args.size <= 990:
+        ap.error('--size must be 1..990, one frame')
+
+    v = vars(args)
+    mpremote(args, args.slave, 'exec', '--no-follow', SLAVE % v)
+    time.sleep(2)  # let the slave become discoverable
+    out = mpremote(args, args.master, 'exec', MASTER % v, capture=True)
+    line = [l for l in out.splitlines() if l.startswith('BENCH ')]
+    if not line:
+        sys.exit('no result from the master:\n' + out)
+    m = json.loads(line[-1][6:])
+
+    time.sleep(1)  # the slave writes its figures once the link is gone
+    slave = json.loads(mpremote(args, args.slave, 'fs', 'cat', ':bench_slave.json', capture=True))
+
+    text = json.dumps(report(m, slave, args), indent=2, sort_keys=True)
+    if args.out:
+        with open(args.out, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print(text)
+
+
+if __name__ == '__main__':
+    main()
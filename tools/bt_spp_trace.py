@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""
+Decode a bts/btm event trace into a timeline.
+
+The firmware must be built with BT_SPP_TRACE=1 or 2. On the board, save
+the trace to a file:
+
+    import bts
+    with open('trace.bin', 'wb') as f:
+        f.write(bts.trace())
+
+copy trace.bin to the host (mpremote cp :trace.bin .) and run
+
+    python3 bt_spp_trace.py trace.bin
+
+Each record is 8 bytes little-endian: time in us, source (0 SPP, 1 GAP),
+event number and one argument (length, congestion flag or status).
+Event numbers are those of ESP-IDF 4.4, unknown ones are shown as numbers.
+"""
+
+import argparse
+import struct
+import sys
+
+REC = struct.Struct('<IBBH')
+
+SPP_EVENTS = {
+    0: 'INIT',
+    1: 'UNINIT',
+    8: 'DISCOVERY_COMP',
+    26: 'OPEN',
+    27: 'CLOSE',
+    28: 'START',
+    29: 'CL_INIT',
+    30: 'DATA_IND',
+    31: 'CONG',
+    33: 'WRITE',
+    34: 'SRV_OPEN',
+    35: 'SRV_STOP',
+    36: 'VFS_REGISTER',
+    37: 'VFS_UNREGISTER',
+}
+
+GAP_EVENTS = {
+    0: 'DISC_RES',
+    1: 'DISC_STATE_CHANGED',
+    2: 'RMT_SRVCS',
+    3: 'RMT_SRVC_REC',
+    4: 'AUTH_CMPL',
+    5: 'PIN_REQ',
+    6: 'CFM_REQ',
+    7: 'KEY_NOTIF',
+    8: 'KEY_REQ',
+    9: 'READ_RSSI_DELTA',
+    10: 'CONFIG_EIR_DATA',
+    11: 'SET_AFH_CHANNELS',
+    12: 'READ_REMOTE_NAME',
+    13: 'MODE_CHG',
+    14: 'REMOVE_BOND_DEV_COMPLETE',
+    15: 'QOS_CMPL',
+    16: 'ACL_CONN_CMPL_STAT',
+    17: 'ACL_DISCONN_CMPL_STAT',
+}
+
+# what the argument means, by event
+SPP_ARGS = {'DATA_IND': 'len', 'WRITE': 'len', 'CONG': 'cong'}
+GAP_ARGS = {'AUTH_CMPL': 'stat', 'DISC_STATE_CHANGED': 'state'}
+
+
+def records(data):
+    if len(data) % REC.size:
+        sys.exit('trace length %d is not a multiple of %d' % (len(data), REC.size))
+    for off in range(0, len(data), REC.size):
+        yield REC.unpack_from(data, off)
+
+
+def decode(data):
+    rows = []
+    first = prev = None
+    for us, src, event, arg in records(data):
+        if first is None:
+            first = prev = us
+        t = (us - first) & 0xFFFFFFFF  # ticks_us wraps at 32 bits
+        dt = (us - prev) & 0xFFFFFFFF
+        prev = us
+        if src == 0:
+            name = SPP_EVENTS.get(event, str(event))
+            what = SPP_ARGS.get(name, 'status')
+            rows.append((t, dt, 'SPP', name, what, arg))
+        else:
+            name = GAP_EVENTS.get(event, str(event))
+            what = GAP_ARGS.get(name, '')
+            rows.append((t, dt, 'GAP', name, what, arg))
+    return rows
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split('\n\n')[0].strip())
+    ap.add_argument('file', help='trace bytes saved from bts.trace() or btm.trace()')
+    ap.add_argument('--csv', action='store_true', help='comma separated output')
+    args = ap.parse_args()
+
+    with open(args.file, 'rb') as f:
+        rows = decode(f.read())
+
+    if args.csv:
+        print('t_us,dt_us,src,event,arg_name,arg')
+        for row in rows:
+            print('%d,%d,%s,%s,%s,%d' % row)
+        return
+    for t, dt, src, name, what, arg in rows:
+        extra = '%s=%d' % (what, arg) if what else ''
+        print('%10.3f ms  +%8d us  %s %-20s %s' % (t / 1000, dt, src, name, extra))
+
+
+if __name__ == '__main__':
+    main()